@@ -0,0 +1,270 @@
+/*
+ * admission.c
+ *  Admission control, shared by all workers: a limit on the pastes
+ *  received at once, a memory budget for their buffers, and load
+ *  shedding when pastes queue up before being stored.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "admission.h"
+
+#ifndef COSMOPOLITAN
+#include <limits.h>      /* for LLONG_MAX                                      */
+#include <stdio.h>       /* for NULL                                           */
+#include <string.h>      /* for strlen                                         */
+#include <sys/socket.h>  /* for send, MSG_DONTWAIT, MSG_NOSIGNAL               */
+#endif
+
+#include "feuille.h"     /* for Settings, settings                             */
+#include "metrics.h"     /* for metrics_count                                  */
+#include "util.h"        /* for error, monotonic_time, shared_alloc, verbose   */
+
+/* what a worker is doing (only written by that worker, on a cache line of its own) */
+typedef struct Usage {
+    long         uploads;     /* pastes being received or stored            */
+    long         memory;      /* bytes of their buffers                     */
+    char         pad[64 - 2 * sizeof(long)];
+} Usage;
+
+/* what all the workers decide together, followed by the usage of every worker */
+typedef struct State {
+    long long    window;      /* start of the current interval (microseconds) */
+    long long    lowest;      /* lowest queueing delay seen during it       */
+    int          overloaded;  /* whether new pastes are turned away         */
+    char         pad[64 - 2 * sizeof(long long) - sizeof(int)];
+
+    Usage        usages[];
+} State;
+
+static State   *state       = NULL;
+static int      usage_count = 0;
+
+/* usage of this worker, NULL if it isn't one */
+static Usage   *usage       = NULL;
+
+/* functions declarations */
+static  void     update(long long);
+static  long     total(int);
+
+/**
+ * Create the state of the workers, before any of them is forked.
+ *   count: the number of worker slots.
+ * -> 0 if done, -1 if not.
+ */
+int admission_initialize(int count)
+{
+    if ((state = shared_alloc(sizeof(State) + count * sizeof(Usage))) == NULL)
+        return -1;
+
+    state->lowest = LLONG_MAX;
+    usage_count   = count;
+    return 0;
+}
+
+/**
+ * Make this process count its pastes in the usage of a worker slot.
+ *   slot: the index of the worker slot.
+ */
+void admission_attach(int slot)
+{
+    if (state != NULL && slot < usage_count)
+        usage = &state->usages[slot];
+}
+
+/**
+ * Forget the usage of a worker that has died: the pastes it was receiving are gone with it.
+ *   slot: the index of the worker slot.
+ */
+void admission_clear(int slot)
+{
+    if (state == NULL || slot >= usage_count)
+        return;
+
+    __atomic_store_n(&state->usages[slot].uploads, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&state->usages[slot].memory, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Sum up the usage of all the workers.
+ *   memory: 1 for the bytes of their buffers, 0 for the pastes being received or stored.
+ * -> the sum.
+ */
+long total(int memory)
+{
+    long sum = 0;
+
+    for (int i = 0; i < usage_count; i++)
+        sum += memory ? __atomic_load_n(&state->usages[i].memory, __ATOMIC_RELAXED)
+                      : __atomic_load_n(&state->usages[i].uploads, __ATOMIC_RELAXED);
+
+    return sum;
+}
+
+/**
+ * Get the current time, if load is shed by queueing delay (the clock isn't read otherwise).
+ * -> the time elapsed since an arbitrary point in microseconds, or 0.
+ */
+long long admission_now(void)
+{
+    if (state == NULL || settings.queue_delay == 0)
+        return 0;
+
+    return monotonic_time();
+}
+
+/**
+ * Decide whether load should be shed, once per interval (by whichever worker gets there first).
+ * Like CoDel, only the lowest delay of an interval counts: a burst doesn't shed load, a standing queue does.
+ *   time: the current time.
+ */
+void update(long long time)
+{
+    long long window = __atomic_load_n(&state->window, __ATOMIC_RELAXED);
+
+    if (time - window < ADMISSION_INTERVAL * 1000LL)
+        return;
+
+    if (!__atomic_compare_exchange_n(&state->window, &window, time, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+
+    long long lowest = __atomic_exchange_n(&state->lowest, LLONG_MAX, __ATOMIC_RELAXED);
+
+    /* no paste has been stored during the interval: let new ones in, they'll tell */
+    int overloaded = lowest != LLONG_MAX && lowest > settings.queue_delay * 1000LL;
+
+    if (overloaded != __atomic_load_n(&state->overloaded, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&state->overloaded, overloaded, __ATOMIC_RELAXED);
+
+        if (overloaded)
+            error("pastes wait %.1fms to be stored, shedding load.", lowest / 1000.0);
+        else
+            verbose(1, "pastes are stored in time again, not shedding load anymore.");
+    }
+}
+
+/**
+ * Let a new paste in, if there's room for it.
+ * -> 1 if it can be received (admission_leave has to be called once it's done), 0 if not.
+ */
+int admission_enter(void)
+{
+    if (usage == NULL)
+        return 1;
+
+    if (settings.queue_delay > 0) {
+        update(admission_now());
+
+        if (__atomic_load_n(&state->overloaded, __ATOMIC_RELAXED))
+            return 0;
+    }
+
+    if (settings.memory_budget > 0 && (unsigned long)total(1) >= settings.memory_budget)
+        return 0;
+
+    /* counted first, so that two workers can't both take the last place */
+    __atomic_fetch_add(&usage->uploads, 1, __ATOMIC_SEQ_CST);
+
+    if (settings.max_uploads > 0 && (unsigned long)total(0) > settings.max_uploads) {
+        __atomic_fetch_sub(&usage->uploads, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Make room for a new paste, once one is done.
+ */
+void admission_leave(void)
+{
+    if (usage != NULL)
+        __atomic_fetch_sub(&usage->uploads, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Turn a client away, without waiting for anything.
+ *   connection: the socket associated with the connection.
+ * -> the number of bytes sent, or -1 if an error occured.
+ */
+int admission_reject(int connection)
+{
+    metrics_count(COUNTER_SHED, 1);
+
+    return send(connection, ADMISSION_ERROR, strlen(ADMISSION_ERROR), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/**
+ * Count memory used by a paste against the budget.
+ *   size: the number of bytes.
+ *   force: whether to count it even if it's over the budget.
+ * -> 0 if done, -1 if it's over the budget.
+ */
+int admission_reserve(unsigned long size, int force)
+{
+    if (usage == NULL)
+        return 0;
+
+    __atomic_fetch_add(&usage->memory, size, __ATOMIC_SEQ_CST);
+
+    if (!force && settings.memory_budget > 0 && (unsigned long)total(1) > settings.memory_budget) {
+        __atomic_fetch_sub(&usage->memory, size, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Give memory used by a paste back to the budget.
+ *   size: the number of bytes.
+ */
+void admission_release(unsigned long size)
+{
+    if (usage != NULL)
+        __atomic_fetch_sub(&usage->memory, size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Record how long a paste has waited between being received and being stored.
+ *   received: when it was received (see admission_now).
+ */
+void admission_delay(long long received)
+{
+    if (state == NULL || settings.queue_delay == 0 || received == 0)
+        return;
+
+    long long time   = admission_now();
+    long long delay  = time - received;
+    long long lowest = __atomic_load_n(&state->lowest, __ATOMIC_RELAXED);
+
+    while (delay < lowest && !__atomic_compare_exchange_n(&state->lowest, &lowest, delay, 0,
+                                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    update(time);
+}
+
+/**
+ * Get what all the workers are doing.
+ *   uploads: set to the number of pastes being received or stored.
+ *   memory: set to the bytes of their buffers.
+ * -> 1 if load is being shed, 0 if not, or -1 if admission control is disabled.
+ */
+int admission_read(long *uploads, long *memory)
+{
+    if (state == NULL)
+        return -1;
+
+    *uploads = total(0);
+    *memory  = total(1);
+
+    return __atomic_load_n(&state->overloaded, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,41 @@
+/*
+ * admission.h
+ *  admission.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+/* clients are told so when feuille sheds load */
+#define ADMISSION_ERROR "Server too busy.\nPlease try again later.\n"
+
+/* ... and HTTP clients when to try again (seconds) */
+#define ADMISSION_RETRY "1"
+
+/* how long the queueing delay has to stay above its target before load is shed (milliseconds) */
+#define ADMISSION_INTERVAL 100
+
+int          admission_initialize(int);
+void         admission_attach(int);
+void         admission_clear(int);
+
+int          admission_enter(void);
+void         admission_leave(void);
+int          admission_reject(int);
+
+int          admission_reserve(unsigned long, int);
+void         admission_release(unsigned long);
+
+long long    admission_now(void);
+void         admission_delay(long long);
+
+int          admission_read(long *, long *);
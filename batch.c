@@ -0,0 +1,306 @@
+/*
+ * batch.c
+ *  Batch uploads, received on the paste socket (several pastes on a
+ *  single connection, each one after its length).
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "batch.h"
+
+#ifndef COSMOPOLITAN
+#include <errno.h>       /* for errno, EFBIG, ENOENT, EPROTO               */
+#include <stdlib.h>      /* for calloc                                     */
+#include <string.h>      /* for memcmp, memmove                            */
+#include <sys/socket.h>  /* for recv                                       */
+#include <time.h>        /* for time                                       */
+#endif
+
+#include "admission.h"   /* for admission_delay                            */
+#include "feuille.h"     /* for Settings, settings                         */
+#include "paste.h"       /* for Paste, paste_write                         */
+
+/* functions declarations */
+static  int      filter(Paste *, char *, unsigned long);
+
+/**
+ * Check whether the first bytes received on a connection are those of a batch upload.
+ *   data: the bytes in question.
+ *   size: the number of bytes.
+ * -> the kind of batch upload (see BatchMode), BATCH_NONE if they aren't.
+ */
+int batch_match(char *data, unsigned long size)
+{
+    if (size >= sizeof(BATCH_MAGIC) - 1 && memcmp(data, BATCH_MAGIC, sizeof(BATCH_MAGIC) - 1) == 0)
+        return BATCH_ONCE;
+
+    if (size >= sizeof(BATCH_KEEPALIVE) - 1 && memcmp(data, BATCH_KEEPALIVE, sizeof(BATCH_KEEPALIVE) - 1) == 0)
+        return BATCH_PERSISTENT;
+
+    return BATCH_NONE;
+}
+
+/**
+ * Start handling a paste as a batch upload.
+ *   paste: the paste in question (received in memory, see paste_open).
+ *   mode: the kind of batch upload (see batch_match).
+ * -> 0 if done, -1 if not.
+ */
+int batch_open(Paste *paste, int mode)
+{
+    if ((paste->batch = calloc(1, sizeof(Batch))) == NULL)
+        return -1;
+
+    /* without an idle timeout, persistent connections are plain batches */
+    paste->batch->state      = BATCH_START;
+    paste->batch->persistent = mode == BATCH_PERSISTENT && settings.idle_timeout > 0;
+
+    return 0;
+}
+
+/**
+ * Add data received from a batch upload to its paste: lengths are parsed, and the pastes are kept one after the other.
+ *   paste: the paste in question.
+ *   data: the data in question.
+ *   size: the size of the data.
+ * -> 0 if done, -1 if not (errno is EPROTO if the batch is malformed, EFBIG if it's too big).
+ */
+int batch_filter(Paste *paste, char *data, unsigned long size)
+{
+    if (filter(paste, data, size) == 0)
+        return 0;
+
+    /* the pastes received along with the error aren't stored (nor is the connection kept) */
+    paste->batch->count = 0;
+    return -1;
+}
+
+/**
+ * Parse data received from a batch upload, see batch_filter.
+ *   paste: the paste in question.
+ *   data: the data in question.
+ *   size: the size of the data.
+ * -> 0 if done, -1 if not.
+ */
+int filter(Paste *paste, char *data, unsigned long size)
+{
+    Batch         *batch = paste->batch;
+    unsigned long  i     = 0;
+
+    /* anything after the end of the batch is ignored */
+    while (i < size && batch->state != BATCH_DONE) {
+        /* the first line has already been matched */
+        if (batch->state == BATCH_START) {
+            if (data[i++] == '\n') {
+                batch->state = BATCH_LENGTH;
+                batch->idle  = time(NULL);
+            }
+
+            continue;
+        }
+
+        if (batch->state == BATCH_LENGTH) {
+            char c = data[i++];
+
+            /* as output by wc -c on some systems */
+            if ((c == ' ' || c == '\t') && batch->digits == 0)
+                continue;
+
+            if (c >= '0' && c <= '9' && batch->digits < 19) {
+                batch->length = batch->length * 10 + c - '0';
+                batch->digits++;
+                continue;
+            }
+
+            if (c != '\n' || batch->digits == 0) {
+                errno = EPROTO;
+                return -1;
+            }
+
+            /* a length of 0 ends the batch */
+            if (batch->length == 0) {
+                batch->state = BATCH_DONE;
+                break;
+            }
+
+            if (batch->count == BATCH_MAX_PASTES) {
+                errno = EPROTO;
+                return -1;
+            }
+
+            /* no need to receive what won't be stored */
+            if (paste->size + batch->length >= settings.max_size) {
+                errno = EFBIG;
+                return -1;
+            }
+
+            batch->state     = BATCH_BODY;
+            batch->remaining = batch->length;
+            batch->start     = paste->size;
+            batch->length    = 0;
+            batch->digits    = 0;
+            continue;
+        }
+
+        /* the pastes are moved within the buffer, never past the data still to be parsed */
+        unsigned long end = size - i < batch->remaining ? size : i + batch->remaining;
+
+        if (paste_write(paste, data + i, end - i) != 0)
+            return -1;
+
+        batch->last       = data[end - 1];
+        batch->remaining -= end - i;
+        i                 = end;
+
+        if (batch->remaining > 0)
+            continue;
+
+        /* every paste ends with a newline, like the others */
+        if (batch->last != '\n' && paste_write(paste, "\n", 1) != 0)
+            return -1;
+
+        batch->sizes[batch->count++] = paste->size - batch->start;
+        batch->state                 = BATCH_LENGTH;
+        batch->idle                  = time(NULL);
+    }
+
+    return 0;
+}
+
+/**
+ * Receive the data available for a batch upload.
+ *   paste: the paste in question.
+ *   connection: the socket associated with the connection.
+ * -> the number of bytes received, 0 once the end of the batch has been received, or -1 if an error occured.
+ */
+long batch_receive(Paste *paste, int connection)
+{
+    /* the batch is over (or has pastes to store), there's no EOF to wait for */
+    if (batch_done(paste))
+        return 0;
+
+    long size;
+    if ((size = recv(connection, paste->batch->chunk, sizeof(paste->batch->chunk), 0)) <= 0)
+        return size;
+
+    if (batch_filter(paste, paste->batch->chunk, size) != 0)
+        return -1;
+
+    return batch_done(paste) ? 0 : size;
+}
+
+/**
+ * Check whether a paste is a batch upload whose end has been received, or a persistent connection with pastes to store.
+ *   paste: the paste in question.
+ * -> 1 if it is, 0 if not.
+ */
+int batch_done(Paste *paste)
+{
+    Batch *batch = paste->batch;
+
+    return batch != NULL && (batch->state == BATCH_DONE || (batch->persistent && batch->count > 0));
+}
+
+/**
+ * Check that a batch upload is complete, once the connection is over.
+ * The length 0 can be left out: the connection ending between two pastes ends the batch too.
+ *   paste: the paste in question.
+ * -> 0 if it is, -1 if not (errno is ENOENT if it's empty, EPROTO if a paste is incomplete).
+ */
+int batch_finish(Paste *paste)
+{
+    Batch *batch = paste->batch;
+
+    /* the paste being received on a persistent connection is stored along with the next ones */
+    if (batch->persistent && batch->count > 0)
+        return 0;
+
+    if (batch->state != BATCH_DONE && (batch->state != BATCH_LENGTH || batch->digits != 0)) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (batch->count == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * End a persistent connection early: the pastes received so far are still stored, but it's closed afterwards.
+ *   paste: the paste in question (nothing is done if it isn't a persistent connection).
+ */
+void batch_end(Paste *paste)
+{
+    if (paste->batch != NULL && paste->batch->persistent && paste->batch->count > 0)
+        paste->batch->state = BATCH_DONE;
+}
+
+/**
+ * Check whether a persistent connection is waiting for its next paste, for less than the idle timeout.
+ *   paste: the paste in question.
+ * -> 1 if it is, 0 if not.
+ */
+int batch_idle(Paste *paste)
+{
+    Batch *batch = paste->batch;
+
+    if (batch == NULL || !batch->persistent || batch->state != BATCH_LENGTH || batch->digits != 0 || batch->count != 0)
+        return 0;
+
+    return time(NULL) - batch->idle < (time_t)settings.idle_timeout;
+}
+
+/**
+ * Check whether a persistent connection has ended between two pastes, with nothing left to store (or to respond).
+ *   paste: the paste in question.
+ * -> 1 if it has, 0 if not.
+ */
+int batch_over(Paste *paste)
+{
+    Batch *batch = paste->batch;
+
+    if (batch == NULL || !batch->persistent || batch->count != 0)
+        return 0;
+
+    return batch->state == BATCH_DONE || (batch->state == BATCH_LENGTH && batch->digits == 0);
+}
+
+/**
+ * Get a persistent connection ready for its next pastes, once the current ones have been stored.
+ * They're dropped from the buffer, and the paste being received (if any) is moved to its start.
+ *   paste: the paste in question.
+ * -> 1 if the connection goes on, 0 if it has to be closed.
+ */
+int batch_next(Paste *paste)
+{
+    Batch *batch = paste->batch;
+
+    if (batch == NULL || !batch->persistent || batch->count == 0 || batch->state == BATCH_DONE)
+        return 0;
+
+    unsigned long stored = batch->state == BATCH_BODY ? batch->start : paste->size;
+    memmove(paste->buffer, paste->buffer + stored, paste->size - stored);
+
+    paste->size    -= stored;
+    batch->start    = 0;
+    batch->charged  = paste->size;
+    batch->stored  += batch->count;
+    batch->count    = 0;
+
+    /* each round of pastes has its own queueing delay */
+    admission_delay(paste->received);
+    paste->received = 0;
+
+    return 1;
+}
@@ -0,0 +1,83 @@
+/*
+ * batch.h
+ *  batch.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#ifndef COSMOPOLITAN
+#include <time.h>  /* for time_t */
+#endif
+
+#include "feuille.h"
+#include "paste.h"
+
+/* what a batch upload starts with */
+#define BATCH_MAGIC         "FEUILLE-BATCH/1\n"
+
+/* ... and a persistent connection, whose pastes are stored as they come */
+#define BATCH_KEEPALIVE     "FEUILLE-KEEPALIVE/1\n"
+
+/* maximum number of pastes in a batch */
+#define BATCH_MAX_PASTES    256
+
+/* size of the chunks received once a batch upload has been recognized */
+#define BATCH_CHUNK_SIZE    16384
+
+/* kinds of batch uploads */
+enum BatchMode {
+    BATCH_NONE,
+    BATCH_ONCE,         /* stored once the whole batch is received    */
+    BATCH_PERSISTENT    /* stored as they come, see batch_next        */
+};
+
+/* where a batch upload is at */
+enum BatchState {
+    BATCH_START,    /* skipping the first line                    */
+    BATCH_LENGTH,   /* reading the length of the next paste       */
+    BATCH_BODY,     /* reading a paste                            */
+    BATCH_DONE      /* the length 0 has been received             */
+};
+
+/* several pastes, received on a single connection: each one is its length, a newline, then its content */
+typedef struct Batch {
+    char             state;
+    char             last;        /* last byte of the paste being received         */
+    char             persistent;
+
+    unsigned long    length;      /* length being read                            */
+    unsigned long    digits;      /* ... and its number of digits so far          */
+    unsigned long    remaining;   /* bytes of the paste being received left       */
+    unsigned long    start;       /* where it starts in the buffer of the batch   */
+
+    /* the pastes follow each other in the buffer of the batch */
+    unsigned long    count;
+    unsigned long    sizes[BATCH_MAX_PASTES];
+
+    /* persistent connections */
+    unsigned long    stored;      /* pastes stored before the current ones        */
+    unsigned long    charged;     /* bytes of the buffer already rate limited     */
+    time_t           idle;        /* when the last paste was received             */
+
+    char             chunk[BATCH_CHUNK_SIZE];
+} Batch;
+
+int      batch_match(char *, unsigned long);
+int      batch_open(Paste *, int);
+int      batch_filter(Paste *, char *, unsigned long);
+long     batch_receive(Paste *, int);
+int      batch_done(Paste *);
+int      batch_finish(Paste *);
+
+void     batch_end(Paste *);
+int      batch_idle(Paste *);
+int      batch_over(Paste *);
+int      batch_next(Paste *);
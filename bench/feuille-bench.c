@@ -0,0 +1,1035 @@
+/*
+ * bench/feuille-bench.c
+ *  Load generator for a running feuille: sends pastes over many
+ *  connections at once, checks the URLs it gets back and reports the
+ *  throughput and latency.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>       /* for errno, ERANGE, EAGAIN, EINPROGRESS, EINTR      */
+#include <fcntl.h>       /* for fcntl, F_GETFL, F_SETFL, O_NONBLOCK            */
+#include <math.h>        /* for log                                            */
+#include <netdb.h>       /* for getaddrinfo, freeaddrinfo, addrinfo            */
+#include <poll.h>        /* for poll, pollfd, POLLIN, POLLOUT                  */
+#include <signal.h>      /* for signal, SIGPIPE, SIG_IGN                       */
+#include <stdarg.h>      /* for va_list, va_start, va_end                      */
+#include <stdio.h>       /* for printf, fprintf, snprintf, vfprintf, NULL      */
+#include <stdlib.h>      /* for calloc, exit, free, malloc, qsort, rand, re... */
+#include <string.h>      /* for memcmp, memcpy, memmem, strchr, strcmp, str... */
+#include <sys/socket.h>  /* for connect, getsockopt, recv, send, shutdown, ... */
+#include <time.h>        /* for clock_gettime, time, timespec, CLOCK_MONOTONIC */
+#include <unistd.h>      /* for close                                          */
+
+#include "arg.h"         /* for EARGF, ARGBEGIN, ARGEND                        */
+
+/* bytes sent at once by slow senders */
+#define SLOW_CHUNK       64
+
+/* size of the response kept for each paste (URLs are short) */
+#define RESPONSE_SIZE    512
+
+/* size of the sequence number that starts every paste, so that no two of them are the same */
+#define HEADER_SIZE      24
+
+/* most size distributions given with -s */
+#define MAX_SIZES        16
+
+/* most kinds of rejection reported */
+#define MAX_REJECTIONS   16
+
+/* size distributions */
+enum Distribution {
+    DISTRIBUTION_FIXED,        /* N         */
+    DISTRIBUTION_UNIFORM,      /* MIN-MAX   */
+    DISTRIBUTION_EXPONENTIAL   /* ~MEAN     */
+};
+
+/* what a client does */
+enum Kind {
+    KIND_NORMAL,   /* sends its paste at once           */
+    KIND_SLOW,     /* sends its paste a bit at a time   */
+    KIND_IDLE      /* connects and never sends anything */
+};
+
+/* where a client is at */
+enum State {
+    STATE_CLOSED,
+    STATE_CONNECTING,
+    STATE_SENDING,
+    STATE_WAITING
+};
+
+typedef struct Size {
+    char             distribution;
+    unsigned long    min;
+    unsigned long    max;
+} Size;
+
+/* a connection to feuille, sending one paste after the other */
+typedef struct Client {
+    int              fd;
+    char             kind;
+    char             state;
+
+    unsigned long    sequence;
+    char             header[HEADER_SIZE];
+    unsigned long    header_size;
+    unsigned long    offset;        /* of the rest of the paste, in the pool */
+    unsigned long    size;          /* of the whole paste                    */
+    unsigned long    sent;
+
+    long long        started;       /* microseconds, monotonic clock         */
+    long long        next_send;
+
+    char             response[RESPONSE_SIZE];
+    unsigned long    response_size;
+} Client;
+
+/* a paste that has been stored */
+typedef struct Sample {
+    long long        latency;       /* microseconds */
+    char             kind;
+
+    unsigned long    sequence;
+    unsigned long    offset;
+    unsigned long    size;
+
+    char            *id;
+} Sample;
+
+/* settings */
+static struct {
+    char            *address;
+    char            *port;
+    char            *url;
+    char            *http_port;
+
+    unsigned int     connections;
+    unsigned int     idle;
+    unsigned long    requests;
+    unsigned long    duration;      /* seconds      */
+    unsigned int     slow;          /* percent      */
+    unsigned long    interval;      /* milliseconds */
+
+    Size             sizes[MAX_SIZES];
+    int              size_count;
+} settings = {
+    .address     = "127.0.0.1",
+    .port        = "9999",
+    .url         = "http://localhost",
+    .http_port   = NULL,
+
+    .connections = 16,
+    .idle        = 0,
+    .requests    = 10000,
+    .duration    = 0,
+    .slow        = 0,
+    .interval    = 100,
+
+    .sizes       = { { DISTRIBUTION_FIXED, 1024, 1024 } },
+    .size_count  = 1
+};
+
+char *argv0;
+
+static struct sockaddr_storage   address;
+static socklen_t                 address_size;
+
+/* random text the pastes are cut from */
+static char            *pool      = NULL;
+static unsigned long    pool_size = 0;
+
+static Sample          *samples      = NULL;
+static unsigned long    sample_count = 0;
+static unsigned long    sample_cap   = 0;
+
+/* results */
+static unsigned long    issued     = 0;
+static unsigned long    failed     = 0;   /* the connection broke             */
+static unsigned long    rejected   = 0;   /* feuille answered an error        */
+static unsigned long    wrong      = 0;   /* the URL isn't what it should be  */
+static unsigned long    dropped    = 0;   /* idle clients closed by feuille   */
+static unsigned long    received   = 0;   /* bytes of the stored pastes       */
+
+static struct {
+    char            *response;
+    unsigned long    count;
+} rejections[MAX_REJECTIONS];
+
+/* functions declarations */
+static  void         usage(int);
+static  void         die(int, char *, ...);
+static  long long    now(void);
+static  unsigned long parse_number(char *, char **);
+static  void         parse_sizes(char *);
+static  unsigned long pick_size(void);
+static  void         fill_pool(unsigned long);
+static  int          resolve(char *, char *, struct sockaddr_storage *, socklen_t *);
+
+static  void         client_start(Client *, int);
+static  void         client_close(Client *);
+static  void         client_connected(Client *);
+static  void         client_send(Client *);
+static  void         client_receive(Client *);
+static  void         client_finish(Client *);
+
+static  void         record_rejection(char *);
+static  int          check_url(char *, unsigned long, char **);
+static  unsigned long expected_paste(Sample *, char **);
+static  long         fetch_paste(int, char *, char **);
+static  unsigned long verify_pastes(unsigned long *);
+static  int          compare_latencies(const void *, const void *);
+static  int          compare_ids(const void *, const void *);
+static  void         report_latencies(char *, int, unsigned long, long long);
+
+/**
+ * Display the usage of the load generator.
+ *   exit_code: the exit code to be used.
+ */
+void usage(int exit_code)
+{
+    die(exit_code, "usage: %s [-a address] [-p port] [-c connections] [-n requests] [-d seconds]\n"
+                   "       [-s sizes] [-l percent] [-i milliseconds] [-I clients] [-U url] [-g port]\n"
+                   "  -s takes a comma-separated list of sizes, each of them picked as often:\n"
+                   "     N (fixed), MIN-MAX (uniform) or ~MEAN (exponential), with an optional k or m.\n", argv0);
+}
+
+/**
+ * Print an error message and exit.
+ *   code: the exit code.
+ *   format: the format string, as with printf.
+ */
+void die(int code, char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+
+    exit(code);
+}
+
+/**
+ * Get the current time.
+ * -> the time elapsed since an arbitrary point, in microseconds.
+ */
+long long now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Parse a number of bytes, with an optional k (KiB) or m (MiB) suffix.
+ *   string: the string in question.
+ *   end: where to store the end of the number.
+ * -> the number of bytes.
+ */
+unsigned long parse_number(char *string, char **end)
+{
+    errno = 0;
+    long long number = strtoll(string, end, 10);
+
+    if (*end == string || number < 0 || errno == ERANGE)
+        die(ERANGE, "invalid size `%s'.\n", string);
+
+    if (**end == 'k' || **end == 'K') {
+        number *= 1024;
+        (*end)++;
+    } else if (**end == 'm' || **end == 'M') {
+        number *= 1024 * 1024;
+        (*end)++;
+    }
+
+    return number;
+}
+
+/**
+ * Parse the size distributions of the pastes.
+ *   string: the comma-separated list of distributions.
+ */
+void parse_sizes(char *string)
+{
+    settings.size_count = 0;
+
+    char *end = string;
+    do {
+        if (settings.size_count == MAX_SIZES)
+            die(1, "too many sizes (maximum: %d).\n", MAX_SIZES);
+
+        Size *size = &settings.sizes[settings.size_count++];
+        char *item = end + (end != string);
+
+        if (*item == '~') {
+            size->distribution = DISTRIBUTION_EXPONENTIAL;
+            size->min          = parse_number(item + 1, &end);
+            size->max          = size->min * 16;
+        } else {
+            size->distribution = DISTRIBUTION_FIXED;
+            size->min          = parse_number(item, &end);
+            size->max          = size->min;
+
+            if (*end == '-') {
+                size->distribution = DISTRIBUTION_UNIFORM;
+                size->max          = parse_number(end + 1, &end);
+            }
+        }
+
+        if (size->min == 0 || size->max < size->min || (*end != ',' && *end != 0))
+            die(1, "invalid size `%s'.\n", item);
+
+    } while (*end == ',');
+}
+
+/**
+ * Pick the size of a paste.
+ * -> the size in question.
+ */
+unsigned long pick_size(void)
+{
+    Size *size = &settings.sizes[rand() % settings.size_count];
+
+    switch (size->distribution) {
+    case DISTRIBUTION_UNIFORM:
+        return size->min + (unsigned long)rand() % (size->max - size->min + 1);
+
+    case DISTRIBUTION_EXPONENTIAL: {
+        double u      = (rand() + 1.0) / (RAND_MAX + 2.0);
+        double picked = -log(u) * size->min;
+
+        return picked < 1 ? 1 : picked > size->max ? size->max : (unsigned long)picked;
+    }
+
+    default:
+        return size->min;
+    }
+}
+
+/**
+ * Fill the pool with random lines of text, twice as big as the biggest paste (pastes start anywhere in it).
+ *   max: the size of the biggest paste.
+ */
+void fill_pool(unsigned long max)
+{
+    pool_size = max * 2 + 1;
+
+    if ((pool = malloc(pool_size)) == NULL)
+        die(errno, "could not allocate the pastes: %s.\n", strerror(errno));
+
+    for (unsigned long i = 0; i < pool_size; i++)
+        pool[i] = rand() % 64 == 0 ? '\n' : 'a' + rand() % 26;
+}
+
+/**
+ * Resolve an address and a port.
+ *   host: the address in question.
+ *   port: the port in question.
+ *   result: where to store the address.
+ *   size: where to store its size.
+ * -> 0 if done, -1 if not.
+ */
+int resolve(char *host, char *port, struct sockaddr_storage *result, socklen_t *size)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *info;
+
+    if (getaddrinfo(host, port, &hints, &info) != 0)
+        return -1;
+
+    memcpy(result, info->ai_addr, info->ai_addrlen);
+    *size = info->ai_addrlen;
+
+    freeaddrinfo(info);
+    return 0;
+}
+
+/**
+ * Open a new connection, and pick the paste it sends.
+ *   client: the client in question.
+ *   kind: what the client does.
+ */
+void client_start(Client *client, int kind)
+{
+    client->kind          = kind;
+    client->state         = STATE_CONNECTING;
+    client->sent          = 0;
+    client->response_size = 0;
+    client->started       = now();
+    client->next_send     = 0;
+
+    if (kind != KIND_IDLE) {
+        client->sequence    = issued++;
+        client->header_size = snprintf(client->header, sizeof(client->header), "%lu\n", client->sequence);
+
+        unsigned long size = pick_size();
+        client->size   = size > client->header_size ? size : client->header_size;
+        client->offset = (unsigned long)rand() % (pool_size - (client->size - client->header_size));
+    }
+
+    if ((client->fd = socket(address.ss_family, SOCK_STREAM, 0)) == -1
+     || fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) | O_NONBLOCK) == -1) {
+        client_close(client);
+        failed++;
+        return;
+    }
+
+    if (connect(client->fd, (struct sockaddr *)&address, address_size) == -1 && errno != EINPROGRESS) {
+        client_close(client);
+        failed++;
+    }
+}
+
+/**
+ * Close the connection of a client.
+ *   client: the client in question.
+ */
+void client_close(Client *client)
+{
+    if (client->fd != -1)
+        close(client->fd);
+
+    client->fd    = -1;
+    client->state = STATE_CLOSED;
+}
+
+/**
+ * Start sending, once connected.
+ *   client: the client in question.
+ */
+void client_connected(Client *client)
+{
+    int error = 0;
+    socklen_t size = sizeof(error);
+
+    if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &size) == -1 || error != 0) {
+        client_close(client);
+
+        if (client->kind == KIND_IDLE)
+            dropped++;
+        else
+            failed++;
+
+        return;
+    }
+
+    /* idle clients wait for feuille to give up on them */
+    client->state = client->kind == KIND_IDLE ? STATE_WAITING : STATE_SENDING;
+
+    if (client->state == STATE_SENDING)
+        client_send(client);
+}
+
+/**
+ * Send as much of the paste as possible (or a chunk, for slow senders).
+ *   client: the client in question.
+ */
+void client_send(Client *client)
+{
+    while (client->sent < client->size) {
+        if (client->kind == KIND_SLOW && now() < client->next_send)
+            return;
+
+        char          *data;
+        unsigned long  length;
+
+        if (client->sent < client->header_size) {
+            data   = client->header + client->sent;
+            length = client->header_size - client->sent;
+        } else {
+            data   = pool + client->offset + (client->sent - client->header_size);
+            length = client->size - client->sent;
+        }
+
+        if (client->kind == KIND_SLOW && length > SLOW_CHUNK)
+            length = SLOW_CHUNK;
+
+        long size;
+        if ((size = send(client->fd, data, length, MSG_NOSIGNAL)) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return;
+
+            /* feuille may have answered already (e.g. the paste is too big) */
+            break;
+        }
+
+        client->sent += size;
+
+        if (client->kind == KIND_SLOW)
+            client->next_send = now() + settings.interval * 1000;
+    }
+
+    /* the end of the paste is the end of the connection */
+    shutdown(client->fd, SHUT_WR);
+    client->state = STATE_WAITING;
+}
+
+/**
+ * Read the response of feuille, and handle it once it's complete.
+ *   client: the client in question.
+ */
+void client_receive(Client *client)
+{
+    char buffer[RESPONSE_SIZE];
+
+    for (;;) {
+        long size = recv(client->fd, buffer, sizeof(buffer), 0);
+
+        if (size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return;
+
+        if (size <= 0) {
+            client_finish(client);
+            return;
+        }
+
+        /* only the start of the response is kept */
+        unsigned long kept = sizeof(client->response) - 1 - client->response_size;
+        if ((unsigned long)size < kept)
+            kept = size;
+
+        memcpy(client->response + client->response_size, buffer, kept);
+        client->response_size += kept;
+    }
+}
+
+/**
+ * Handle the response of feuille, then close the connection.
+ *   client: the client in question.
+ */
+void client_finish(Client *client)
+{
+    long long latency = now() - client->started;
+
+    client->response[client->response_size] = 0;
+    client_close(client);
+
+    if (client->kind == KIND_IDLE) {
+        dropped++;
+
+        if (client->response_size > 0)
+            record_rejection(client->response);
+
+        return;
+    }
+
+    if (client->response_size == 0) {
+        failed++;
+        return;
+    }
+
+    char *id;
+    if (check_url(client->response, client->response_size, &id) != 0) {
+        /* anything that doesn't look like a URL is an error message */
+        char *newline = strchr(client->response, '\n');
+        char *scheme  = strstr(client->response, "://");
+
+        if (scheme != NULL && (newline == NULL || scheme < newline))
+            wrong++;
+        else {
+            rejected++;
+            record_rejection(client->response);
+        }
+
+        return;
+    }
+
+    if (sample_count == sample_cap) {
+        void *tmp;
+        if ((tmp = realloc(samples, (sample_cap * 2 + 1024) * sizeof(Sample))) == NULL)
+            die(errno, "could not allocate the results: %s.\n", strerror(errno));
+
+        samples    = tmp;
+        sample_cap = sample_cap * 2 + 1024;
+    }
+
+    samples[sample_count++] = (Sample){
+        .latency  = latency,
+        .kind     = client->kind,
+        .sequence = client->sequence,
+        .offset   = client->offset,
+        .size     = client->size,
+        .id       = id
+    };
+
+    received += client->size;
+}
+
+/**
+ * Count an error message of feuille.
+ *   response: the message in question.
+ */
+void record_rejection(char *response)
+{
+    int i;
+    for (i = 0; i < MAX_REJECTIONS && rejections[i].response != NULL; i++)
+        if (strcmp(rejections[i].response, response) == 0)
+            break;
+
+    if (i == MAX_REJECTIONS)
+        return;
+
+    if (rejections[i].response == NULL && (rejections[i].response = strdup(response)) == NULL)
+        return;
+
+    rejections[i].count++;
+}
+
+/**
+ * Check that a response is a URL made of the base URL and an ID, as feuille makes them.
+ *   response: the response in question.
+ *   size: its size.
+ *   id: where to store a copy of the ID.
+ * -> 0 if it is, -1 if not.
+ */
+int check_url(char *response, unsigned long size, char **id)
+{
+    unsigned long prefix = strlen(settings.url);
+
+    if (size < prefix + 3 || strncmp(response, settings.url, prefix) != 0 || response[prefix] != '/'
+     || response[size - 1] != '\n')
+        return -1;
+
+    for (unsigned long i = prefix + 1; i < size - 1; i++)
+        if (!((response[i] >= 'a' && response[i] <= 'z') || (response[i] >= '0' && response[i] <= '9')))
+            return -1;
+
+    if ((*id = strndup(response + prefix + 1, size - prefix - 2)) == NULL)
+        die(errno, "could not allocate the results: %s.\n", strerror(errno));
+
+    return 0;
+}
+
+/**
+ * Rebuild a paste as feuille stores it (with a trailing newline).
+ *   sample: the paste in question.
+ *   paste: where to store it. Needs to be freed.
+ * -> its size.
+ */
+unsigned long expected_paste(Sample *sample, char **paste)
+{
+    char header[HEADER_SIZE];
+    unsigned long header_size = snprintf(header, sizeof(header), "%lu\n", sample->sequence);
+
+    if ((*paste = malloc(sample->size + 1)) == NULL)
+        die(errno, "could not allocate the pastes: %s.\n", strerror(errno));
+
+    memcpy(*paste, header, header_size);
+    memcpy(*paste + header_size, pool + sample->offset, sample->size - header_size);
+
+    unsigned long size = sample->size;
+    if ((*paste)[size - 1] != '\n')
+        (*paste)[size++] = '\n';
+
+    return size;
+}
+
+/**
+ * Get a paste from the HTTP server of feuille.
+ *   fd: a socket connected to it.
+ *   id: the ID of the paste.
+ *   body: where to store the paste. Needs to be freed.
+ * -> its size, or -1 if it couldn't be fetched.
+ */
+long fetch_paste(int fd, char *id, char **body)
+{
+    char request[256];
+    int  length = snprintf(request, sizeof(request), "GET /%s HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n", id);
+
+    if (send(fd, request, length, MSG_NOSIGNAL) != length)
+        return -1;
+
+    char          *response = NULL;
+    unsigned long  size     = 0;
+    unsigned long  cap      = 0;
+
+    for (;;) {
+        if (size == cap) {
+            void *tmp;
+            if ((tmp = realloc(response, cap * 2 + 4096)) == NULL) {
+                free(response);
+                return -1;
+            }
+
+            response = tmp;
+            cap      = cap * 2 + 4096;
+        }
+
+        long received = recv(fd, response + size, cap - size, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+
+        if (received <= 0)
+            break;
+
+        size += received;
+    }
+
+    char *start;
+    if (size < 12 || strncmp(response, "HTTP/1.1 200", 12) != 0
+     || (start = memmem(response, size, "\r\n\r\n", 4)) == NULL) {
+        free(response);
+        return -1;
+    }
+
+    start += 4;
+    size  -= start - response;
+
+    memmove(response, start, size);
+    *body = response;
+
+    return size;
+}
+
+/**
+ * Get every paste that has been stored back from the HTTP server of feuille, and compare it with what was sent.
+ *   mismatched: where to store the number of pastes that differ (or couldn't be fetched).
+ * -> the number of pastes verified.
+ */
+unsigned long verify_pastes(unsigned long *mismatched)
+{
+    struct sockaddr_storage http;
+    socklen_t               http_size;
+
+    if (resolve(settings.address, settings.http_port, &http, &http_size) != 0)
+        die(1, "could not resolve `%s' port %s.\n", settings.address, settings.http_port);
+
+    *mismatched = 0;
+
+    for (unsigned long i = 0; i < sample_count; i++) {
+        int fd;
+        if ((fd = socket(http.ss_family, SOCK_STREAM, 0)) == -1
+         || connect(fd, (struct sockaddr *)&http, http_size) == -1)
+            die(errno, "could not connect to the HTTP server of feuille: %s.\n", strerror(errno));
+
+        char *paste, *body;
+        unsigned long expected = expected_paste(&samples[i], &paste);
+        long          size     = fetch_paste(fd, samples[i].id, &body);
+
+        if (size < 0 || (unsigned long)size != expected || memcmp(body, paste, expected) != 0) {
+            fprintf(stderr, "paste `%s' isn't what was sent.\n", samples[i].id);
+            (*mismatched)++;
+        }
+
+        if (size >= 0)
+            free(body);
+
+        free(paste);
+        close(fd);
+    }
+
+    return sample_count;
+}
+
+/**
+ * Compare two samples by latency.
+ */
+int compare_latencies(const void *a, const void *b)
+{
+    long long left  = ((Sample *)a)->latency;
+    long long right = ((Sample *)b)->latency;
+
+    return (left > right) - (left < right);
+}
+
+/**
+ * Compare two samples by ID.
+ */
+int compare_ids(const void *a, const void *b)
+{
+    return strcmp(((Sample *)a)->id, ((Sample *)b)->id);
+}
+
+/**
+ * Print the latency percentiles of one kind of client. The samples need to be sorted by latency.
+ *   label: what to call these clients.
+ *   kind: the kind in question.
+ *   count: the number of samples of this kind.
+ *   elapsed: the duration of the run, in microseconds.
+ */
+void report_latencies(char *label, int kind, unsigned long count, long long elapsed)
+{
+    if (count == 0)
+        return;
+
+    long long *latencies;
+    if ((latencies = malloc(count * sizeof(long long))) == NULL)
+        die(errno, "could not allocate the results: %s.\n", strerror(errno));
+
+    unsigned long n = 0;
+    for (unsigned long i = 0; i < sample_count; i++)
+        if (samples[i].kind == kind)
+            latencies[n++] = samples[i].latency;
+
+    /* nearest rank */
+    double  percentiles[] = { 0.5, 0.99, 0.999 };
+    double  values[3];
+
+    for (int i = 0; i < 3; i++) {
+        unsigned long rank = (unsigned long)(percentiles[i] * count + 0.999999);
+        values[i] = latencies[rank > 0 ? rank - 1 : 0] / 1000.0;
+    }
+
+    printf("%-14s %lu requests (%.1f/s)\n", label, count, count * 1e6 / elapsed);
+    printf("%-14s min %.3fms, p50 %.3fms, p99 %.3fms, p999 %.3fms, max %.3fms\n", "  latency:",
+           latencies[0] / 1000.0, values[0], values[1], values[2], latencies[count - 1] / 1000.0);
+
+    free(latencies);
+}
+
+/**
+ * Load generator's main function.
+ *   argc: the argument count.
+ *   argv: the argument values.
+ * -> 0 if every paste was stored and its URL is right, 1 if not.
+ */
+int main(int argc, char *argv[])
+{
+    long long tmp;
+
+    ARGBEGIN {
+    case 'a':
+        settings.address = EARGF(usage(1));
+        break;
+
+    case 'c':
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp <= 0 || tmp > 65536 || errno == ERANGE)
+            die(ERANGE, "invalid number of connections.\n");
+
+        settings.connections = tmp;
+        break;
+
+    case 'd':
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp <= 0 || errno == ERANGE)
+            die(ERANGE, "invalid duration.\n");
+
+        settings.duration = tmp;
+        break;
+
+    case 'g':
+        settings.http_port = EARGF(usage(1));
+        break;
+
+    case 'h':
+        usage(0);
+        break;
+
+    case 'i':
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp < 0 || errno == ERANGE)
+            die(ERANGE, "invalid interval.\n");
+
+        settings.interval = tmp;
+        break;
+
+    case 'I':
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp < 0 || tmp > 65536 || errno == ERANGE)
+            die(ERANGE, "invalid number of idle clients.\n");
+
+        settings.idle = tmp;
+        break;
+
+    case 'l':
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp < 0 || tmp > 100 || errno == ERANGE)
+            die(ERANGE, "invalid percentage of slow senders.\n");
+
+        settings.slow = tmp;
+        break;
+
+    case 'n':
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp <= 0 || errno == ERANGE)
+            die(ERANGE, "invalid number of requests.\n");
+
+        settings.requests = tmp;
+        break;
+
+    case 'p':
+        settings.port = EARGF(usage(1));
+        break;
+
+    case 's':
+        parse_sizes(EARGF(usage(1)));
+        break;
+
+    case 'U':
+        settings.url = EARGF(usage(1));
+        break;
+
+    default:
+        usage(1);
+    } ARGEND;
+
+    if (argc != 0)
+        usage(1);
+
+    /* feuille closing a connection mustn't kill the load generator */
+    signal(SIGPIPE, SIG_IGN);
+    srand(time(0));
+
+    if (resolve(settings.address, settings.port, &address, &address_size) != 0)
+        die(1, "could not resolve `%s' port %s.\n", settings.address, settings.port);
+
+    unsigned long max = HEADER_SIZE;
+    for (int i = 0; i < settings.size_count; i++)
+        if (settings.sizes[i].max > max)
+            max = settings.sizes[i].max;
+
+    fill_pool(max);
+
+    unsigned int   count = settings.connections + settings.idle;
+    Client        *clients;
+    struct pollfd *fds;
+
+    if ((clients = calloc(count, sizeof(Client))) == NULL || (fds = calloc(count, sizeof(struct pollfd))) == NULL)
+        die(errno, "could not allocate the clients: %s.\n", strerror(errno));
+
+    for (unsigned int i = 0; i < count; i++)
+        clients[i].fd = -1;
+
+    long long start = now();
+    long long end   = settings.duration > 0 ? start + settings.duration * 1000000LL : 0;
+
+    for (;;) {
+        long long current = now();
+        int       running = end > 0 ? current < end : issued < settings.requests;
+        int       active  = 0;
+        long long wake    = -1;
+
+        /* keep every client busy, as long as there are pastes to send */
+        for (unsigned int i = 0; i < count; i++) {
+            Client *client = &clients[i];
+
+            if (client->state == STATE_CLOSED && running) {
+                if (i >= settings.connections)
+                    client_start(client, KIND_IDLE);
+                else
+                    client_start(client, (unsigned int)rand() % 100 < settings.slow ? KIND_SLOW : KIND_NORMAL);
+
+                running = end > 0 ? current < end : issued < settings.requests;
+            }
+
+            fds[i].fd     = client->fd;
+            fds[i].events = 0;
+
+            if (client->state == STATE_CLOSED)
+                continue;
+
+            if (client->kind != KIND_IDLE)
+                active++;
+
+            if (client->state == STATE_CONNECTING)
+                fds[i].events = POLLOUT;
+            else if (client->state == STATE_WAITING)
+                fds[i].events = POLLIN;
+            else if (client->next_send <= current)
+                fds[i].events = POLLOUT;
+            else if (wake == -1 || client->next_send < wake)
+                wake = client->next_send;
+        }
+
+        /* done once the last pastes have been answered (idle clients are then let go) */
+        if (active == 0 && !running)
+            break;
+
+        int timeout = wake == -1 ? 1000 : (int)((wake - current) / 1000) + 1;
+        if (end > 0 && running && (end - current) / 1000 + 1 < timeout)
+            timeout = (end - current) / 1000 + 1;
+
+        if (poll(fds, count, timeout) == -1) {
+            if (errno == EINTR)
+                continue;
+
+            die(errno, "could not wait for the connections: %s.\n", strerror(errno));
+        }
+
+        for (unsigned int i = 0; i < count; i++) {
+            Client *client = &clients[i];
+
+            if (client->state == STATE_CLOSED || fds[i].revents == 0)
+                continue;
+
+            if (client->state == STATE_CONNECTING)
+                client_connected(client);
+            else if (client->state == STATE_SENDING)
+                client_send(client);
+            else
+                client_receive(client);
+        }
+    }
+
+    long long elapsed = now() - start + 1;
+
+    for (unsigned int i = 0; i < count; i++)
+        client_close(&clients[i]);
+
+
+    /* two pastes mustn't get the same URL */
+    unsigned long duplicates = 0;
+    qsort(samples, sample_count, sizeof(Sample), compare_ids);
+
+    for (unsigned long i = 1; i < sample_count; i++)
+        if (strcmp(samples[i - 1].id, samples[i].id) == 0)
+            duplicates++;
+
+    unsigned long verified = 0, mismatched = 0;
+    if (settings.http_port != NULL)
+        verified = verify_pastes(&mismatched);
+
+    qsort(samples, sample_count, sizeof(Sample), compare_latencies);
+
+    unsigned long normal = 0, slow = 0;
+    for (unsigned long i = 0; i < sample_count; i++) {
+        if (samples[i].kind == KIND_SLOW)
+            slow++;
+        else
+            normal++;
+    }
+
+
+    /* report */
+    printf("%-14s %lu (%lu stored, %lu rejected, %lu failed, %lu wrong URLs, %lu duplicate URLs)\n", "requests:",
+           issued, sample_count, rejected, failed, wrong, duplicates);
+    printf("%-14s %.3fs\n", "duration:", elapsed / 1e6);
+    printf("%-14s %.1f requests/s, %.2f MiB/s\n", "throughput:",
+           sample_count * 1e6 / elapsed, received * 1e6 / elapsed / (1024 * 1024));
+
+    report_latencies("pastes:", KIND_NORMAL, normal, elapsed);
+    report_latencies("slow senders:", KIND_SLOW, slow, elapsed);
+
+    if (settings.idle > 0)
+        printf("%-14s %lu dropped by feuille\n", "idle clients:", dropped);
+
+    for (int i = 0; i < MAX_REJECTIONS && rejections[i].response != NULL; i++) {
+        char *newline = strchr(rejections[i].response, '\n');
+        int   length  = newline != NULL ? newline - rejections[i].response : (int)strlen(rejections[i].response);
+
+        printf("%-14s %lu `%.*s'\n", i == 0 ? "responses:" : "", rejections[i].count, length, rejections[i].response);
+    }
+
+    if (settings.http_port != NULL)
+        printf("%-14s %lu pastes (%lu mismatched)\n", "verified:", verified, mismatched);
+
+    return failed > 0 || wrong > 0 || duplicates > 0 || mismatched > 0;
+}
@@ -11,17 +11,36 @@
  * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
  */
 
+#define _DEFAULT_SOURCE
+
 #include "bin.h"
 
 #ifndef COSMOPOLITAN
-#include <errno.h>    /* for errno                                      */
-#include <stdio.h>    /* for NULL, fclose, fopen, fputs, snprintf, FILE */
-#include <stdlib.h>   /* for calloc, free, malloc, rand, realloc        */
-#include <string.h>   /* for strlen                                     */
-#include <unistd.h>   /* for access, F_OK                               */
+#include <dirent.h>      /* for opendir, readdir, closedir, DIR, dirent, D... */
+#include <errno.h>       /* for errno, EEXIST, EFBIG, ENAMETOOLONG, ENOENT   */
+#include <fcntl.h>       /* for open, O_CREAT, O_EXCL, O_WRONLY              */
+#include <stdio.h>       /* for NULL, snprintf                               */
+#include <stdlib.h>      /* for calloc, free, malloc, rand, realloc          */
+#include <string.h>      /* for memcpy, strchr, strcmp, strcpy, strdup, s... */
+#include <sys/stat.h>    /* for mkdir, stat, S_ISDIR                         */
+#include <unistd.h>      /* for access, close, link, rmdir, unlink, write... */
 #endif
 
-#include "feuille.h"  /* for Settings, settings                         */
+#include "batch.h"       /* for Batch                                        */
+#include "cache.h"       /* for cache_add, cache_remove                      */
+#include "compress.h"    /* for compress_add, COMPRESSED_SUFFIX, HAVE_ZLIB   */
+#include "dedup.h"       /* for dedup_find, dedup_record                     */
+#include "durability.h"  /* for durability_file, durability_add              */
+#include "expiry.h"      /* for expiry_add, expiry_renew                     */
+#include "feuille.h"     /* for Settings, settings                           */
+#include "index.h"       /* for index_claim, index_release                   */
+#include "metrics.h"     /* for metrics_count, metrics_now, metrics_time     */
+#include "pack.h"        /* for pack_claim, pack_release, pack_exists, pa... */
+#include "paste.h"       /* for Paste                                        */
+#include "util.h"        /* for verbose, error, hash_bytes, HASH_INIT        */
+
+/* maximum number of IDs tried for a single paste */
+#define MAX_ATTEMPTS 8
 
 /* symbols used to generate IDs */
 static char *id_symbols = "abcdefghijklmnopqrstuvwxyz0123456789";
@@ -52,7 +71,9 @@ char *generate_id(int min_length)
         buffer[i + 1] = 0;
 
         /* collision? */
-        if (i == length - 1 && paste_exists(buffer)) {
+        if (i == length - 1 && !claim_id(buffer)) {
+            metrics_count(COUNTER_COLLISIONS, 1);
+
             /* add one to the ID length and re-allocate the buffer */
             length++;
 
@@ -70,13 +91,133 @@ char *generate_id(int min_length)
 }
 
 /**
- * Check if an ID is already used.
+ * Claim an ID, so that no other worker can use it.
+ *   id: the ID in question.
+ * -> 1 if claimed, 0 if already used.
+ */
+int claim_id(char *id)
+{
+    /* the packs have no other index to fall back on */
+    if (settings.storage == STORAGE_PACK)
+        return pack_claim(id) == 1;
+
+    /* the shared index answers without touching the disk */
+    int claimed;
+    if ((claimed = index_claim(id)) != -1)
+        return claimed;
+
+    return !paste_exists(id);
+}
+
+/**
+ * Check if an ID is already used on disk.
  *   id: the ID in question.
  * -> 1 if exists, 0 if not.
  */
 int paste_exists(char *id)
 {
-    return access(id, F_OK) == 0;
+    if (settings.storage == STORAGE_PACK)
+        return pack_exists(id);
+
+    char path[PASTE_PATH_SIZE + sizeof(COMPRESSED_SUFFIX)];
+    if (paste_path(id, path, PASTE_PATH_SIZE) != 0)
+        return 0;
+
+    if (access(path, F_OK) == 0)
+        return 1;
+
+    /* the paste could only be stored compressed */
+    strcat(path, COMPRESSED_SUFFIX);
+    return access(path, F_OK) == 0;
+}
+
+/**
+ * Get the path of a paste, depending on the storage layout.
+ * Every level of fan-out uses the next two characters of the ID, e.g. `ab/cd/abcd1234' with two levels.
+ *   id: the ID of the paste.
+ *   path: the buffer to store the path in.
+ *   size: the size of the buffer.
+ * -> 0 if done, -1 if the path is too long.
+ */
+int paste_path(char *id, char *path, unsigned long size)
+{
+    unsigned long length = strlen(id);
+    unsigned long levels = settings.fan_out;
+
+    if (levels * 3 + length + 1 > size || length < levels * 2) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    for (unsigned long level = 0; level < levels; level++) {
+        *path++ = id[level * 2];
+        *path++ = id[level * 2 + 1];
+        *path++ = '/';
+    }
+
+    strcpy(path, id);
+    return 0;
+}
+
+/**
+ * Create the folders leading to a file, if they don't exist.
+ *   path: the path of the file in question.
+ * -> 0 if done, -1 if not.
+ */
+int create_folders(char *path)
+{
+    char folder[PASTE_PATH_SIZE];
+
+    for (char *slash = strchr(path, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        if (slash - path >= (long)sizeof(folder)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        memcpy(folder, path, slash - path);
+        folder[slash - path] = 0;
+
+        if (mkdir(folder, 0755) != 0 && errno != EEXIST)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Create the file of a paste, making sure no other paste is overwritten.
+ *   id: the ID of the paste.
+ * -> the file descriptor, or -1 if an error occured.
+ */
+int create_paste(char *id)
+{
+    char path[PASTE_PATH_SIZE];
+    if (paste_path(id, path, sizeof(path)) != 0)
+        return -1;
+
+    /* the folders of a fan-out layout are only created when needed */
+    int file;
+    if ((file = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666)) == -1 && errno == ENOENT && create_folders(path) == 0)
+        file = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+
+    return file;
+}
+
+/**
+ * Remove a paste from disk.
+ *   id: the ID of the paste.
+ * -> 0 if done, -1 if not.
+ */
+int remove_paste(char *id)
+{
+    char path[PASTE_PATH_SIZE];
+    if (paste_path(id, path, sizeof(path)) != 0)
+        return -1;
+
+    /* a deferred write can fail after the paste has been cached */
+    cache_remove(id);
+
+    return unlink(path);
 }
 
 /**
@@ -87,19 +228,52 @@ int paste_exists(char *id)
  */
 int write_paste(char *paste, unsigned long paste_size, char *id)
 {
-    /* open the file with write access */
-    FILE *file;
-    if ((file = fopen(id, "w")) == NULL)
+    /* open the file with write access, making sure no other paste is overwritten */
+    int file;
+    if ((file = create_paste(id)) == -1)
         return -1;
 
     /* write the content to file */
-    if (fwrite(paste, sizeof(char), paste_size, file) != paste_size) {
-        fclose(file);
+    for (long left = paste_size, written; left > 0; left -= written) {
+        if ((written = write(file, paste + paste_size - left, left)) <= 0) {
+            close(file);
+            remove_paste(id);
+            return -1;
+        }
+    }
+
+    /* make it durable, if every paste is synced on its own */
+    if (durability_file(file) != 0) {
+        close(file);
+        remove_paste(id);
         return -1;
     }
 
     /* close the file (obviously) */
-    fclose(file);
+    close(file);
+    return 0;
+}
+
+/**
+ * Create the file of a paste, leaving its content to be written by the engine.
+ *   paste: the paste in question. Its output file and ID are set on success.
+ *   id: the ID of the paste.
+ * -> 0 if done, -1 if not.
+ */
+int reserve_paste(Paste *paste, char *id)
+{
+    /* making sure no other paste is overwritten, just like write_paste */
+    if ((paste->output = create_paste(id)) == -1)
+        return -1;
+
+    if ((paste->id = strdup(id)) == NULL) {
+        close(paste->output);
+        remove_paste(id);
+
+        paste->output = -1;
+        return -1;
+    }
+
     return 0;
 }
 
@@ -124,3 +298,339 @@ char *create_url(char *id)
 
     return buffer;
 }
+
+/**
+ * Give its ID to a paste that's already on disk (a temporary file, or an identical paste).
+ *   source: the path of the file in question.
+ *   id: the ID of the paste.
+ * -> 0 if done, -1 if not.
+ */
+int link_paste(char *source, char *id)
+{
+    char path[PASTE_PATH_SIZE];
+    if (paste_path(id, path, sizeof(path)) != 0)
+        return -1;
+
+    /* unlike rename, link never replaces an existing paste */
+    int status;
+    if ((status = link(source, path)) == -1 && errno == ENOENT && create_folders(path) == 0)
+        status = link(source, path);
+
+    return status;
+}
+
+/**
+ * Call a function for every paste on disk, whatever the storage layout.
+ *   folder: the folder to look into.
+ *   depth: the number of levels of fan-out folders to look into.
+ *   callback: the function in question, called with the ID and the path of every paste.
+ * -> the number of pastes for which the function returned 1, or -1 if an error occured.
+ */
+long walk_pastes(char *folder, int depth, int (*callback)(char *, char *))
+{
+    DIR *directory;
+    if ((directory = opendir(folder)) == NULL)
+        return -1;
+
+    long count = 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        /* skip `.', `..', temporary files and journals */
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char path[PASTE_PATH_SIZE];
+        if (snprintf(path, sizeof(path), "%s/%s", folder, entry->d_name) >= (int)sizeof(path))
+            continue;
+
+        /* the path of a paste never starts with `./' */
+        char *relative = strncmp(path, "./", 2) == 0 ? path + 2 : path;
+
+        struct stat status;
+        int is_folder = entry->d_type == DT_DIR
+                    || (entry->d_type == DT_UNKNOWN && stat(path, &status) == 0 && S_ISDIR(status.st_mode));
+
+        if (!is_folder) {
+            count += callback(entry->d_name, relative);
+            continue;
+        }
+
+        /* fan-out folders are named after two characters of the IDs, other folders are left alone */
+        if (depth > 0 && strlen(entry->d_name) == 2) {
+            long sub_count;
+            if ((sub_count = walk_pastes(path, depth - 1, callback)) > 0)
+                count += sub_count;
+        }
+    }
+
+    closedir(directory);
+    return count;
+}
+
+/**
+ * Move a paste to its path in the storage layout.
+ *   id: the ID of the paste.
+ *   path: the current path of the paste.
+ * -> 1 if moved, 0 if not.
+ */
+int move_paste(char *id, char *path)
+{
+    char target[PASTE_PATH_SIZE];
+    if (paste_path(id, target, sizeof(target)) != 0 || strcmp(path, target) == 0)
+        return 0;
+
+    if (link_paste(path, id) != 0) {
+        error("could not move paste `%s': %s", path, strerror(errno));
+        return 0;
+    }
+
+    unlink(path);
+    return 1;
+}
+
+/**
+ * Remove the fan-out folders left empty.
+ *   folder: the folder to look into.
+ *   depth: the number of levels of fan-out folders to look into.
+ */
+void prune_folders(char *folder, int depth)
+{
+    DIR *directory;
+    if (depth == 0 || (directory = opendir(folder)) == NULL)
+        return;
+
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] == '.' || strlen(entry->d_name) != 2)
+            continue;
+
+        char path[PASTE_PATH_SIZE];
+        if (snprintf(path, sizeof(path), "%s/%s", folder, entry->d_name) >= (int)sizeof(path))
+            continue;
+
+        /* only empty folders can be removed, the others are left as is */
+        prune_folders(path, depth - 1);
+        rmdir(path);
+    }
+
+    closedir(directory);
+}
+
+/**
+ * Move every paste of the output folder to the storage layout set in the settings.
+ * -> the number of pastes moved, or -1 if an error occured.
+ */
+long migrate_pastes(void)
+{
+    long count;
+    if ((count = walk_pastes(".", MAX_FAN_OUT, move_paste)) == -1)
+        return -1;
+
+    prune_folders(".", MAX_FAN_OUT);
+    return count;
+}
+
+/**
+ * Store a paste: generate its ID, write it to disk and make its URL.
+ *   paste: the paste, once fully received. If it's deferred, only its file is created (see reserve_paste).
+ * -> a pointer to the response to send to the client (the URL, or an error message). Needs to be freed.
+ */
+char *store_paste(Paste *paste)
+{
+    char *id       = NULL;
+    char *url      = NULL;
+    char *existing = NULL;
+
+    char source[PASTE_PATH_SIZE];
+
+    if (paste->batch != NULL)
+        return store_batch(paste);
+
+    long long start = metrics_now();
+    metrics_count(COUNTER_BYTES, paste->size);
+
+    /* is there already a paste with the same content? */
+    if (settings.dedup != DEDUP_NONE && (existing = dedup_find(paste)) != NULL) {
+        verbose(1, "paste `%s' has the same content.", existing);
+
+        /* it has to live as long as a new paste, unless it has just expired */
+        if (settings.dedup == DEDUP_URL && settings.retention > 0 && expiry_renew(existing, paste->hash, paste->size) != 0) {
+            free(existing);
+            existing = NULL;
+        }
+
+        /* reuse its URL */
+        if (existing != NULL && settings.dedup == DEDUP_URL) {
+            if ((url = create_url(existing)) == NULL) {
+                error("error while making a valid URL.");
+                url = strdup("Could not create your paste URL.\nPlease try again later.\n");
+            }
+
+            free(existing);
+
+            metrics_count(COUNTER_DEDUPLICATED, 1);
+            metrics_time(PHASE_STORE, start);
+            return url;
+        }
+    }
+
+    /* an ID can still be taken by a paste the index doesn't know about */
+    for (int attempt = 1;; attempt++) {
+        /* generate random ID */
+        verbose(2, "generating a random ID...");
+
+        if ((id = generate_id(settings.id_length)) == NULL) {
+            error("error while generating a random ID.");
+            return strdup("Could not generate your paste ID.\nPlease try again later.\n");
+        }
+
+        /* write paste to disk */
+        verbose(2, "done.");
+        verbose(1, "writing paste `%s' to disk...", id);
+
+        int status;
+        if (settings.storage == STORAGE_PACK)
+            status = pack_write(id, paste->buffer, paste->size, paste->file);
+        else if (existing != NULL)
+            status = paste_path(existing, source, sizeof(source)) == 0 ? link_paste(source, id) : -1;
+        else if (paste->file == -1 && paste->deferred)
+            status = reserve_paste(paste, id);
+        else if (paste->file == -1)
+            status = write_paste(paste->buffer, paste->size, id);
+        else if ((status = durability_file(paste->file)) == 0)
+            status = link_paste(paste->temporary, id);
+
+        if (status == 0)
+            break;
+
+        /* if the ID is used on disk, keep it in the index */
+        int error_code = errno;
+
+        if (error_code != EEXIST && settings.storage == STORAGE_PACK)
+            pack_release(id);
+        else if (error_code != EEXIST)
+            index_release(id);
+
+        free(id);
+
+        /* the paste with the same content has just expired: store this one instead */
+        if (existing != NULL && error_code == ENOENT) {
+            free(existing);
+            existing = NULL;
+            continue;
+        }
+
+        if (error_code != EEXIST || attempt == MAX_ATTEMPTS) {
+            error("error while writing paste to disk.");
+            free(existing);
+
+            metrics_count(COUNTER_WRITE_ERRORS, 1);
+            return strdup(WRITE_ERROR);
+        }
+
+        verbose(2, "ID already used on disk, trying again...");
+        metrics_count(COUNTER_COLLISIONS, 1);
+    }
+
+    /* its URL won't be sent until it's committed (a new segment is synced as soon as it's created) */
+    char path[PASTE_PATH_SIZE] = "";
+    if (settings.storage == STORAGE_FILES)
+        paste_path(id, path, sizeof(path));
+
+    durability_add(path);
+
+    /* delete it once it expires */
+    if (settings.retention > 0)
+        expiry_add(id, paste->hash, paste->size);
+
+    /* keep it in memory for its first readers, when its whole content is at hand */
+    if (paste->file == -1 && paste->buffer != NULL)
+        cache_add(id, paste->buffer, paste->size);
+
+#ifdef HAVE_ZLIB
+    /* compress it once its URL has been sent */
+    if (settings.compression != COMPRESSION_NONE)
+        compress_add(id);
+#endif
+
+    /* remember its content, for the next identical paste */
+    if (settings.dedup != DEDUP_NONE && existing == NULL)
+        dedup_record(paste, id);
+
+    if (existing != NULL)
+        metrics_count(COUNTER_DEDUPLICATED, 1);
+
+    free(existing);
+
+    /* create URL */
+    verbose(1, "done.");
+    verbose(2, "making the right URL...");
+
+    if ((url = create_url(id)) == NULL) {
+        error("error while making a valid URL.");
+        free(id);
+        return strdup("Could not create your paste URL.\nPlease try again later.\n");
+    }
+
+    verbose(2, "done.");
+
+    metrics_count(COUNTER_PASTES, 1);
+    metrics_time(PHASE_STORE, start);
+
+    free(id);
+    return url;
+}
+
+/**
+ * Store every paste of a batch, one after the other. They're committed along with each other afterwards.
+ *   paste: the batch, once fully received.
+ * -> a pointer to the response to send to the client: a line per paste (its URL, or what went wrong). Needs to be freed.
+ */
+char *store_batch(Paste *paste)
+{
+    Batch         *batch    = paste->batch;
+    char          *response = NULL;
+    unsigned long  length   = 0;
+    unsigned long  offset   = 0;
+
+    for (unsigned long i = 0; i < batch->count; i++) {
+        /* a paste of its own, whose content is a part of the buffer of the batch */
+        Paste part = *paste;
+
+        part.buffer   = paste->buffer + offset;
+        part.size     = batch->sizes[i];
+        part.hash     = settings.dedup ? hash_bytes(HASH_INIT, part.buffer, part.size) : HASH_INIT;
+        part.deferred = 0;
+        part.batch    = NULL;
+
+        offset += part.size;
+
+        char *url;
+        if ((url = store_paste(&part)) == NULL) {
+            free(response);
+            return NULL;
+        }
+
+        /* only the first line of the errors is kept */
+        unsigned long line = strcspn(url, "\n");
+
+        char *tmp;
+        if ((tmp = realloc(response, length + line + 2)) == NULL) {
+            free(url);
+            free(response);
+            return NULL;
+        }
+
+        response = tmp;
+
+        memcpy(response + length, url, line);
+        response[length + line] = '\n';
+        length += line + 1;
+
+        free(url);
+    }
+
+    response[length] = 0;
+    return response;
+}
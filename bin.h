@@ -14,9 +14,34 @@
 #pragma once
 
 #include "feuille.h"
+#include "paste.h"
 
+/* maximum levels of fan-out folders */
+#define MAX_FAN_OUT 2
+
+/* size of the buffers holding the path of a paste */
+#define PASTE_PATH_SIZE (3 * MAX_FAN_OUT + 256)
+
+/* sent when a paste couldn't be written (or committed) to disk */
+#define WRITE_ERROR "Could not write your paste to disk.\nPlease try again later.\n"
+
+int      claim_id(char *);
 int      paste_exists(char *);
+int      paste_path(char *, char *, unsigned long);
+int      create_folders(char *);
+int      create_paste(char *);
+int      remove_paste(char *);
 int      write_paste(char *, unsigned long, char *);
+int      reserve_paste(Paste *, char *);
+int      link_paste(char *, char *);
+
+long     walk_pastes(char *, int, int (*)(char *, char *));
+int      move_paste(char *, char *);
+void     prune_folders(char *, int);
+long     migrate_pastes(void);
 
 char    *generate_id(int);
 char    *create_url(char *);
+
+char    *store_paste(Paste *);
+char    *store_batch(Paste *);
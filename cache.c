@@ -0,0 +1,468 @@
+/*
+ * cache.c
+ *  Cache of the most recent and most read pastes, shared by all workers.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _GNU_SOURCE
+
+#include "cache.h"
+
+#ifdef HAVE_CACHE
+#include <errno.h>     /* for EOWNERDEAD                                   */
+#include <pthread.h>   /* for pthread_mutex_*                              */
+#include <stdint.h>    /* for uint64_t                                     */
+#include <stdio.h>     /* for NULL                                         */
+#include <stdlib.h>    /* for free, malloc                                 */
+#include <string.h>    /* for memcpy, memcmp, strlen                       */
+#include <sys/mman.h>  /* for munmap                                       */
+
+#include "metrics.h"   /* for metrics_count                                */
+#include "table.h"     /* for table_fingerprint                            */
+#include "util.h"      /* for shared_alloc                                 */
+
+/* no entry, block or bucket */
+#define NONE -1
+
+/* a paste takes whole blocks: its ID (with the null byte) and then its content */
+#define BLOCK_SIZE    4096
+
+/* a paste taking more than that part of the cache isn't cached, not to flush everything else */
+#define MAX_SHARE     8
+
+/* reads remembered for a paste: the most read ones survive that many evictions in a row */
+#define MAX_HITS      8
+
+/* a cached paste */
+typedef struct Entry {
+    uint64_t         fingerprint;  /* of its ID                        */
+    unsigned long    size;         /* of its content                   */
+    unsigned int     hits;         /* reads since its last eviction    */
+    unsigned long    version;      /* bumped whenever it's dropped     */
+
+    long             block;        /* its first block                  */
+    long             chain;        /* next entry of the same bucket    */
+    long             prev;         /* more recently used entry         */
+    long             next;         /* less recently used entry, or ... */
+} Entry;                           /* ... next free entry              */
+
+/* state of the cache, followed by the entries, the buckets, the links between the blocks and the blocks */
+typedef struct Cache {
+    pthread_mutex_t  lock;
+
+    long             head;         /* most recently used entry         */
+    long             tail;         /* least recently used entry        */
+    long             free_entry;
+    long             free_block;
+    unsigned long    free_count;   /* blocks                           */
+} Cache;
+
+static Cache           *cache        = NULL;
+static Entry           *entries      = NULL;
+static long            *buckets      = NULL;
+static long            *links        = NULL; /* next block of every block */
+static char            *blocks       = NULL;
+
+static unsigned long    entry_count  = 0;   /* also the number of blocks */
+static unsigned long    mask         = 0;   /* of the buckets            */
+
+/* functions declarations */
+static  int         cache_lock(void);
+static  void        reset(void);
+static  long        find(char *, uint64_t);
+static  void        detach(long);
+static  void        attach(long);
+static  void        drop(long);
+static  void        evict(void);
+#endif
+
+/**
+ * Create the cache, before any worker is forked.
+ *   size: the memory the cached pastes can use, in bytes.
+ * -> 0 if done, -1 if not.
+ */
+int cache_initialize(unsigned long size)
+{
+#ifdef HAVE_CACHE
+    /* every paste takes at least a block, so there are never more entries than blocks */
+    entry_count = size / BLOCK_SIZE;
+
+    unsigned long bucket_count = 1;
+    while (bucket_count < entry_count)
+        bucket_count <<= 1;
+
+    unsigned long total = sizeof(Cache) + entry_count * sizeof(Entry) + bucket_count * sizeof(long)
+                        + entry_count * sizeof(long) + entry_count * BLOCK_SIZE;
+
+    void *shared;
+    if ((shared = shared_alloc(total)) == NULL)
+        return -1;
+
+    cache   = shared;
+    entries = (Entry *)(cache + 1);
+    buckets = (long *)(entries + entry_count);
+    links   = buckets + bucket_count;
+    blocks  = (char *)(links + entry_count);
+    mask    = bucket_count - 1;
+
+    /* the lock has to survive a worker dying while holding it */
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+
+    int status = pthread_mutex_init(&cache->lock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+
+    if (status != 0) {
+        munmap(shared, total);
+        cache = NULL;
+
+        errno = status;
+        return -1;
+    }
+
+    reset();
+    return 0;
+#else
+    (void)size;
+    return 0;
+#endif
+}
+
+#ifdef HAVE_CACHE
+/**
+ * Lock the cache.
+ * -> 0 if done, an error number if not.
+ */
+int cache_lock(void)
+{
+    int status = pthread_mutex_lock(&cache->lock);
+
+    /* a worker died while holding the lock, in the middle of any change: start over with an empty cache */
+    if (status == EOWNERDEAD) {
+        reset();
+        status = pthread_mutex_consistent(&cache->lock);
+    }
+
+    return status;
+}
+
+/**
+ * Empty the cache.
+ */
+void reset(void)
+{
+    cache->head       = NONE;
+    cache->tail       = NONE;
+    cache->free_entry = entry_count > 0 ? 0 : NONE;
+    cache->free_block = entry_count > 0 ? 0 : NONE;
+    cache->free_count = entry_count;
+
+    for (unsigned long i = 0; i <= mask; i++)
+        buckets[i] = NONE;
+
+    for (unsigned long i = 0; i < entry_count; i++) {
+        entries[i].next = i + 1 < entry_count ? (long)i + 1 : NONE;
+        links[i]        = i + 1 < entry_count ? (long)i + 1 : NONE;
+
+        entries[i].version++;
+    }
+}
+
+/**
+ * Find the entry of a paste (the cache has to be locked).
+ *   id: the ID of the paste.
+ *   hash: the fingerprint of its ID.
+ * -> the entry, or NONE if the paste isn't cached.
+ */
+long find(char *id, uint64_t hash)
+{
+    unsigned long length = strlen(id) + 1;
+
+    for (long i = buckets[hash & mask]; i != NONE; i = entries[i].chain)
+        if (entries[i].fingerprint == hash && memcmp(blocks + entries[i].block * BLOCK_SIZE, id, length) == 0)
+            return i;
+
+    return NONE;
+}
+
+/**
+ * Take an entry out of the recency list.
+ *   i: the entry in question.
+ */
+void detach(long i)
+{
+    Entry *entry = &entries[i];
+
+    if (entry->prev != NONE)
+        entries[entry->prev].next = entry->next;
+    else
+        cache->head = entry->next;
+
+    if (entry->next != NONE)
+        entries[entry->next].prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+}
+
+/**
+ * Put an entry at the head of the recency list.
+ *   i: the entry in question.
+ */
+void attach(long i)
+{
+    Entry *entry = &entries[i];
+
+    entry->prev = NONE;
+    entry->next = cache->head;
+
+    if (cache->head != NONE)
+        entries[cache->head].prev = i;
+    else
+        cache->tail = i;
+
+    cache->head = i;
+}
+
+/**
+ * Remove an entry from the cache, freeing its blocks.
+ *   i: the entry in question.
+ */
+void drop(long i)
+{
+    Entry *entry = &entries[i];
+
+    /* out of its bucket */
+    long *link = &buckets[entry->fingerprint & mask];
+    while (*link != i)
+        link = &entries[*link].chain;
+
+    *link = entry->chain;
+
+    detach(i);
+
+    /* its blocks go back to the free list, all at once */
+    long last = entry->block;
+    unsigned long count = 1;
+
+    while (links[last] != NONE) {
+        last = links[last];
+        count++;
+    }
+
+    links[last]        = cache->free_block;
+    cache->free_block  = entry->block;
+    cache->free_count += count;
+
+    entry->next       = cache->free_entry;
+    cache->free_entry = i;
+
+    entry->version++;
+}
+
+/**
+ * Remove the least recently used paste, unless it's been read since its last chance:
+ * then it gets another one, with half its reads, at the head of the list.
+ */
+void evict(void)
+{
+    for (;;) {
+        long i = cache->tail;
+
+        if (entries[i].hits == 0) {
+            drop(i);
+            return;
+        }
+
+        entries[i].hits /= 2;
+
+        detach(i);
+        attach(i);
+    }
+}
+#endif
+
+/**
+ * Cache a paste that has just been stored, evicting the others as needed.
+ *   id: the ID of the paste.
+ *   content: its content.
+ *   size: the size of its content.
+ */
+void cache_add(char *id, char *content, unsigned long size)
+{
+#ifdef HAVE_CACHE
+    if (cache == NULL)
+        return;
+
+    unsigned long length = strlen(id) + 1;
+    unsigned long needed = (length + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    if (needed > entry_count / MAX_SHARE || cache_lock() != 0)
+        return;
+
+    uint64_t hash = table_fingerprint(id);
+
+    long i;
+    if ((i = find(id, hash)) != NONE)
+        drop(i);
+
+    while (cache->free_count < needed || cache->free_entry == NONE)
+        evict();
+
+    i = cache->free_entry;
+    cache->free_entry = entries[i].next;
+
+    Entry *entry = &entries[i];
+
+    entry->fingerprint = hash;
+    entry->size        = size;
+    entry->hits        = 0;
+    entry->block       = cache->free_block;
+
+    /* copy the ID, then the content, block after block */
+    long          block  = NONE;
+    unsigned long offset = 0;
+
+    for (unsigned long n = 0; n < needed; n++) {
+        block = cache->free_block;
+        cache->free_block = links[block];
+
+        char         *data = blocks + block * BLOCK_SIZE;
+        unsigned long room = BLOCK_SIZE;
+
+        if (n == 0) {
+            memcpy(data, id, length);
+            data += length;
+            room -= length;
+        }
+
+        unsigned long part = size - offset < room ? size - offset : room;
+        memcpy(data, content + offset, part);
+        offset += part;
+    }
+
+    links[block]       = NONE;
+    cache->free_count -= needed;
+
+    entry->chain = buckets[hash & mask];
+    buckets[hash & mask] = i;
+
+    attach(i);
+
+    pthread_mutex_unlock(&cache->lock);
+#else
+    (void)id;
+    (void)content;
+    (void)size;
+#endif
+}
+
+/**
+ * Get a copy of a cached paste, making it the most recently used one.
+ * The copy is made without holding the lock: it's thrown away if the paste has been dropped meanwhile.
+ *   id: the ID of the paste.
+ *   size: where to store the size of its content.
+ * -> a pointer to its content, or NULL if it isn't cached. Needs to be freed.
+ */
+char *cache_find(char *id, unsigned long *size)
+{
+#ifdef HAVE_CACHE
+    if (cache == NULL || cache_lock() != 0)
+        return NULL;
+
+    long i;
+    if ((i = find(id, table_fingerprint(id))) == NONE) {
+        pthread_mutex_unlock(&cache->lock);
+
+        metrics_count(COUNTER_CACHE_MISSES, 1);
+        return NULL;
+    }
+
+    Entry *entry = &entries[i];
+
+    if (entry->hits < MAX_HITS)
+        entry->hits++;
+
+    detach(i);
+    attach(i);
+
+    long          first   = entry->block;
+    unsigned long version = entry->version;
+
+    *size = entry->size;
+    pthread_mutex_unlock(&cache->lock);
+
+    /* a paste can't be empty, but its copy still needs a byte */
+    char *content;
+    if ((content = malloc(*size + 1)) == NULL)
+        return NULL;
+
+    unsigned long length = strlen(id) + 1;
+    unsigned long offset = 0;
+
+    /* its blocks may be reused meanwhile: the links are only followed as far as its size */
+    for (long block = first; block != NONE && offset < *size; block = links[block]) {
+        char         *data = blocks + block * BLOCK_SIZE;
+        unsigned long room = BLOCK_SIZE;
+
+        if (block == first) {
+            data += length;
+            room -= length;
+        }
+
+        unsigned long part = *size - offset < room ? *size - offset : room;
+        memcpy(content + offset, data, part);
+        offset += part;
+    }
+
+    if (cache_lock() != 0) {
+        free(content);
+        return NULL;
+    }
+
+    int intact = entry->version == version && offset == *size;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (!intact) {
+        free(content);
+
+        metrics_count(COUNTER_CACHE_MISSES, 1);
+        return NULL;
+    }
+
+    metrics_count(COUNTER_CACHE_HITS, 1);
+    return content;
+#else
+    (void)id;
+    (void)size;
+    return NULL;
+#endif
+}
+
+/**
+ * Remove a paste from the cache, e.g. once it has expired.
+ *   id: the ID of the paste.
+ */
+void cache_remove(char *id)
+{
+#ifdef HAVE_CACHE
+    if (cache == NULL || cache_lock() != 0)
+        return;
+
+    long i;
+    if ((i = find(id, table_fingerprint(id))) != NONE)
+        drop(i);
+
+    pthread_mutex_unlock(&cache->lock);
+#else
+    (void)id;
+#endif
+}
@@ -0,0 +1,30 @@
+/*
+ * cache.h
+ *  cache.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+/* the cache is locked with a process-shared mutex, only used on Linux (like the group commit) */
+#if defined __linux__ && !defined COSMOPOLITAN
+#define HAVE_CACHE
+#endif
+
+/* smaller caches couldn't hold a paste of a few blocks */
+#define CACHE_MIN_SIZE 65536
+
+int      cache_initialize(unsigned long);
+
+void     cache_add(char *, char *, unsigned long);
+char    *cache_find(char *, unsigned long *);
+void     cache_remove(char *);
@@ -1,7 +1,7 @@
 /*
  * misc/web/feuille.cgi.c
  *  Auxiliary CGI script that converts an HTTP request to a raw TCP
- *  one.
+ *  one. Also runs as a persistent FastCGI responder.
  *
  * Copyright (c) 2022
  *     Tom MTT. <tom@heimdall.pm>
@@ -12,18 +12,106 @@
  * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
  */
 
+#define _DEFAULT_SOURCE
+
 #include <arpa/inet.h>   /* for inet_pton                                      */
-#include <errno.h>       /* for ERANGE, errno                                  */
+#include <ctype.h>       /* for isalnum                                        */
+#include <errno.h>       /* for ERANGE, EAGAIN, EINPROGRESS, ENOTCONN, errno   */
+#include <fcntl.h>       /* for fcntl, F_SETFL, O_NONBLOCK                     */
 #include <netinet/in.h>  /* for htons, sockaddr_in, sockaddr_in6               */
-#include <stdio.h>       /* for printf, NULL, BUFSIZ                           */
-#include <stdlib.h>      /* for calloc, free, getenv, exit, strtoll            */
-#include <string.h>      /* for strcmp, strncmp, strstr                        */
+#include <poll.h>        /* for poll, pollfd, POLLIN, POLLOUT                  */
+#include <signal.h>      /* for signal, SIGPIPE, SIG_IGN                       */
+#include <stdio.h>       /* for snprintf, fwrite, NULL, BUFSIZ                 */
+#include <stdlib.h>      /* for calloc, free, getenv, exit, realloc, strtoll   */
+#include <string.h>      /* for memcmp, memcpy, memmove, strcspn, strncmp      */
 #include <strings.h>     /* for bzero                                          */
-#include <sys/socket.h>  /* for connect, socket, AF_INET, AF_INET6, recv, send */
+#include <sys/socket.h>  /* for accept, connect, setsockopt, socket, linger... */
 #include <unistd.h>      /* for close, read, STDIN_FILENO                      */
 
-/* Initialize client socket and connect to feuille */
-int initialize_socket(char *address, unsigned short port)
+/* longest form field name held back before the paste (`paste=') */
+#define FIELD_SIZE       32
+
+/* size of the response of feuille (its URL, or what went wrong) */
+#define RESPONSE_SIZE    BUFSIZ
+
+/* size of a response to the web server (headers and body) */
+#define OUTPUT_SIZE      (RESPONSE_SIZE + 512)
+
+/* most web server connections handled at once, in FastCGI mode */
+#define MAX_CONNECTIONS  1024
+
+/* FastCGI protocol (see the FastCGI specification) */
+#define FCGI_VERSION_1          1
+#define FCGI_HEADER_SIZE        8
+#define FCGI_MAX_CONTENT        65535
+#define FCGI_MAX_PADDING        255
+
+#define FCGI_BEGIN_REQUEST      1
+#define FCGI_ABORT_REQUEST      2
+#define FCGI_END_REQUEST        3
+#define FCGI_PARAMS             4
+#define FCGI_STDIN              5
+#define FCGI_STDOUT             6
+#define FCGI_GET_VALUES         9
+#define FCGI_GET_VALUES_RESULT  10
+#define FCGI_UNKNOWN_TYPE       11
+
+#define FCGI_RESPONDER          1
+#define FCGI_KEEP_CONN          1
+
+#define FCGI_REQUEST_COMPLETE   0
+#define FCGI_OVERLOADED         2
+#define FCGI_UNKNOWN_ROLE       3
+
+/* strips the form field name and the carriage returns of a paste, as it's received */
+typedef struct Filter {
+    char     field[FIELD_SIZE];
+    size_t   field_size;
+    int      done;          /* the field name has been stripped (or there's none) */
+} Filter;
+
+/* a request, multiplexed on a connection from the web server */
+typedef struct Request {
+    unsigned int     id;
+    int              done;
+
+    /* FCGI_PARAMS, parsed once they've all been received */
+    unsigned char   *params;
+    size_t           params_size;
+
+    /* the connection to feuille, opened for this request only */
+    int              backend;
+    int              connected;
+    int              shut;
+
+    /* FCGI_STDIN, streamed to feuille as it arrives */
+    Filter           filter;
+    int              stdin_done;
+    char             pending[FCGI_MAX_CONTENT + FIELD_SIZE];
+    size_t           pending_size;
+    size_t           pending_sent;
+
+    char             response[RESPONSE_SIZE];
+    size_t           response_size;
+
+    struct Request  *next;
+} Request;
+
+/* a connection from the web server */
+typedef struct Connection {
+    int                  socket;
+    int                  keep_conn;
+    int                  closed;
+
+    unsigned char        buffer[FCGI_HEADER_SIZE + FCGI_MAX_CONTENT + FCGI_MAX_PADDING];
+    size_t               size;
+
+    Request             *requests;
+    struct Connection   *next;
+} Connection;
+
+/* Initialize client socket and connect to feuille (the connection may still be in progress if it's non-blocking) */
+int initialize_socket(char *address, unsigned short port, int nonblocking)
 {
     int server;
 
@@ -44,9 +132,15 @@ int initialize_socket(char *address, unsigned short port)
         if ((server = socket(AF_INET, SOCK_STREAM, 0)) < 0)
             return -1;
 
+        if (nonblocking)
+            fcntl(server, F_SETFL, O_NONBLOCK);
+
         /* connect to server */
-        if (connect(server, (struct sockaddr *)&server_address_v4, sizeof(server_address_v4)) < 0)
+        if (connect(server, (struct sockaddr *)&server_address_v4, sizeof(server_address_v4)) < 0
+         && errno != EINPROGRESS) {
+            close(server);
             return -1;
+        }
 
     } else if (inet_pton(AF_INET6, address, &server_address_v6.sin6_addr) == 1) {
         /* set socket family and port */
@@ -57,9 +151,15 @@ int initialize_socket(char *address, unsigned short port)
         if ((server = socket(AF_INET6, SOCK_STREAM, 0)) < 0)
             return -1;
 
+        if (nonblocking)
+            fcntl(server, F_SETFL, O_NONBLOCK);
+
         /* connect to server */
-        if (connect(server, (struct sockaddr *)&server_address_v6, sizeof(server_address_v6)) < 0)
+        if (connect(server, (struct sockaddr *)&server_address_v6, sizeof(server_address_v6)) < 0
+         && errno != EINPROGRESS) {
+            close(server);
             return -1;
+        }
 
     } else
         return -1;
@@ -68,59 +168,661 @@ int initialize_socket(char *address, unsigned short port)
 }
 
 /* helper functions */
-int remove_char(char *str, char c) {
-    char *src, *dst;
-    int count = 0;
+int send_all(int socket, void *data, size_t size)
+{
+    for (size_t sent = 0; sent < size;) {
+        ssize_t length;
+        if ((length = send(socket, (char *)data + sent, size - sent, 0)) <= 0)
+            return -1;
 
-    for (src = dst = str; *src != 0; src++) {
-        *dst = *src;
+        sent += length;
+    }
 
-        if (*dst != c)
-            dst++;
-        else
-            count++;
+    return 0;
+}
+
+/* Filter a part of the request body. `output' must be able to hold `size + FIELD_SIZE' bytes */
+size_t filter_body(Filter *filter, char *input, size_t size, char *output)
+{
+    size_t length = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        char c = input[i];
+
+        /* remove `paste=' from request */
+        if (!filter->done) {
+            if (c == '=') {
+                filter->done = 1;
+                continue;
+            }
+
+            if (filter->field_size < FIELD_SIZE && (isalnum((unsigned char)c) || c == '_' || c == '-')) {
+                filter->field[filter->field_size++] = c;
+                continue;
+            }
+
+            /* not a form field: what's been held back is part of the paste */
+            memcpy(output + length, filter->field, filter->field_size);
+            length      += filter->field_size;
+            filter->done = 1;
+        }
+
+        /* remove all carriage returns from paste */
+        if (c != '\r')
+            output[length++] = c;
     }
 
-    *dst = 0;
-    return count;
+    return length;
 }
 
-void cgi_init()
+/* Flush what's been held back, once the whole request body has been filtered */
+size_t filter_end(Filter *filter, char *output)
 {
-    printf("Content-Type: text/plain\r\n");
+    if (filter->done)
+        return 0;
+
+    filter->done = 1;
+
+    memcpy(output, filter->field, filter->field_size);
+    return filter->field_size;
 }
 
-void cgi_error(char *status)
+/* Format the response to the web server: the one of feuille, or an error status if there's none */
+size_t format_response(char *output, size_t size, char *status, char *response)
 {
-    printf("Status: %s\r\n", status);
-    printf("\r\n");
-    printf("%s\n", status);
+    int length;
+
+    /* check if responses starts with `http' */
+    if (response == NULL)
+        length = snprintf(output, size, "Content-Type: text/plain\r\nStatus: %s\r\n\r\n%s\n", status, status);
+    else if (strncmp(response, "http", 4) == 0)
+        length = snprintf(output, size, "Content-Type: text/plain\r\nStatus: 301 Moved Permanently\r\n"
+                                        "Location: %.*s\r\n\r\n%s",
+                          (int)strcspn(response, "\r\n"), response, response);
+    else
+        length = snprintf(output, size, "Content-Type: text/plain\r\nStatus: 200 OK\r\n\r\n%s", response);
+
+    if (length < 0)
+        return 0;
+
+    return (size_t)length < size ? (size_t)length : size - 1;
+}
+
+void cgi_respond(char *status, char *response)
+{
+    char output[OUTPUT_SIZE];
+    fwrite(output, 1, format_response(output, sizeof(output), status, response), stdout);
 }
 
 void cgi_die(char *status)
 {
-    cgi_error(status);
+    cgi_respond(status, NULL);
     exit(1);
 }
 
-void cgi_ok(char *response)
+/* Send a FastCGI record to the web server */
+int send_record(Connection *connection, int type, unsigned int id, void *data, size_t size)
+{
+    static unsigned char record[FCGI_HEADER_SIZE + FCGI_MAX_CONTENT + FCGI_MAX_PADDING];
+
+    size_t padding = (8 - size % 8) % 8;
+
+    record[0] = FCGI_VERSION_1;
+    record[1] = type;
+    record[2] = id >> 8;
+    record[3] = id & 0xff;
+    record[4] = size >> 8;
+    record[5] = size & 0xff;
+    record[6] = padding;
+    record[7] = 0;
+
+    memcpy(record + FCGI_HEADER_SIZE, data, size);
+    bzero(record + FCGI_HEADER_SIZE + size, padding);
+
+    if (send_all(connection->socket, record, FCGI_HEADER_SIZE + size + padding) != 0) {
+        connection->closed = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Tell the web server that a request is over */
+void send_end(Connection *connection, unsigned int id, int protocol_status)
+{
+    unsigned char body[8] = { 0, 0, 0, 0, protocol_status, 0, 0, 0 };
+    send_record(connection, FCGI_END_REQUEST, id, body, sizeof(body));
+
+    /* without FCGI_KEEP_CONN, the connection only carries one request */
+    if (!connection->keep_conn)
+        connection->closed = 1;
+}
+
+/* Read the next name-value pair of FCGI_PARAMS or FCGI_GET_VALUES */
+int next_pair(unsigned char **cursor, unsigned char *end,
+              unsigned char **name, size_t *name_length, unsigned char **value, size_t *value_length)
+{
+    size_t *lengths[2] = { name_length, value_length };
+
+    /* lengths are one byte long, or four with the high bit set */
+    for (int i = 0; i < 2; i++) {
+        if (*cursor >= end)
+            return 0;
+
+        if (**cursor >> 7 == 0) {
+            *lengths[i] = *(*cursor)++;
+            continue;
+        }
+
+        if (end - *cursor < 4)
+            return 0;
+
+        *lengths[i] = ((*cursor)[0] & 0x7f) << 24 | (*cursor)[1] << 16 | (*cursor)[2] << 8 | (*cursor)[3];
+        *cursor    += 4;
+    }
+
+    if ((size_t)(end - *cursor) < *name_length + *value_length)
+        return 0;
+
+    *name    = *cursor;
+    *value   = *cursor + *name_length;
+    *cursor += *name_length + *value_length;
+
+    return 1;
+}
+
+/* Answer the web server asking what this application supports */
+void send_values(Connection *connection, unsigned char *data, size_t size)
+{
+    static struct {
+        char *name;
+        char *value;
+    } values[] = {
+        { "FCGI_MAX_CONNS",  "1024" },
+        { "FCGI_MAX_REQS",   "1024" },
+        { "FCGI_MPXS_CONNS", "1"    },
+    };
+
+    unsigned char  result[256];
+    size_t         length = 0;
+
+    unsigned char *cursor = data, *name, *value;
+    size_t         name_length, value_length;
+
+    while (next_pair(&cursor, data + size, &name, &name_length, &value, &value_length)) {
+        for (size_t i = 0; i < sizeof(values) / sizeof(*values); i++) {
+            size_t value_size = strlen(values[i].value);
+
+            if (name_length != strlen(values[i].name) || memcmp(name, values[i].name, name_length) != 0
+             || length + 2 + name_length + value_size > sizeof(result))
+                continue;
+
+            result[length++] = name_length;
+            result[length++] = value_size;
+
+            memcpy(result + length, name, name_length);
+            length += name_length;
+
+            memcpy(result + length, values[i].value, value_size);
+            length += value_size;
+        }
+    }
+
+    send_record(connection, FCGI_GET_VALUES_RESULT, 0, result, length);
+}
+
+/* Send the response to a request, and end it */
+void request_respond(Connection *connection, Request *request, char *status, char *response)
 {
-    printf("Status: 200 OK\r\n");
-    printf("\r\n");
-    printf("%s", response);
+    char   output[OUTPUT_SIZE];
+    size_t length = format_response(output, sizeof(output), status, response);
+
+    if (send_record(connection, FCGI_STDOUT, request->id, output, length) == 0
+     && send_record(connection, FCGI_STDOUT, request->id, NULL, 0) == 0)
+        send_end(connection, request->id, FCGI_REQUEST_COMPLETE);
+
+    request->done = 1;
+}
+
+/* Send the request body received so far to feuille */
+void request_flush(Request *request)
+{
+    if (!request->connected)
+        return;
+
+    while (request->pending_sent < request->pending_size) {
+        ssize_t sent = send(request->backend, request->pending + request->pending_sent,
+                            request->pending_size - request->pending_sent, 0);
+
+        if (sent < 0) {
+            /* feuille may have given up on the paste (e.g. too big): the rest of the body is dropped */
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                request->pending_size = 0;
+                request->pending_sent = 0;
+                request->shut         = 1;
+            }
+
+            return;
+        }
+
+        request->pending_sent += sent;
+    }
+
+    request->pending_size = 0;
+    request->pending_sent = 0;
+
+    /* feuille stores the paste once it gets EOF */
+    if (request->stdin_done && !request->shut) {
+        shutdown(request->backend, SHUT_WR);
+        request->shut = 1;
+    }
+}
+
+/* Check the parameters of a request, and connect to feuille */
+void request_start(Connection *connection, Request *request)
+{
+    char *method         = NULL;
+    char  content_length[32] = { 0 };
+
+    unsigned char *cursor = request->params, *name, *value;
+    size_t         name_length, value_length;
+
+    while (next_pair(&cursor, request->params + request->params_size, &name, &name_length, &value, &value_length)) {
+        if (name_length == 14 && memcmp(name, "REQUEST_METHOD", 14) == 0)
+            method = value_length == 4 && memcmp(value, "POST", 4) == 0 ? "POST" : "";
+
+        if (name_length == 14 && memcmp(name, "CONTENT_LENGTH", 14) == 0 && value_length < sizeof(content_length))
+            memcpy(content_length, value, value_length);
+    }
+
+    free(request->params);
+    request->params      = NULL;
+    request->params_size = 0;
+
+    /* get method */
+    if (method == NULL || strcmp(method, "POST") != 0) {
+        request_respond(connection, request, "405 Method Not Allowed", NULL);
+        return;
+    }
+
+    /* convert content length to a long long int */
+    errno = 0;
+    long long length = strtoll(content_length, NULL, 10);
+    if (length <= 0 || errno == ERANGE) {
+        request_respond(connection, request, "400 Bad Request", NULL);
+        return;
+    }
+
+    /* the body is sent as it arrives, once connected */
+    if ((request->backend = initialize_socket(ADDR, PORT, 1)) == -1)
+        request_respond(connection, request, "500 Internal Server Error", NULL);
 }
 
-void cgi_redirect(char *url)
+/* Handle a part of the body of a request (an empty one ends it) */
+void request_body(Request *request, unsigned char *data, size_t size)
 {
-    printf("Status: 301 Moved Permanently\r\n");
-    printf("Location: %s\r\n", url);
-    printf("%s\r\n", url);
+    if (request->shut)
+        return;
+
+    /* only called once the previous part has been sent */
+    if (size == 0) {
+        request->stdin_done   = 1;
+        request->pending_size = filter_end(&request->filter, request->pending);
+    } else {
+        request->pending_size = filter_body(&request->filter, (char *)data, size, request->pending);
+    }
+
+    request->pending_sent = 0;
+    request_flush(request);
+}
+
+/* Handle the readiness of the connection to feuille of a request */
+void request_backend(Connection *connection, Request *request, short events)
+{
+    /* the connection is over: check whether it succeeded */
+    if (!request->connected) {
+        int       error  = 0;
+        socklen_t length = sizeof(error);
+
+        if (getsockopt(request->backend, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+            request_respond(connection, request, "500 Internal Server Error", NULL);
+            return;
+        }
+
+        request->connected = 1;
+        request_flush(request);
+        return;
+    }
+
+    if (events & POLLOUT) {
+        request_flush(request);
+
+        if (request->done || !(events & (POLLIN | POLLHUP | POLLERR)))
+            return;
+    }
+
+    /* receive response from feuille (it may come before the end of the body, e.g. if the paste is too big) */
+    ssize_t size = recv(request->backend, request->response + request->response_size,
+                        sizeof(request->response) - 1 - request->response_size, 0);
+
+    if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    if (size > 0) {
+        request->response_size += size;
+
+        if (request->response_size < sizeof(request->response) - 1)
+            return;
+    }
+
+    request->response[request->response_size] = 0;
+
+    if (request->response_size > 0)
+        request_respond(connection, request, NULL, request->response);
+    else
+        request_respond(connection, request, "500 Internal Server Error", NULL);
+}
+
+/* Find a request, on the connection it's been made on */
+Request *find_request(Connection *connection, unsigned int id)
+{
+    for (Request *request = connection->requests; request != NULL; request = request->next)
+        if (request->id == id && !request->done)
+            return request;
+
+    return NULL;
+}
+
+/* Handle a record sent by the web server */
+void handle_record(Connection *connection, int type, unsigned int id, unsigned char *data, size_t size)
+{
+    Request *request = find_request(connection, id);
+
+    switch (type) {
+    case FCGI_GET_VALUES:
+        send_values(connection, data, size);
+        break;
+
+    case FCGI_BEGIN_REQUEST:
+        if (size < 8 || request != NULL)
+            break;
+
+        connection->keep_conn = data[2] & FCGI_KEEP_CONN;
+
+        if ((data[0] << 8 | data[1]) != FCGI_RESPONDER) {
+            send_end(connection, id, FCGI_UNKNOWN_ROLE);
+            break;
+        }
+
+        if ((request = calloc(1, sizeof(Request))) == NULL) {
+            send_end(connection, id, FCGI_OVERLOADED);
+            break;
+        }
+
+        request->id          = id;
+        request->backend     = -1;
+        request->next        = connection->requests;
+        connection->requests = request;
+        break;
+
+    case FCGI_ABORT_REQUEST:
+        if (request != NULL) {
+            send_end(connection, id, FCGI_REQUEST_COMPLETE);
+            request->done = 1;
+        }
+
+        break;
+
+    case FCGI_PARAMS:
+        if (request == NULL)
+            break;
+
+        /* an empty record ends the parameters */
+        if (size == 0) {
+            request_start(connection, request);
+            break;
+        }
+
+        void *tmp;
+        if ((tmp = realloc(request->params, request->params_size + size)) == NULL) {
+            request_respond(connection, request, "500 Internal Server Error", NULL);
+            break;
+        }
+
+        request->params = tmp;
+        memcpy(request->params + request->params_size, data, size);
+        request->params_size += size;
+        break;
+
+    case FCGI_STDIN:
+        /* requests that have already been answered don't need their body */
+        if (request != NULL && request->backend != -1)
+            request_body(request, data, size);
+
+        break;
+
+    default:
+        /* management records need an answer, other ones don't */
+        if (id == 0) {
+            unsigned char body[8] = { type, 0, 0, 0, 0, 0, 0, 0 };
+            send_record(connection, FCGI_UNKNOWN_TYPE, 0, body, sizeof(body));
+        }
+    }
+}
+
+/* Handle the complete records received on a connection */
+void connection_process(Connection *connection)
+{
+    size_t offset = 0;
+
+    while (!connection->closed && connection->size - offset >= FCGI_HEADER_SIZE) {
+        unsigned char *header = connection->buffer + offset;
+        size_t         size   = header[4] << 8 | header[5];
+        unsigned int   id     = header[2] << 8 | header[3];
+
+        if (header[0] != FCGI_VERSION_1) {
+            connection->closed = 1;
+            break;
+        }
+
+        if (connection->size - offset < FCGI_HEADER_SIZE + size + header[6])
+            break;
+
+        /* the body of a request waits until its previous part has been sent to feuille */
+        Request *request = find_request(connection, id);
+        if (header[1] == FCGI_STDIN && request != NULL && request->pending_size > 0)
+            break;
+
+        handle_record(connection, header[1], id, header + FCGI_HEADER_SIZE, size);
+        offset += FCGI_HEADER_SIZE + size + header[6];
+    }
+
+    memmove(connection->buffer, connection->buffer + offset, connection->size - offset);
+    connection->size -= offset;
+}
+
+/* Free the requests that are over, and the connections that are closed */
+void sweep(Connection **connections, int *count)
+{
+    for (Connection **link = connections; *link != NULL;) {
+        Connection *connection = *link;
+
+        for (Request **request_link = &connection->requests; *request_link != NULL;) {
+            Request *request = *request_link;
+
+            if (!request->done && !connection->closed) {
+                request_link = &request->next;
+                continue;
+            }
+
+            /* feuille would store a paste cut short by a close: the connection is reset instead */
+            if (request->backend != -1) {
+                if (!request->shut)
+                    setsockopt(request->backend, SOL_SOCKET, SO_LINGER, &(struct linger){ 1, 0 }, sizeof(struct linger));
+
+                close(request->backend);
+            }
+
+            *request_link = request->next;
+
+            free(request->params);
+            free(request);
+        }
+
+        if (!connection->closed) {
+            link = &connection->next;
+            continue;
+        }
+
+        close(connection->socket);
+
+        *link = connection->next;
+        (*count)--;
+
+        free(connection);
+    }
+}
+
+/* FastCGI responder: the web server connects to the socket it has given as stdin */
+int fastcgi_loop(int listener)
+{
+    Connection *connections = NULL;
+    int         count       = 0;
+
+    /* what each polled socket belongs to */
+    struct pollfd  *fds      = NULL;
+    Connection    **owners   = NULL;
+    Request       **requests = NULL;
+    size_t          capacity = 0;
+
+    /* feuille (or the web server) may close its connection at any time */
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        size_t needed = 1;
+        for (Connection *connection = connections; connection != NULL; connection = connection->next)
+            for (Request *request = connection->requests; request != NULL; request = request->next)
+                needed++;
+
+        needed += count;
+
+        if (needed > capacity) {
+            capacity = needed * 2;
+
+            void *tmp;
+            if ((tmp = realloc(fds, capacity * sizeof(*fds))) == NULL)
+                return 1;
+
+            fds = tmp;
+
+            if ((tmp = realloc(owners, capacity * sizeof(*owners))) == NULL)
+                return 1;
+
+            owners = tmp;
+
+            if ((tmp = realloc(requests, capacity * sizeof(*requests))) == NULL)
+                return 1;
+
+            requests = tmp;
+        }
+
+        /* connections from the web server, along with the connections to feuille of their requests */
+        size_t n = 0;
+
+        fds[n] = (struct pollfd){ .fd = listener, .events = count < MAX_CONNECTIONS ? POLLIN : 0 };
+        n++;
+
+        for (Connection *connection = connections; connection != NULL; connection = connection->next) {
+            int full = connection->size == sizeof(connection->buffer);
+
+            fds[n]      = (struct pollfd){ .fd = connection->socket, .events = full ? 0 : POLLIN };
+            owners[n]   = connection;
+            requests[n] = NULL;
+            n++;
+
+            for (Request *request = connection->requests; request != NULL; request = request->next) {
+                if (request->backend == -1)
+                    continue;
+
+                short events = POLLOUT;
+                if (request->connected)
+                    events = request->pending_size > 0 ? POLLIN | POLLOUT : POLLIN;
+
+                fds[n]      = (struct pollfd){ .fd = request->backend, .events = events };
+                owners[n]   = connection;
+                requests[n] = request;
+                n++;
+            }
+        }
+
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return 1;
+        }
+
+        /* nothing is freed until every event has been handled */
+        for (size_t i = 1; i < n; i++) {
+            Connection *connection = owners[i];
+            Request    *request    = requests[i];
+
+            if (fds[i].revents == 0 || connection->closed)
+                continue;
+
+            if (request == NULL) {
+                ssize_t size = recv(connection->socket, connection->buffer + connection->size,
+                                    sizeof(connection->buffer) - connection->size, 0);
+
+                if (size <= 0) {
+                    connection->closed = 1;
+                    continue;
+                }
+
+                connection->size += size;
+                connection_process(connection);
+                continue;
+            }
+
+            if (request->done)
+                continue;
+
+            request_backend(connection, request, fds[i].revents);
+
+            /* the records that were waiting for this request can be handled now */
+            if (request->done || request->pending_size == 0)
+                connection_process(connection);
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int         socket;
+            Connection *connection;
+
+            if ((socket = accept(listener, NULL, NULL)) != -1) {
+                if ((connection = calloc(1, sizeof(Connection))) == NULL) {
+                    close(socket);
+                } else {
+                    connection->socket = socket;
+                    connection->next   = connections;
+                    connections        = connection;
+                    count++;
+                }
+            }
+        }
+
+        sweep(&connections, &count);
+    }
 }
 
 /* main function */
 int main(void)
 {
-    cgi_init();
+    /* run by a FastCGI server (e.g. through spawn-fcgi): stdin is a listening socket */
+    struct sockaddr_in6 address;
+    socklen_t           address_length = sizeof(address);
+
+    if (getpeername(STDIN_FILENO, (struct sockaddr *)&address, &address_length) == -1 && errno == ENOTCONN)
+        return fastcgi_loop(STDIN_FILENO);
 
     /* get method */
     char *method;
@@ -139,50 +841,49 @@ int main(void)
 
     /* initialize socket */
     int socket;
-    if ((socket = initialize_socket(ADDR, PORT)) == -1)
+    if ((socket = initialize_socket(ADDR, PORT, 0)) == -1)
         cgi_die("500 Internal Server Error");
 
-    /* read paste from stdin */
-    char *request;
-    if ((request = calloc(length + 1, sizeof(char))) == NULL)
-        cgi_die("500 Internal Server Error");
+    /* send paste to feuille as it's read from stdin, without keeping it in memory */
+    Filter filter = { 0 };
+
+    char input[BUFSIZ];
+    char output[BUFSIZ + FIELD_SIZE];
+
+    for (long long left = length; left > 0;) {
+        ssize_t size;
+        if ((size = read(STDIN_FILENO, input, left < BUFSIZ ? left : BUFSIZ)) <= 0)
+            break;
 
-    read(STDIN_FILENO, request, length);
-    request[length] = 0;
+        left -= size;
 
-    /* remove `paste=' from request */
-    char *paste = request;
-    char *tmp;
-    if ((tmp = strstr(request, "=")) != NULL) {
-        length -= tmp + 1 - request;
-        paste   = tmp + 1;
+        if (send_all(socket, output, filter_body(&filter, input, size, output)) != 0)
+            cgi_die("500 Internal Server Error");
     }
 
-    /* remove all carriage returns from paste */
-    length -= remove_char(paste, '\r');
+    if (send_all(socket, output, filter_end(&filter, output)) != 0)
+        cgi_die("500 Internal Server Error");
 
-    /* send paste to feuille */
-    send(socket, paste, length, 0);
     shutdown(socket, SHUT_WR);
 
     /* receive response from feuille */
-    char *response;
-    if ((response = calloc(BUFSIZ + 1, sizeof(char))) == NULL)
-        cgi_die("500 Internal Server Error");
+    char   response[RESPONSE_SIZE];
+    size_t received = 0;
 
-    if (recv(socket, response, BUFSIZ, 0) > 0) {
-        /* check if responses starts with `http' */
-        if (strncmp(response, "http", 4) == 0)
-            cgi_redirect(response);
-        else
-            cgi_ok(response);
-    } else
-        cgi_error("500 Internal Server Error");
+    ssize_t size;
+    while (received < sizeof(response) - 1
+        && (size = recv(socket, response + received, sizeof(response) - 1 - received, 0)) > 0)
+        received += size;
+
+    response[received] = 0;
+
+    if (received > 0)
+        cgi_respond(NULL, response);
+    else
+        cgi_respond("500 Internal Server Error", NULL);
 
-    /* close socket, free variables and exit */
+    /* close socket and exit */
     close(socket);
-    free(response);
-    free(request);
 
     return 0;
 }
@@ -0,0 +1,306 @@
+/*
+ * compress.c
+ *  Storing a gzip-compressed copy of pastes, for web servers to send as is.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "compress.h"
+
+#ifdef HAVE_ZLIB
+
+#ifndef COSMOPOLITAN
+#include <errno.h>         /* for errno, EAGAIN, EINTR, EINVAL                */
+#include <fcntl.h>         /* for fcntl, open, F_SETFL, O_NONBLOCK, O_RDONLY  */
+#include <stdio.h>         /* for rename, snprintf, NULL                      */
+#include <stdlib.h>        /* for free, malloc, mkstemp                       */
+#include <string.h>        /* for memchr, memmove, strerror, strlen           */
+#include <sys/resource.h>  /* for setpriority, PRIO_PROCESS                   */
+#include <sys/stat.h>      /* for fchmod, fstat, futimens, stat               */
+#include <unistd.h>        /* for close, fsync, pipe, pread, read, unlink...  */
+#include <zlib.h>          /* for deflate*, z_stream, Z_*                     */
+#endif
+
+#include "bin.h"           /* for paste_path, PASTE_PATH_SIZE                 */
+#include "feuille.h"       /* for Settings, settings                          */
+#include "util.h"          /* for verbose, error                              */
+
+/* gzip's default: most of the gain, for a fraction of the time of the best level */
+#define LEVEL       6
+
+/* size of the chunks read from and written to disk */
+#define CHUNK_SIZE  65536
+
+/* IDs of the pastes to compress, sent by the workers to the compression process (NUL-terminated) */
+static int              handover[2] = { -1, -1 };
+
+/* functions declarations */
+static  long     deflate_file(int, int);
+static  int      compress_paste(char *);
+
+/**
+ * Compress a file into another, in the gzip format.
+ *   input: the file to read from.
+ *   output: the file to write to.
+ * -> the size of the compressed data, or -1 if an error occured.
+ */
+long deflate_file(int input, int output)
+{
+    static unsigned char in[CHUNK_SIZE];
+    static unsigned char out[CHUNK_SIZE];
+
+    z_stream stream = { 0 };
+
+    /* 16 more window bits for a gzip header */
+    if (deflateInit2(&stream, LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+
+    long total = 0;
+    int  flush = Z_NO_FLUSH;
+
+    while (flush != Z_FINISH) {
+        long size;
+        if ((size = read(input, in, sizeof(in))) < 0)
+            break;
+
+        stream.next_in  = in;
+        stream.avail_in = size;
+        flush           = size == 0 ? Z_FINISH : Z_NO_FLUSH;
+
+        do {
+            stream.next_out  = out;
+            stream.avail_out = sizeof(out);
+            deflate(&stream, flush);
+
+            long produced = sizeof(out) - stream.avail_out;
+            if (write(output, out, produced) != produced) {
+                flush = -1;
+                break;
+            }
+
+            total += produced;
+        } while (stream.avail_out == 0);
+
+        if (flush == -1)
+            break;
+    }
+
+    deflateEnd(&stream);
+    return flush == Z_FINISH ? total : -1;
+}
+
+/**
+ * Store the compressed copy of a paste, next to it (or instead of it).
+ *   id: the ID of the paste.
+ * -> 0 if done, -1 if not.
+ */
+int compress_paste(char *id)
+{
+    char path[PASTE_PATH_SIZE];
+    char compressed[PASTE_PATH_SIZE + sizeof(COMPRESSED_SUFFIX)];
+
+    if (paste_path(id, path, sizeof(path)) != 0)
+        return -1;
+
+    snprintf(compressed, sizeof(compressed), "%s" COMPRESSED_SUFFIX, path);
+
+    int input;
+    if ((input = open(path, O_RDONLY)) == -1)
+        return -1;
+
+    struct stat status;
+    if (fstat(input, &status) != 0) {
+        close(input);
+        return -1;
+    }
+
+    /* written aside, so that web servers never send a partial copy */
+    char temporary[] = ".tmp.XXXXXX";
+
+    int output;
+    if ((output = mkstemp(temporary)) == -1) {
+        close(input);
+        return -1;
+    }
+
+    long size = deflate_file(input, output);
+    close(input);
+
+    /* incompressible pastes (or tiny ones, because of the gzip header) are left alone */
+    if (size == -1 || size >= status.st_size) {
+        int error_code = errno;
+
+        close(output);
+        unlink(temporary);
+
+        errno = error_code;
+        return size == -1 ? -1 : 0;
+    }
+
+    /* same permissions and age as the paste, for the web server and the expiry */
+    struct timespec times[2] = { status.st_atim, status.st_mtim };
+
+    fchmod(output, 0644);
+    futimens(output, times);
+
+    /* the paste is only removed once its copy is safe on disk */
+    if ((settings.durability != DURABILITY_NONE && fsync(output) != 0) || rename(temporary, compressed) != 0) {
+        int error_code = errno;
+
+        close(output);
+        unlink(temporary);
+
+        errno = error_code;
+        return -1;
+    }
+
+    close(output);
+
+    if (settings.compression == COMPRESSION_GZIP)
+        unlink(path);
+
+    verbose(2, "paste `%s' compressed from %ld to %ld bytes.", id, (long)status.st_size, size);
+    return 0;
+}
+
+/**
+ * Decompress a compressed copy, for the clients that don't accept gzip.
+ *   file: the compressed file.
+ *   size: where to store the size of the paste.
+ * -> the paste, or NULL if an error occured. Needs to be freed.
+ */
+char *inflate_file(int file, unsigned long *size)
+{
+    struct stat status;
+    if (fstat(file, &status) != 0 || status.st_size < 18) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* the gzip trailer ends with the size of the paste (modulo 4GiB) */
+    unsigned char trailer[4];
+    if (pread(file, trailer, sizeof(trailer), status.st_size - 4) != sizeof(trailer))
+        return NULL;
+
+    *size = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | (unsigned long)trailer[3] << 24;
+
+    char *paste;
+    if ((paste = malloc(*size + 1)) == NULL)
+        return NULL;
+
+    z_stream stream = { 0 };
+    if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+        free(paste);
+        return NULL;
+    }
+
+    static unsigned char in[CHUNK_SIZE];
+
+    stream.next_out  = (unsigned char *)paste;
+    stream.avail_out = *size + 1;
+
+    int  result = Z_OK;
+    long length;
+    while (result == Z_OK && (length = read(file, in, sizeof(in))) > 0) {
+        stream.next_in  = in;
+        stream.avail_in = length;
+
+        result = inflate(&stream, Z_NO_FLUSH);
+    }
+
+    inflateEnd(&stream);
+
+    if (result != Z_STREAM_END || stream.total_out != *size) {
+        free(paste);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return paste;
+}
+
+/**
+ * Create the pipe the pastes to compress go through, before any worker is forked.
+ * -> 0 if done, -1 if not.
+ */
+int compress_initialize(void)
+{
+    if (pipe(handover) != 0)
+        return -1;
+
+    /* a worker never waits for the compression process */
+    if (fcntl(handover[1], F_SETFL, O_NONBLOCK) != 0) {
+        close(handover[0]);
+        close(handover[1]);
+
+        handover[0] = handover[1] = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Have a paste that has just been stored compressed by the compression process.
+ *   id: the ID of the paste.
+ */
+void compress_add(char *id)
+{
+    /* an ID is shorter than PIPE_BUF: it's written at once, never mixed with those of other workers */
+    long size = strlen(id) + 1;
+    long written;
+
+    while ((written = write(handover[1], id, size)) == -1 && errno == EINTR);
+
+    if (written == -1 && errno == EAGAIN)
+        error("compression is falling behind: paste `%s' is left uncompressed.", id);
+    else if (written != size)
+        error("could not queue paste `%s' for compression: %s", id, strerror(errno));
+}
+
+/**
+ * Compress the pastes stored by the workers, with the lowest priority. Never returns.
+ */
+void compress_loop(void)
+{
+    /* don't compete with the workers for the CPU */
+    setpriority(PRIO_PROCESS, 0, 19);
+
+    char          ids[4096];
+    unsigned long size = 0;
+
+    for (;;) {
+        long length;
+        if ((length = read(handover[0], ids + size, sizeof(ids) - size)) <= 0) {
+            if (length == -1 && errno != EINTR)
+                error("error while waiting for pastes to compress: %s", strerror(errno));
+
+            continue;
+        }
+
+        size += length;
+
+        char *id = ids;
+        char *end;
+        while ((end = memchr(id, 0, size - (id - ids))) != NULL) {
+            if (compress_paste(id) != 0)
+                error("error while compressing paste `%s': %s", id, strerror(errno));
+
+            id = end + 1;
+        }
+
+        /* the rest of an ID comes with the next read */
+        size -= id - ids;
+        memmove(ids, id, size);
+    }
+}
+
+#endif
@@ -0,0 +1,29 @@
+/*
+ * compress.h
+ *  compress.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+/* suffix of the compressed copy of a paste */
+#define COMPRESSED_SUFFIX ".gz"
+
+/* zlib is enabled in config.mk */
+#ifdef HAVE_ZLIB
+char    *inflate_file(int, unsigned long *);
+
+int      compress_initialize(void);
+void     compress_add(char *);
+
+void     compress_loop(void);
+#endif
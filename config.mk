@@ -7,12 +7,23 @@ MAN    = $(PREFIX)/share/man
 
 # includes and libs
 INCS = -I/usr/include -I.
-LIBS = -L/usr/lib -lc
+LIBS = -L/usr/lib -lc -lpthread
 
 # OpenBSD / FreeBSD (uncomment)
 #MAN  = $(PREFIX)/man
 #INCS = -I/usr/share/include -I.
-#LIBS = -L/usr/share/lib -lc
+#LIBS = -L/usr/share/lib -lc -lpthread
+
+# gzip compression of pastes, using zlib (comment to disable)
+ZLIB_FLAGS = -DHAVE_ZLIB
+ZLIB_LIBS  = -lz
+
+# TLS, using OpenSSL (3.0+) and kernel TLS on Linux (uncomment to enable)
+#TLS_FLAGS = -DHAVE_TLS
+#TLS_LIBS  = -lssl -lcrypto
+
+# most verbose level compiled in (0 leaves out every verbose message)
+VERBOSE_FLAGS = -DVERBOSE_MAX=3
 
 # compiler
 CC = cc
@@ -21,6 +32,7 @@ CC = cc
 CCFLAGS  = -std=c99 -nostdinc -fno-pie -fno-omit-frame-pointer \
            -mno-tls-direct-seg-refs -mno-red-zone              \
            -DVERSION=\"$(VERSION)\" -DCOSMOPOLITAN             \
+           $(VERBOSE_FLAGS)                                    \
            -I. -include cosmopolitan/cosmopolitan.h
 
 CLDFLAGS = -std=c99 -static -nostdlib -fno-pie -fno-omit-frame-pointer \
@@ -29,8 +41,8 @@ CLDFLAGS = -std=c99 -static -nostdlib -fno-pie -fno-omit-frame-pointer \
            cosmopolitan/crt.o cosmopolitan/ape-no-modify-self.o cosmopolitan/cosmopolitan.a
 
 # standard libc flags
-CCFLAGS$(COSMO)  = -std=c99 -DVERSION=\"$(VERSION)\" $(INCS)
-CLDFLAGS$(COSMO) = $(LIBS)
+CCFLAGS$(COSMO)  = -std=c99 -DVERSION=\"$(VERSION)\" $(INCS) $(ZLIB_FLAGS) $(TLS_FLAGS) $(VERBOSE_FLAGS)
+CLDFLAGS$(COSMO) = $(LIBS) $(ZLIB_LIBS) $(TLS_LIBS)
 
 # debug flags
 CFLAGS  = -g -Wall -Wextra -Wno-sign-compare -DDEBUG $(CCFLAGS)
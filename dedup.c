@@ -0,0 +1,372 @@
+/*
+ * dedup.c
+ *  Content-addressed deduplication of pastes.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "dedup.h"
+
+#ifndef COSMOPOLITAN
+#include <fcntl.h>     /* for open, O_APPEND, O_CREAT, O_RDONLY, O_WRONLY */
+#include <stdio.h>     /* for rename, BUFSIZ, NULL                        */
+#include <stdlib.h>    /* for free                                        */
+#include <string.h>    /* for memcmp, memcpy, strdup, strlen, strncmp      */
+#include <sys/stat.h>  /* for fstat, stat                                 */
+#include <unistd.h>    /* for close, pread, read, write                   */
+#endif
+
+#include "bin.h"       /* for paste_exists, paste_path, PASTE_PATH_SIZE   */
+#include "feuille.h"   /* for Settings, settings                          */
+#include "pack.h"      /* for pack_open                                   */
+#include "paste.h"     /* for Paste                                       */
+#include "util.h"      /* for hash_bytes, shared_alloc, HASH_INIT         */
+
+/* the journal of hashes, used to rebuild the table on startup */
+#define JOURNAL            ".dedup"
+#define JOURNAL_TEMPORARY  ".dedup.tmp"
+
+/* longer IDs aren't deduplicated */
+#define ID_MAX             32
+
+/* give up after that many slots */
+#define MAX_PROBES         64
+
+/* entry states */
+enum State {
+    ENTRY_EMPTY,
+    ENTRY_BUSY,
+    ENTRY_READY,
+    ENTRY_DELETED
+};
+
+/* a known paste, in the table shared by all workers */
+typedef struct Entry {
+    unsigned int         state;
+    unsigned long        size;
+    unsigned long long   hash;
+    char                 id[ID_MAX];
+} Entry;
+
+/* a known paste, in the journal */
+typedef struct Record {
+    unsigned long long   hash;
+    unsigned long        size;
+    char                 id[ID_MAX];
+} Record;
+
+static Entry           *entries = NULL;
+static unsigned long    mask    = 0;
+
+/* each worker opens the journal once */
+static int              journal = -1;
+
+/* functions declarations */
+static  int      insert(unsigned long long, unsigned long, char *);
+static  int      open_paste(char *, long long *, unsigned long *);
+static  int      is_equal(Paste *, char *);
+
+/**
+ * Create the table of known pastes, before any worker is forked.
+ *   size: the number of pastes the table should hold.
+ * -> 0 if done, -1 if not.
+ */
+int dedup_initialize(unsigned long size)
+{
+    unsigned long capacity = 1;
+    while (capacity < size * 2)
+        capacity <<= 1;
+
+    if ((entries = shared_alloc(capacity * sizeof(Entry))) == NULL)
+        return -1;
+
+    mask = capacity - 1;
+
+    return 0;
+}
+
+/**
+ * Add a paste to the table.
+ *   hash: the hash of the paste.
+ *   size: the size of the paste.
+ *   id: the ID of the paste.
+ * -> 1 if added, 0 if not.
+ */
+int insert(unsigned long long hash, unsigned long size, char *id)
+{
+    if (entries == NULL || strlen(id) >= ID_MAX)
+        return 0;
+
+    for (unsigned long i = 0; i < MAX_PROBES; i++) {
+        Entry *entry = &entries[(hash + i) & mask];
+        unsigned int state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+
+        if (state == ENTRY_READY && entry->hash == hash && entry->size == size) {
+            char other[ID_MAX];
+            memcpy(other, entry->id, ID_MAX);
+            other[ID_MAX - 1] = 0;
+
+            /* one copy of the content is enough, as long as it exists (it could have been deleted by hand) */
+            if (paste_exists(other))
+                return 0;
+
+        } else if (state != ENTRY_EMPTY && state != ENTRY_DELETED) {
+            continue;
+        }
+
+        /* take the entry, fill it, then make it visible to the other workers */
+        if (__atomic_compare_exchange_n(&entry->state, &state, ENTRY_BUSY, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            entry->hash = hash;
+            entry->size = size;
+            memcpy(entry->id, id, strlen(id) + 1);
+
+            __atomic_store_n(&entry->state, ENTRY_READY, __ATOMIC_RELEASE);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Fill the table using the journal, and rewrite the journal without the pastes that don't exist anymore.
+ * -> the number of pastes added, or -1 if an error occured.
+ */
+long dedup_load(void)
+{
+    long count = 0;
+
+    int file;
+    if ((file = open(JOURNAL, O_RDONLY)) != -1) {
+        Record record;
+        while (read(file, &record, sizeof(record)) == sizeof(record)) {
+            record.id[ID_MAX - 1] = 0;
+
+            if (paste_exists(record.id))
+                count += insert(record.hash, record.size, record.id);
+        }
+
+        close(file);
+    }
+
+    /* compact the journal */
+    if ((file = open(JOURNAL_TEMPORARY, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+        return -1;
+
+    for (unsigned long i = 0; i <= mask; i++) {
+        if (entries[i].state != ENTRY_READY)
+            continue;
+
+        Record record = { .hash = entries[i].hash, .size = entries[i].size };
+        memcpy(record.id, entries[i].id, ID_MAX);
+
+        if (write(file, &record, sizeof(record)) != sizeof(record)) {
+            close(file);
+            return -1;
+        }
+    }
+
+    close(file);
+
+    if (rename(JOURNAL_TEMPORARY, JOURNAL) != 0)
+        return -1;
+
+    return count;
+}
+
+/**
+ * Open a stored paste.
+ *   id: the ID of the paste.
+ *   start: where to store the offset of its content in the file.
+ *   size: where to store the size of its content.
+ * -> the file holding its content, or -1 if it doesn't exist.
+ */
+int open_paste(char *id, long long *start, unsigned long *size)
+{
+    char path[PASTE_PATH_SIZE];
+    int  file = -1;
+
+    *start = 0;
+    *size  = 0;
+
+    /* the paste is either a file of its own, or a part of a segment */
+    if (settings.storage == STORAGE_PACK) {
+        file = pack_open(id, start, size);
+
+    } else if (paste_path(id, path, sizeof(path)) == 0 && (file = open(path, O_RDONLY)) != -1) {
+        struct stat status;
+        *size = fstat(file, &status) == 0 ? (unsigned long)status.st_size : 0;
+    }
+
+    return file;
+}
+
+/**
+ * Compare the content of a paste with a paste on disk.
+ *   paste: the paste in question.
+ *   id: the ID of the paste on disk.
+ * -> 1 if they're the same, 0 if not.
+ */
+int is_equal(Paste *paste, char *id)
+{
+    long long     start;
+    unsigned long size;
+
+    int file;
+    if ((file = open_paste(id, &start, &size)) == -1)
+        return 0;
+
+    if (size != paste->size) {
+        close(file);
+        return 0;
+    }
+
+    char chunk[BUFSIZ];
+    char other[BUFSIZ];
+
+    long length;
+    unsigned long offset = 0;
+    while (offset < paste->size
+        && (length = pread(file, chunk, paste->size - offset < sizeof(chunk) ? paste->size - offset : sizeof(chunk),
+                           start + offset)) > 0) {
+        char *content = paste->buffer + offset;
+
+        if (paste->file != -1) {
+            if (pread(paste->file, other, length, offset) != length)
+                break;
+
+            content = other;
+        }
+
+        if (memcmp(chunk, content, length) != 0)
+            break;
+
+        offset += length;
+    }
+
+    close(file);
+    return offset == paste->size;
+}
+
+/**
+ * Find a paste with the same content.
+ *   paste: the paste in question, once fully received.
+ * -> the ID of the paste with the same content, or NULL if there's none. Needs to be freed.
+ */
+char *dedup_find(Paste *paste)
+{
+    if (entries == NULL)
+        return NULL;
+
+    for (unsigned long i = 0; i < MAX_PROBES; i++) {
+        Entry *entry = &entries[(paste->hash + i) & mask];
+        unsigned int state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+
+        if (state == ENTRY_EMPTY)
+            return NULL;
+
+        if (state != ENTRY_READY || entry->hash != paste->hash || entry->size != paste->size)
+            continue;
+
+        /* the hash could collide and the paste could have been deleted: check the content */
+        char id[ID_MAX];
+        memcpy(id, entry->id, ID_MAX);
+        id[ID_MAX - 1] = 0;
+
+        if (is_equal(paste, id))
+            return strdup(id);
+    }
+
+    return NULL;
+}
+
+/**
+ * Remember a paste that has just been stored.
+ *   paste: the paste in question.
+ *   id: the ID of the paste.
+ */
+void dedup_record(Paste *paste, char *id)
+{
+    if (!insert(paste->hash, paste->size, id))
+        return;
+
+    if (journal == -1 && (journal = open(JOURNAL, O_WRONLY | O_APPEND | O_CREAT, 0600)) == -1)
+        return;
+
+    /* small appends are atomic, no need to lock the journal */
+    Record record = { .hash = paste->hash, .size = paste->size };
+    memcpy(record.id, id, strlen(id) + 1);
+
+    write(journal, &record, sizeof(record));
+}
+
+/**
+ * Get the hash of a stored paste, e.g. before it's deleted.
+ *   id: the ID of the paste.
+ *   hash: where to store its hash.
+ *   size: where to store its size.
+ * -> 0 if done, -1 if not.
+ */
+int dedup_hash(char *id, unsigned long long *hash, unsigned long *size)
+{
+    if (entries == NULL)
+        return -1;
+
+    long long start;
+
+    int file;
+    if ((file = open_paste(id, &start, size)) == -1)
+        return -1;
+
+    char chunk[BUFSIZ];
+
+    long length;
+    unsigned long offset = 0;
+
+    *hash = HASH_INIT;
+    while (offset < *size
+        && (length = pread(file, chunk, *size - offset < sizeof(chunk) ? *size - offset : sizeof(chunk),
+                           start + offset)) > 0) {
+        *hash   = hash_bytes(*hash, chunk, length);
+        offset += length;
+    }
+
+    close(file);
+    return offset == *size ? 0 : -1;
+}
+
+/**
+ * Forget a paste that has been deleted, so that the next paste with the same content takes its place.
+ *   hash: the hash of the paste (see dedup_hash).
+ *   size: the size of the paste.
+ *   id: the ID of the paste.
+ */
+void dedup_remove(unsigned long long hash, unsigned long size, char *id)
+{
+    if (entries == NULL)
+        return;
+
+    for (unsigned long i = 0; i < MAX_PROBES; i++) {
+        Entry *entry = &entries[(hash + i) & mask];
+        unsigned int state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+
+        if (state == ENTRY_EMPTY)
+            return;
+
+        if (state != ENTRY_READY || entry->hash != hash || entry->size != size
+         || strncmp(entry->id, id, ID_MAX) != 0)
+            continue;
+
+        /* the entry stays in the way of the others, until it's taken again */
+        __atomic_compare_exchange_n(&entry->state, &state, ENTRY_DELETED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        return;
+    }
+}
@@ -0,0 +1,29 @@
+/*
+ * dedup.h
+ *  dedup.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+#include "paste.h"
+
+/* number of pastes deduplicated when the index is disabled (see `-x') */
+#define DEDUP_DEFAULT_SIZE 1048576
+
+int      dedup_initialize(unsigned long);
+long     dedup_load(void);
+
+char    *dedup_find(Paste *);
+void     dedup_record(Paste *, char *);
+
+int      dedup_hash(char *, unsigned long long *, unsigned long *);
+void     dedup_remove(unsigned long long, unsigned long, char *);
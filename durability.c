@@ -0,0 +1,324 @@
+/*
+ * durability.c
+ *  Making pastes durable before their URL is sent.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _GNU_SOURCE
+
+#include "durability.h"
+
+#ifndef COSMOPOLITAN
+#include <errno.h>     /* for errno, EINTR                                 */
+#include <fcntl.h>     /* for open, sync_file_range, O_CLOEXEC, O_DIREC... */
+#include <limits.h>    /* for PATH_MAX                                     */
+#include <pthread.h>   /* for pthread_create, pthread_detach, pthread_t    */
+#include <stdio.h>     /* for NULL                                         */
+#include <string.h>    /* for memcpy, strchr                               */
+#include <unistd.h>    /* for close, dup, fsync, pipe2, read, write        */
+#endif
+
+#include "feuille.h"   /* for Settings, settings                           */
+#include "metrics.h"   /* for metrics_count, metrics_spent                 */
+#include "util.h"      /* for verbose                                      */
+
+/* files kept open for the next group commit (past that, they're synced right away) */
+#define GROUP_SIZE 256
+
+/* what has been written by this worker since its last commit */
+typedef struct Commit {
+    int              files[GROUP_SIZE];  /* files and folders, with the group policy */
+    int              file_count;
+
+    unsigned long    pending;            /* pastes stored                            */
+    long long        spent;              /* microseconds                             */
+    int              failed;
+    int              status;             /* once synced                              */
+} Commit;
+
+/* the output folder, whose entries need to be synced too */
+static int              directory   = -1;
+
+/* the commit being filled, and the one being synced in the background (see durability_start) */
+static Commit           commits[2];
+static Commit          *current     = &commits[0];
+static Commit          *syncing     = NULL;
+
+/* the thread syncing the commits in the background, and how it's told about them */
+static int              requests[2] = { -1, -1 };
+static int              results[2]  = { -1, -1 };
+
+/* functions declarations */
+static  void        keep(int);
+static  void        commit_sync(Commit *);
+static  int         commit_report(Commit *);
+static  void       *sync_loop(void *);
+static  int         sync_start(void);
+
+/**
+ * Prepare the durability policy set in the settings, before any worker is forked.
+ * -> 0 if done, -1 if not.
+ */
+int durability_initialize(void)
+{
+    if (settings.durability == DURABILITY_NONE)
+        return 0;
+
+    if ((directory = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Keep a file open until the next group commit.
+ *   file: the file in question (closed once synced).
+ */
+void keep(int file)
+{
+    /* too many files at once: this one is synced on its own */
+    if (current->file_count == GROUP_SIZE) {
+        if (fsync(file) != 0)
+            current->failed = 1;
+
+        close(file);
+        return;
+    }
+
+    current->files[current->file_count++] = file;
+}
+
+/**
+ * Make the content of a new paste durable: right away if every paste has to be synced on its own, or on the next commit.
+ *   file: the file descriptor of the paste.
+ * -> 0 if done, -1 if not.
+ */
+int durability_file(int file)
+{
+    if (settings.durability == DURABILITY_NONE)
+        return 0;
+
+    long long start = monotonic_time();
+    int status      = 0;
+
+    /* the file can be closed before the commit: a copy of its descriptor is kept */
+    int copy;
+    if (settings.durability == DURABILITY_ALWAYS || (copy = dup(file)) == -1)
+        status = fsync(file);
+    else
+        keep(copy);
+
+    current->spent += monotonic_time() - start;
+    return status;
+}
+
+/**
+ * Remember that a paste has been stored, and needs to be committed before its URL is sent.
+ *   path: the path of the paste.
+ */
+void durability_add(char *path)
+{
+    if (settings.durability == DURABILITY_NONE)
+        return;
+
+    current->pending++;
+
+    /* with a fan-out layout, the folders of the paste need to be synced too (the output folder is synced on commit) */
+    long long start = monotonic_time();
+
+    char folder[PATH_MAX];
+    for (char *slash = strchr(path, '/'); slash != NULL && slash - path < (long)sizeof(folder); slash = strchr(slash + 1, '/')) {
+        memcpy(folder, path, slash - path);
+        folder[slash - path] = 0;
+
+        int file;
+        if ((file = open(folder, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+            current->failed = 1;
+            continue;
+        }
+
+        if (settings.durability == DURABILITY_GROUP) {
+            keep(file);
+            continue;
+        }
+
+        if (fsync(file) != 0)
+            current->failed = 1;
+
+        close(file);
+    }
+
+    current->spent += monotonic_time() - start;
+}
+
+/**
+ * Sync what a commit holds. With the group policy, the writeback of all its files is started at once,
+ * then they're synced one after the other. The output folder is synced last.
+ * Also run by the sync thread: nothing is logged.
+ *   commit: the commit in question.
+ */
+void commit_sync(Commit *commit)
+{
+    long long start = monotonic_time();
+    int status      = 0;
+
+#ifdef SYNC_FILE_RANGE_WRITE
+    for (int i = 0; i < commit->file_count; i++)
+        sync_file_range(commit->files[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+
+    for (int i = 0; i < commit->file_count; i++) {
+        if (fsync(commit->files[i]) != 0)
+            status = -1;
+
+        close(commit->files[i]);
+    }
+
+    commit->file_count = 0;
+
+    if (fsync(directory) != 0 || commit->failed)
+        status = -1;
+
+    commit->status = status;
+    commit->spent += monotonic_time() - start;
+}
+
+/**
+ * Account for a synced commit, and empty it.
+ *   commit: the commit in question.
+ * -> 0 if its pastes are durable, -1 if not.
+ */
+int commit_report(Commit *commit)
+{
+    int status = commit->status;
+
+    verbose(1, "%lu paste(s) made durable in %lldus.", commit->pending, commit->spent);
+
+    metrics_spent(PHASE_COMMIT, commit->spent);
+    if (status != 0)
+        metrics_count(COUNTER_WRITE_ERRORS, commit->pending);
+
+    commit->pending = 0;
+    commit->spent   = 0;
+    commit->failed  = 0;
+    commit->status  = 0;
+
+    return status;
+}
+
+/**
+ * Commit the pastes stored by this worker, so that they survive a crash.
+ * Their URL must only be sent once this is done.
+ * -> 0 if done, -1 if not.
+ */
+int durability_commit(void)
+{
+    if (current->pending == 0)
+        return 0;
+
+    commit_sync(current);
+    return commit_report(current);
+}
+
+/**
+ * Sync the commits handed over by the worker, one after the other. Never returns.
+ *   unused: nothing.
+ * -> nothing.
+ */
+void *sync_loop(void *unused)
+{
+    (void)unused;
+
+    Commit *commit;
+    for (;;) {
+        if (read(requests[0], &commit, sizeof(commit)) != sizeof(commit))
+            continue;
+
+        commit_sync(commit);
+
+        while (write(results[1], &commit, sizeof(commit)) == -1 && errno == EINTR);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the sync thread of this worker (after the fork: threads don't survive it).
+ * -> 0 if done, -1 if not.
+ */
+int sync_start(void)
+{
+    if (pipe2(requests, O_CLOEXEC) != 0)
+        return -1;
+
+    pthread_t thread;
+    if (pipe2(results, O_CLOEXEC) != 0 || pthread_create(&thread, NULL, sync_loop, NULL) != 0) {
+        close(requests[0]);
+        close(requests[1]);
+
+        if (results[0] != -1) {
+            close(results[0]);
+            close(results[1]);
+        }
+
+        requests[0] = requests[1] = results[0] = results[1] = -1;
+        return -1;
+    }
+
+    pthread_detach(thread);
+    return 0;
+}
+
+/**
+ * Start committing the pastes stored by this worker in the background, so that an event loop keeps going meanwhile.
+ * Only one commit can be in progress: the pastes stored in the meantime wait for the next one.
+ * -> a file descriptor that becomes readable once it's done, or -1 if it's already done. Either way, see durability_end.
+ */
+int durability_start(void)
+{
+    if (current->pending == 0)
+        return -1;
+
+    if (requests[0] == -1 && sync_start() != 0) {
+        commit_sync(current);
+        return -1;
+    }
+
+    syncing = current;
+    current = syncing == &commits[0] ? &commits[1] : &commits[0];
+
+    if (write(requests[1], &syncing, sizeof(syncing)) != sizeof(syncing)) {
+        current = syncing;
+        syncing = NULL;
+
+        commit_sync(current);
+        return -1;
+    }
+
+    return results[0];
+}
+
+/**
+ * Finish a commit started with durability_start, once its file descriptor is readable (or right away if there was none).
+ * -> 0 if its pastes are durable, -1 if not.
+ */
+int durability_end(void)
+{
+    if (syncing == NULL)
+        return current->pending == 0 ? 0 : commit_report(current);
+
+    Commit *commit;
+    while (read(results[0], &commit, sizeof(commit)) == -1 && errno == EINTR);
+
+    commit  = syncing;
+    syncing = NULL;
+
+    return commit_report(commit);
+}
@@ -0,0 +1,25 @@
+/*
+ * durability.h
+ *  durability.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+int      durability_initialize(void);
+
+int      durability_file(int);
+void     durability_add(char *);
+int      durability_commit(void);
+
+int      durability_start(void);
+int      durability_end(void);
@@ -0,0 +1,621 @@
+/*
+ * event.c
+ *  Event-driven (epoll) connection engine.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _GNU_SOURCE
+
+#include "event.h"
+
+#ifdef HAVE_EPOLL
+
+#include <errno.h>         /* for errno, EAGAIN, EFBIG, EINTR, ENOBUFS, EPR... */
+#include <fcntl.h>         /* for fcntl, F_GETFL, F_SETFL, O_NONBLOCK          */
+#include <stdlib.h>        /* for calloc, free                                 */
+#include <string.h>        /* for strdup, strerror, strlen                     */
+#include <sys/epoll.h>     /* for epoll_create1, epoll_ctl, epoll_wait, EPO... */
+#include <sys/resource.h>  /* for getrlimit, setrlimit, RLIMIT_NOFILE          */
+#include <sys/socket.h>    /* for accept4, recv, send, MSG_NOSIGNAL, SOCK_N... */
+#include <unistd.h>        /* for getpid                                       */
+
+#include "admission.h"     /* for admission_enter, admission_leave, admiss... */
+#include "batch.h"         /* for batch_idle, batch_over, batch_next           */
+#include "bin.h"           /* for store_paste, WRITE_ERROR                     */
+#include "durability.h"    /* for durability_start, durability_end             */
+#include "feuille.h"       /* for Settings, settings                           */
+#include "limit.h"         /* for limit_client, limit_admit, limit_charge, ... */
+#include "metrics.h"       /* for metrics_count, metrics_error, metrics_now... */
+#include "paste.h"         /* for Paste, paste_open, paste_receive, paste_c... */
+#include "post.h"          /* for post_response                                */
+#include "server.h"        /* for close_connection, read_error_response, ...   */
+#include "tls.h"           /* for tls_handshake, tls_free, HAVE_TLS            */
+#include "util.h"          /* for verbose, error, die, monotonic_time          */
+
+/* maximum number of events returned by a single epoll_wait */
+#define MAX_EVENTS 256
+
+/* connection states */
+enum State {
+    STATE_HANDSHAKE,
+    STATE_READING,
+    STATE_COMMITTING,
+    STATE_WRITING
+};
+
+/* a connection handled by the event loop */
+typedef struct Connection {
+    int                 socket;
+    enum State          state;
+
+    Paste               paste;
+
+    char               *response;
+    unsigned long       size;        /* bytes to send */
+    unsigned long       sent;
+
+    long long           deadline;    /* milliseconds, monotonic clock               */
+
+    long long           accepted;    /* microseconds, see metrics_now               */
+    long long           responding;
+
+    uint64_t            client;      /* see limit_client                            */
+
+#ifdef HAVE_TLS
+    Tls                *tls;         /* NULL once the kernel has the keys           */
+#endif
+
+    struct Connection  *prev;
+    struct Connection  *next;
+} Connection;
+
+/* connections, sorted by deadline (the timeout is the same for all of them) */
+static Connection *timers_head = NULL;
+static Connection *timers_tail = NULL;
+
+/* connections waiting for their paste to be committed (linked with next, out of the timer list) */
+static Connection *commits     = NULL;
+
+/* ... and those whose commit is in progress, in the background */
+static Connection *syncing     = NULL;
+
+/* the server socket, while it isn't watched for lack of file descriptors */
+static int         paused      = -1;
+
+/* functions declarations */
+static  void        timer_remove(Connection *);
+static  void        timer_append(Connection *);
+
+static  void        connection_accept(int, int);
+static  void        accept_resume(int);
+static  void        connection_close(int, Connection *);
+#ifdef HAVE_TLS
+static  void        connection_handshake(int, Connection *);
+#endif
+static  void        connection_read(int, Connection *);
+static  void        connection_finish(int, Connection *, int);
+static  void        connection_commit(int);
+static  void        connection_committed(int);
+static  void        connection_respond(int, Connection *, char *);
+static  void        connection_write(int, Connection *);
+
+/**
+ * Remove a connection from the timer list.
+ *   connection: the connection in question.
+ */
+void timer_remove(Connection *connection)
+{
+    if (connection->prev != NULL)
+        connection->prev->next = connection->next;
+    else if (timers_head == connection)
+        timers_head = connection->next;
+
+    if (connection->next != NULL)
+        connection->next->prev = connection->prev;
+    else if (timers_tail == connection)
+        timers_tail = connection->prev;
+
+    connection->prev = NULL;
+    connection->next = NULL;
+}
+
+/**
+ * (Re)arm the timer of a connection, by putting it at the end of the timer list.
+ *   connection: the connection in question.
+ */
+void timer_append(Connection *connection)
+{
+    /* no timeout, no timer */
+    if (settings.timeout == 0)
+        return;
+
+    timer_remove(connection);
+
+    connection->deadline = monotonic_time() / 1000 + settings.timeout * 1000LL;
+    connection->prev     = timers_tail;
+
+    if (timers_tail != NULL)
+        timers_tail->next = connection;
+    else
+        timers_head = connection;
+
+    timers_tail = connection;
+}
+
+/**
+ * Accept all pending connections.
+ *   epoll: the epoll instance.
+ *   server: the server socket.
+ */
+void connection_accept(int epoll, int server)
+{
+    struct sockaddr_storage address;
+    socklen_t               address_size = sizeof(address);
+
+    int socket;
+    while ((socket = accept4(server, (struct sockaddr *)&address, &address_size,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        address_size = sizeof(address);
+
+        /* turn away clients over their limits, before anything is allocated for them */
+        uint64_t client = limit_client((struct sockaddr *)&address);
+
+        if (!limit_admit(client)) {
+            limit_reject(socket);
+            close_connection(socket);
+            continue;
+        }
+
+        /* shed load when feuille can't keep up */
+        if (!admission_enter()) {
+            admission_reject(socket);
+            close_connection(socket);
+            continue;
+        }
+
+        verbose(1, "--- new incoming connection. connection ID: %d:%d ---", getpid(), socket);
+
+        Connection *connection;
+        if ((connection = calloc(1, sizeof(Connection))) == NULL) {
+            error("could not allocate a new connection.");
+            close_connection(socket);
+            admission_leave();
+            continue;
+        }
+
+        connection->socket   = socket;
+        connection->state    = settings.certificate != NULL ? STATE_HANDSHAKE : STATE_READING;
+        connection->accepted = metrics_now();
+        connection->client   = client;
+
+        metrics_count(COUNTER_CONNECTIONS, 1);
+
+        if (paste_open(&connection->paste) != 0) {
+            error("error while preparing to receive a paste: %s", strerror(errno));
+            close_connection(socket);
+            free(connection);
+            admission_leave();
+            continue;
+        }
+
+        /* watch the connection */
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, socket, &event) == -1) {
+            error("could not watch the new connection: %s", strerror(errno));
+            close_connection(socket);
+            paste_close(&connection->paste);
+            free(connection);
+            admission_leave();
+            continue;
+        }
+
+        timer_append(connection);
+    }
+
+    /* no file descriptor left: the connection would wake the loop up again and again, until one is closed */
+    if (errno == EMFILE || errno == ENFILE) {
+        error("no file descriptor left, accepting connections again once one is closed.");
+
+        if (epoll_ctl(epoll, EPOLL_CTL_DEL, server, NULL) == 0)
+            paused = server;
+
+        return;
+    }
+
+    /* EAGAIN means that there's nothing left to accept */
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        error("error while accepting incoming connection: %s", strerror(errno));
+}
+
+/**
+ * Watch the server socket again, once a file descriptor may be free.
+ *   epoll: the epoll instance.
+ */
+void accept_resume(int epoll)
+{
+    if (paused == -1)
+        return;
+
+    struct epoll_event event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, paused, &event) == 0)
+        paused = -1;
+}
+
+/**
+ * Close a connection and free everything associated with it.
+ *   epoll: the epoll instance.
+ *   connection: the connection in question.
+ */
+void connection_close(int epoll, Connection *connection)
+{
+    epoll_ctl(epoll, EPOLL_CTL_DEL, connection->socket, NULL);
+    close_connection(connection->socket);
+    accept_resume(epoll);
+
+    timer_remove(connection);
+
+#ifdef HAVE_TLS
+    tls_free(&connection->tls);
+#endif
+
+    paste_close(&connection->paste);
+    free(connection->response);
+    free(connection);
+
+    admission_leave();
+}
+
+#ifdef HAVE_TLS
+/**
+ * Go on with the TLS handshake of a connection, then receive its paste as usual.
+ *   epoll: the epoll instance.
+ *   connection: the connection in question.
+ */
+void connection_handshake(int epoll, Connection *connection)
+{
+    int status;
+    if ((status = tls_handshake(&connection->tls, connection->socket)) == -1) {
+        connection_close(epoll, connection);
+        return;
+    }
+
+    /* the connection is only watched for writing while the handshake waits for it */
+    if (status != TLS_WANT_READ) {
+        struct epoll_event event = { .events = status == TLS_WANT_WRITE ? EPOLLOUT : EPOLLIN, .data.ptr = connection };
+        epoll_ctl(epoll, EPOLL_CTL_MOD, connection->socket, &event);
+    }
+
+    if (status == 0)
+        connection->state = STATE_READING;
+
+    timer_append(connection);
+}
+#endif
+
+/**
+ * Read everything that's available on a connection.
+ *   epoll: the epoll instance.
+ *   connection: the connection in question.
+ */
+void connection_read(int epoll, Connection *connection)
+{
+    long size;
+    while ((size = paste_receive(&connection->paste, connection->socket)) > 0);
+
+    /* EOF: the whole paste has been received */
+    if (size == 0) {
+        verbose(1, "done reading paste from connection %d.", connection->socket);
+        connection_finish(epoll, connection, 0);
+        return;
+    }
+
+    /* nothing more to read for now, wait for the next event */
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        timer_append(connection);
+        return;
+    }
+
+    /* too big, rejected HTTP upload, or over the memory budget: the client is told so */
+    if (errno == EFBIG || errno == EPROTO || errno == ENOBUFS) {
+        int error_code = errno;
+        limit_charge(connection->client, &connection->paste);
+
+        error("error %d while reading paste from incoming connection.", error_code);
+        metrics_error(error_code);
+
+        connection_respond(epoll, connection, read_error_response(error_code));
+        return;
+    }
+
+    error("error while reading paste from connection %d: %s", connection->socket, strerror(errno));
+    connection_close(epoll, connection);
+}
+
+/**
+ * Store the paste received on a connection and respond to the client.
+ * Also used when the connection times out, like the blocking engine does.
+ *   epoll: the epoll instance.
+ *   connection: the connection in question.
+ *   timed_out: whether the connection timed out.
+ */
+void connection_finish(int epoll, Connection *connection, int timed_out)
+{
+    /* a persistent connection ending between two pastes has nothing left to answer */
+    if (batch_over(&connection->paste)) {
+        connection_close(epoll, connection);
+        return;
+    }
+
+    limit_charge(connection->client, &connection->paste);
+
+    if (paste_finish(&connection->paste) != 0) {
+        int error_code = errno == ENOENT && timed_out ? EAGAIN : errno;
+
+        error("error %d while reading paste from incoming connection.", error_code);
+        metrics_error(error_code);
+
+        connection_respond(epoll, connection, read_error_response(error_code));
+        return;
+    }
+
+    metrics_time(PHASE_RECEIVE, connection->accepted);
+
+    /* store paste and send its URL (or what went wrong) */
+    char *response;
+    if ((response = store_paste(&connection->paste)) == NULL) {
+        connection_close(epoll, connection);
+        return;
+    }
+
+    /* the URL is only sent once the paste is safe on disk, along with the other pastes of this round */
+    /* (a hangup is still reported while the commit is in progress: only once) */
+    if (settings.durability != DURABILITY_NONE) {
+        struct epoll_event event = { .events = EPOLLONESHOT, .data.ptr = connection };
+        epoll_ctl(epoll, EPOLL_CTL_MOD, connection->socket, &event);
+        timer_remove(connection);
+
+        connection->state    = STATE_COMMITTING;
+        connection->response = response;
+        connection->next     = commits;
+        commits              = connection;
+        return;
+    }
+
+    connection_respond(epoll, connection, response);
+    free(response);
+}
+
+/**
+ * Start committing the pastes stored during this round at once, without blocking the loop.
+ *   epoll: the epoll instance.
+ */
+void connection_commit(int epoll)
+{
+    syncing = commits;
+    commits = NULL;
+
+    int done;
+    if ((done = durability_start()) == -1) {
+        connection_committed(epoll);
+        return;
+    }
+
+    /* the same descriptor every time: it stays watched */
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &syncing };
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, done, &event) == -1 && errno != EEXIST)
+        connection_committed(epoll);
+}
+
+/**
+ * Respond to the clients whose pastes have been committed.
+ *   epoll: the epoll instance.
+ */
+void connection_committed(int epoll)
+{
+    int status;
+    if ((status = durability_end()) != 0)
+        error("error while committing pastes to disk: %s", strerror(errno));
+
+    while (syncing != NULL) {
+        Connection *connection = syncing;
+        char       *response   = connection->response;
+
+        syncing                = connection->next;
+        connection->next       = NULL;
+        connection->response   = NULL;
+
+        connection_respond(epoll, connection, status == 0 ? response : WRITE_ERROR);
+        free(response);
+    }
+}
+
+/**
+ * Start sending a response to the client.
+ *   epoll: the epoll instance.
+ *   connection: the connection in question.
+ *   response: the string to be sent. Copied.
+ */
+void connection_respond(int epoll, Connection *connection, char *response)
+{
+    connection->response = post_response(&connection->paste, response);
+
+    /* the paste isn't needed anymore, unless the connection is persistent */
+    if (!batch_next(&connection->paste))
+        paste_close(&connection->paste);
+
+    if (connection->response == NULL) {
+        connection_close(epoll, connection);
+        return;
+    }
+
+    connection->state      = STATE_WRITING;
+    connection->size       = strlen(connection->response);
+    connection->sent       = 0;
+    connection->responding = metrics_now();
+
+    verbose(1, "sending the response to the client...");
+
+    timer_append(connection);
+    connection_write(epoll, connection);
+}
+
+/**
+ * Send as much of the response as possible, and close the connection once it's done (or wait for its next pastes).
+ *   epoll: the epoll instance.
+ *   connection: the connection in question.
+ */
+void connection_write(int epoll, Connection *connection)
+{
+    long size;
+    while (connection->sent < connection->size) {
+        size = send(connection->socket, connection->response + connection->sent,
+                    connection->size - connection->sent, MSG_NOSIGNAL);
+
+        if (size < 0) {
+            /* socket buffer is full, wait until it's writable again */
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct epoll_event event = { .events = EPOLLOUT, .data.ptr = connection };
+                epoll_ctl(epoll, EPOLL_CTL_MOD, connection->socket, &event);
+                return;
+            }
+
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        connection->sent += size;
+    }
+
+    if (connection->sent == connection->size) {
+        verbose(1, "All done.");
+
+        metrics_time(PHASE_RESPOND, connection->responding);
+        metrics_time(PHASE_TOTAL, connection->accepted);
+
+        /* the paste has been kept by connection_respond: the connection is persistent */
+        if (connection->paste.batch != NULL) {
+            struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+            epoll_ctl(epoll, EPOLL_CTL_MOD, connection->socket, &event);
+
+            free(connection->response);
+
+            connection->state    = STATE_READING;
+            connection->response = NULL;
+            connection->accepted = metrics_now();
+
+            timer_append(connection);
+            return;
+        }
+    }
+
+    connection_close(epoll, connection);
+}
+
+/**
+ * Feuille's event loop.
+ * Every connection is a non-blocking state machine, so a single worker
+ * can handle as many concurrent connections as its memory permits.
+ *   server: the server socket.
+ */
+void event_loop(int server)
+{
+    /* connections are only limited by the number of file descriptors */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    /* the server socket must not block the loop */
+    fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+
+    int epoll;
+    if ((epoll = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        die(errno, "could not create epoll instance: %s.\n", strerror(errno));
+
+    /* only wake up one worker per incoming connection */
+    struct epoll_event event = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, server, &event) == -1)
+        die(errno, "could not watch server socket: %s.\n", strerror(errno));
+
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        /* wait until an event occurs or the oldest connection times out */
+        int timeout = -1;
+        if (timers_head != NULL) {
+            long long remaining = timers_head->deadline - monotonic_time() / 1000;
+            timeout = remaining > 0 ? remaining : 0;
+        }
+
+        /* the file descriptors may also be used up by other processes: accepting is tried again anyway */
+        if (paused != -1 && (timeout == -1 || timeout > ACCEPT_PAUSE))
+            timeout = ACCEPT_PAUSE;
+
+        int count;
+        if ((count = epoll_wait(epoll, events, MAX_EVENTS, timeout)) == -1 && errno != EINTR)
+            die(errno, "epoll_wait failed: %s.\n", strerror(errno));
+
+        if (count == 0)
+            accept_resume(epoll);
+
+        /* the clients of a finished commit are answered once the batch is done: a hangup of theirs may follow in it */
+        int committed = 0;
+
+        for (int i = 0; i < count; i++) {
+            Connection *connection = events[i].data.ptr;
+
+            if (connection == NULL) {
+                connection_accept(epoll, server);
+                continue;
+            }
+
+            if (events[i].data.ptr == &syncing) {
+                committed = 1;
+                continue;
+            }
+
+            if (connection->state == STATE_READING)
+                connection_read(epoll, connection);
+            else if (connection->state == STATE_WRITING)
+                connection_write(epoll, connection);
+#ifdef HAVE_TLS
+            else if (connection->state == STATE_HANDSHAKE)
+                connection_handshake(epoll, connection);
+#endif
+        }
+
+        if (committed)
+            connection_committed(epoll);
+
+        /* handle timeouts */
+        long long current = monotonic_time() / 1000;
+        while (timers_head != NULL && timers_head->deadline <= current) {
+            Connection *connection = timers_head;
+
+            /* persistent connections wait longer between two pastes */
+            if (connection->state == STATE_READING && batch_idle(&connection->paste))
+                timer_append(connection);
+
+            /* a timeout ends the paste, like in the blocking engine */
+            else if (connection->state == STATE_READING)
+                connection_finish(epoll, connection, 1);
+            else
+                connection_close(epoll, connection);
+        }
+
+        /* a single commit for every paste stored in this round (or since the previous commit began) */
+        if (commits != NULL && syncing == NULL)
+            connection_commit(epoll);
+    }
+}
+
+#endif
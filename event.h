@@ -0,0 +1,25 @@
+/*
+ * event.h
+ *  event.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+/* epoll is only available on Linux */
+#if defined __linux__ && !defined COSMOPOLITAN
+#define HAVE_EPOLL
+#endif
+
+#ifdef HAVE_EPOLL
+void     event_loop(int);
+#endif
@@ -0,0 +1,411 @@
+/*
+ * expiry.c
+ *  Deleting pastes once they're too old, a few at a time.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "expiry.h"
+
+#ifndef COSMOPOLITAN
+#include <dirent.h>        /* for opendir, readdir, closedir, DIR, dirent           */
+#include <errno.h>         /* for errno, ENOENT                                     */
+#include <fcntl.h>         /* for open, O_APPEND, O_CREAT, O_WRONLY, AT_FDCWD       */
+#include <limits.h>        /* for UCHAR_MAX                                         */
+#include <stdio.h>         /* for fopen, fgets, fclose, snprintf, FILE, NULL        */
+#include <stdlib.h>        /* for strtol, strtoul, strtoull                         */
+#include <string.h>        /* for strcat, strcpy, strchr, strcspn, strerror, strlen */
+#include <sys/resource.h>  /* for setpriority, PRIO_PROCESS                         */
+#include <sys/stat.h>      /* for mkdir, lstat, stat, utimensat, S_ISREG            */
+#include <time.h>          /* for time, nanosleep, timespec                         */
+#include <unistd.h>        /* for close, unlink, write, sleep                       */
+#endif
+
+#if defined __linux__ && !defined COSMOPOLITAN
+#include <sys/syscall.h>   /* for syscall, SYS_ioprio_set                           */
+#endif
+
+#include "bin.h"           /* for paste_path, walk_pastes, MAX_FAN_OUT, PASTE...    */
+#include "cache.h"         /* for cache_remove                                      */
+#include "compress.h"      /* for COMPRESSED_SUFFIX                                 */
+#include "dedup.h"         /* for dedup_hash, dedup_remove                          */
+#include "durability.h"    /* for durability_file                                   */
+#include "feuille.h"       /* for Settings, settings                                */
+#include "index.h"         /* for index_release                                     */
+#include "pack.h"          /* for pack_walk, pack_renew, pack_created, pack_ex...   */
+#include "util.h"          /* for verbose, error                                    */
+
+/* pastes are listed by creation time, in one file per time bucket, named after the end of the bucket */
+#define FOLDER          ".expiry"
+
+/* number of buckets spanning the retention time (each bucket lasts between 1 second and 1 hour) */
+#define BUCKET_COUNT    128
+#define BUCKET_MAX      3600
+
+/* pastes deleted before pausing, and how long to pause (milliseconds) */
+#define BATCH_SIZE      64
+#define BATCH_PAUSE     100
+
+/* how long to wait before looking for expired buckets again (seconds) */
+#define IDLE_TIME       60
+
+/* longest line of a bucket: an ID, then the hash and size of the paste if deduplicated */
+#define LINE_SIZE       (UCHAR_MAX + 40)
+
+/* bucket this worker is currently appending to */
+static int              bucket     = -1;
+static long             bucket_end = 0;
+
+/* functions declarations */
+static  long     bucket_width(void);
+static  void     record(char *, long, unsigned long long, unsigned long);
+static  int      seed(char *, char *);
+static  int      seed_pack(char *, long);
+static  long     oldest_bucket(void);
+static  int      expire(char *, unsigned long long, unsigned long);
+static  long     expire_bucket(long);
+
+/**
+ * Get the time span covered by a bucket.
+ * -> the width of a bucket, in seconds.
+ */
+long bucket_width(void)
+{
+    long width = settings.retention / BUCKET_COUNT;
+
+    if (width < 1)
+        return 1;
+
+    return width > BUCKET_MAX ? BUCKET_MAX : width;
+}
+
+/**
+ * List a paste in the bucket of its creation time.
+ *   id: the ID of the paste.
+ *   creation: the creation time of the paste.
+ *   hash: the hash of the paste.
+ *   size: the size of the paste, 0 if it isn't known.
+ */
+void record(char *id, long creation, unsigned long long hash, unsigned long size)
+{
+    long width = bucket_width();
+    long end   = (creation / width + 1) * width;
+
+    if (end != bucket_end) {
+        if (bucket != -1)
+            close(bucket);
+
+        char path[64];
+        snprintf(path, sizeof(path), FOLDER "/%ld", end);
+
+        bucket_end = end;
+        if ((bucket = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600)) == -1) {
+            error("could not open expiry bucket `%s': %s", path, strerror(errno));
+            return;
+        }
+    }
+
+    if (bucket == -1)
+        return;
+
+    /* with deduplication, its hash is kept along: it doesn't have to be read again to be forgotten */
+    /* (small appends are atomic, no need to lock the bucket) */
+    char line[LINE_SIZE];
+    int  length = settings.dedup != DEDUP_NONE && size != 0
+                ? snprintf(line, sizeof(line), "%s %llx %lu\n", id, hash, size)
+                : snprintf(line, sizeof(line), "%s\n", id);
+
+    if (write(bucket, line, length) != length)
+        error("could not list paste `%s' for expiry: %s", id, strerror(errno));
+}
+
+/**
+ * List a paste found on disk, using its modification time.
+ *   id: the ID of the paste.
+ *   path: the path of the paste.
+ * -> 1 if listed, 0 if not.
+ */
+int seed(char *id, char *path)
+{
+    struct stat status;
+    if (stat(path, &status) != 0)
+        return 0;
+
+    /* compressed copies are deleted along with their paste */
+    char paste[UCHAR_MAX + 1];
+    snprintf(paste, sizeof(paste), "%.*s", (int)strcspn(id, "."), id);
+
+    record(paste, status.st_mtime, 0, 0);
+    return 1;
+}
+
+/**
+ * List a paste found in the packs, using its creation time.
+ *   id: the ID of the paste.
+ *   created: the creation time of the paste.
+ * -> 1.
+ */
+int seed_pack(char *id, long created)
+{
+    record(id, created, 0, 0);
+    return 1;
+}
+
+/**
+ * Create the list of pastes to expire. If it's new, list the pastes already on disk.
+ * -> the number of pastes listed, or -1 if an error occured.
+ */
+long expiry_load(void)
+{
+    long count = 0;
+
+    if (mkdir(FOLDER, 0700) == 0)
+        count = settings.storage == STORAGE_PACK ? pack_walk(seed_pack) : walk_pastes(".", MAX_FAN_OUT, seed);
+    else if (errno != EEXIST)
+        return -1;
+
+    /* every worker opens its own bucket */
+    if (bucket != -1)
+        close(bucket);
+
+    bucket     = -1;
+    bucket_end = 0;
+
+    return count;
+}
+
+/**
+ * List a paste that has just been stored, so that it gets deleted once it expires.
+ *   id: the ID of the paste.
+ *   hash: the hash of the paste.
+ *   size: the size of the paste.
+ */
+void expiry_add(char *id, unsigned long long hash, unsigned long size)
+{
+    record(id, time(NULL), hash, size);
+
+    /* with a crash, an unlisted paste would never expire */
+    if (bucket != -1)
+        durability_file(bucket);
+}
+
+/**
+ * Give an existing paste a fresh lifetime, e.g. when its URL is sent again.
+ *   id: the ID of the paste.
+ *   hash: the hash of the paste.
+ *   size: the size of the paste.
+ * -> 0 if done, -1 if not (e.g. the paste has already been deleted).
+ */
+int expiry_renew(char *id, unsigned long long hash, unsigned long size)
+{
+    char path[PASTE_PATH_SIZE + sizeof(COMPRESSED_SUFFIX)];
+
+    if (settings.storage == STORAGE_PACK) {
+        if (pack_renew(id) != 0)
+            return -1;
+
+    } else {
+        if (paste_path(id, path, PASTE_PATH_SIZE) != 0 || utimensat(AT_FDCWD, path, NULL, 0) != 0)
+            return -1;
+
+        strcat(path, COMPRESSED_SUFFIX);
+        utimensat(AT_FDCWD, path, NULL, 0);
+    }
+
+    /* its previous entry will be skipped, as the paste is newer than its bucket */
+    expiry_add(id, hash, size);
+    return 0;
+}
+
+/**
+ * Find the bucket that expires first.
+ * -> the end of the oldest bucket, or -1 if there's none.
+ */
+long oldest_bucket(void)
+{
+    DIR *folder;
+    if ((folder = opendir(FOLDER)) == NULL)
+        return -1;
+
+    long oldest = -1;
+
+    struct dirent *entry;
+    while ((entry = readdir(folder)) != NULL) {
+        char *end;
+        long  value = strtol(entry->d_name, &end, 10);
+
+        if (*end == 0 && end != entry->d_name && (oldest == -1 || value < oldest))
+            oldest = value;
+    }
+
+    closedir(folder);
+    return oldest;
+}
+
+/**
+ * Delete a paste (and its compressed copy) if it's still expired.
+ *   id: the ID of the paste.
+ *   hash: the hash of the paste.
+ *   size: the size of the paste, 0 if it isn't known.
+ * -> 1 if deleted, 0 if not.
+ */
+int expire(char *id, unsigned long long hash, unsigned long size)
+{
+    if (*id == 0 || *id == '.' || strchr(id, '/') != NULL)
+        return 0;
+
+    /* its hash is needed to find it among the deduplicated pastes, once it's deleted */
+    /* (if it wasn't listed with it, its content is read again, only once it's known to be expired) */
+    int known = settings.dedup != DEDUP_NONE && size != 0;
+    int deleted = 0;
+
+    /* its space is reclaimed once most of its segment has expired */
+    if (settings.storage == STORAGE_PACK) {
+        if (settings.dedup != DEDUP_NONE && !known) {
+            long created;
+            if ((created = pack_created(id)) == -1 || created + (long)settings.retention > time(NULL))
+                return 0;
+
+            known = dedup_hash(id, &hash, &size) == 0;
+        }
+
+        if ((deleted = pack_expire(id)) && known)
+            dedup_remove(hash, size, id);
+
+        return deleted;
+    }
+
+    char path[2][PASTE_PATH_SIZE + sizeof(COMPRESSED_SUFFIX)];
+    if (paste_path(id, path[0], PASTE_PATH_SIZE) != 0)
+        return 0;
+
+    strcat(strcpy(path[1], path[0]), COMPRESSED_SUFFIX);
+
+    /* the paste could have been renewed, or replaced after a crash */
+    int expired[2];
+    for (int compressed = 0; compressed <= 1; compressed++) {
+        struct stat status;
+        expired[compressed] = lstat(path[compressed], &status) == 0 && S_ISREG(status.st_mode)
+                           && status.st_mtime + (long)settings.retention <= time(NULL);
+    }
+
+    if (!expired[0] && !expired[1])
+        return 0;
+
+    if (settings.dedup != DEDUP_NONE && !known)
+        known = dedup_hash(id, &hash, &size) == 0;
+
+    for (int compressed = 0; compressed <= 1; compressed++)
+        if (expired[compressed] && unlink(path[compressed]) == 0)
+            deleted = 1;
+
+    /* its ID can be used again, as it would be after a restart, and its content stored again */
+    if (deleted) {
+        index_release(id);
+
+        if (known)
+            dedup_remove(hash, size, id);
+    }
+
+    return deleted;
+}
+
+/**
+ * Delete the pastes of an expired bucket, pausing between batches, then the bucket itself.
+ *   end: the end of the bucket.
+ * -> the number of pastes deleted, or -1 if an error occured.
+ */
+long expire_bucket(long end)
+{
+    char path[64];
+    snprintf(path, sizeof(path), FOLDER "/%ld", end);
+
+    FILE *file;
+    if ((file = fopen(path, "r")) == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = BATCH_PAUSE * 1000000L };
+
+    long count = 0;
+    char line[LINE_SIZE];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\n")] = 0;
+
+        /* the hash and size of the paste, if it was listed with them */
+        unsigned long long hash = 0;
+        unsigned long      size = 0;
+
+        char *fields;
+        if ((fields = strchr(line, ' ')) != NULL) {
+            *fields++ = 0;
+            hash      = strtoull(fields, &fields, 16);
+            size      = strtoul(fields, NULL, 10);
+        }
+
+        if (!expire(line, hash, size))
+            continue;
+
+        /* its URL must not keep working from memory */
+        cache_remove(line);
+
+        if (++count % BATCH_SIZE == 0)
+            nanosleep(&pause, NULL);
+    }
+
+    fclose(file);
+
+    /* if interrupted, the bucket is read again: its deleted pastes are skipped */
+    if (unlink(path) != 0)
+        return -1;
+
+    return count;
+}
+
+/**
+ * Delete expired pastes continuously, with the lowest priority. Never returns.
+ */
+void expiry_loop(void)
+{
+    /* don't compete with the workers, neither for the CPU nor for the disk */
+    setpriority(PRIO_PROCESS, 0, 19);
+
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, 3 << 13 /* IOPRIO_CLASS_IDLE */);
+#endif
+
+    for (;;) {
+        long oldest = oldest_bucket();
+        long wait   = IDLE_TIME;
+
+        if (oldest != -1) {
+            long due = oldest + (long)settings.retention;
+            long now = time(NULL);
+
+            if (due <= now) {
+                long count;
+                if ((count = expire_bucket(oldest)) == -1) {
+                    error("error while expiring pastes: %s", strerror(errno));
+                } else {
+                    verbose(1, "%ld paste(s) expired.", count);
+
+                    if (count > 0 && settings.storage == STORAGE_PACK && pack_compact() == -1)
+                        error("error while compacting the packs: %s", strerror(errno));
+
+                    continue;
+                }
+            } else if (due - now < wait) {
+                wait = due - now;
+            }
+        }
+
+        sleep(wait);
+    }
+}
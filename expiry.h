@@ -0,0 +1,23 @@
+/*
+ * expiry.h
+ *  expiry.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+long     expiry_load(void);
+
+void     expiry_add(char *, unsigned long long, unsigned long);
+int      expiry_renew(char *, unsigned long long, unsigned long);
+
+void     expiry_loop(void);
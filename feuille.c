@@ -16,26 +16,43 @@
 #include "feuille.h"
 
 #ifndef COSMOPOLITAN
-#include <errno.h>     /* for errno, ERANGE, EAGAIN, EFBIG, ENOENT              */
-#include <grp.h>       /* for initgroups                                        */
-#include <limits.h>    /* for USHRT_MAX, ULONG_MAX, CHAR_MAX, PATH_MAX, UCHA... */
-#include <locale.h>    /* for NULL, setlocale, LC_ALL                           */
-#include <pwd.h>       /* for getpwnam, passwd                                  */
-#include <signal.h>    /* for signal, SIGPIPE, SIG_IGN                          */
-#include <stdio.h>     /* for puts                                              */
-#include <stdlib.h>    /* for strtoll, free, realpath, srand                    */
-#include <string.h>    /* for strerror, strlen                                  */
-#include <sys/stat.h>  /* for mkdir                                             */
-#include <sys/wait.h>  /* for wait                                              */
-#include <syslog.h>    /* for syslog, openlog, LOG_WARNING, LOG_NDELAY, LOG_... */
-#include <time.h>      /* for time                                              */
-#include <unistd.h>    /* for getuid, access, chdir, chown, chroot, close       */
+#include <errno.h>       /* for errno, ERANGE, EAGAIN, EFBIG, EMFILE, ...      */
+#include <grp.h>         /* for initgroups                                     */
+#include <limits.h>      /* for USHRT_MAX, ULONG_MAX, INT_MAX, CHAR_MAX, PA... */
+#include <locale.h>      /* for NULL, setlocale, LC_ALL                        */
+#include <pwd.h>         /* for getpwnam, passwd                               */
+#include <signal.h>      /* for signal, SIGPIPE, SIG_IGN                       */
+#include <stdio.h>       /* for puts                                           */
+#include <stdlib.h>      /* for calloc, strtod, strtoll, free, realpath, srand */
+#include <string.h>      /* for strcmp, strerror, strlen                       */
+#include <sys/stat.h>    /* for mkdir                                          */
+#include <sys/wait.h>    /* for wait                                           */
+#include <syslog.h>      /* for syslog, openlog, LOG_WARNING, LOG_NDELAY, L... */
+#include <time.h>        /* for nanosleep, time, timespec                      */
+#include <unistd.h>      /* for getuid, access, chdir, chown, chroot, close    */
 #endif
 
-#include "arg.h"       /* for EARGF, ARGBEGIN, ARGEND                           */
-#include "bin.h"       /* for create_url, generate_id, write_paste              */
-#include "server.h"    /* for send_response, accept_connection, close_connec... */
-#include "util.h"      /* for verbose, die, error                               */
+#include "admission.h"   /* for admission_initialize, admission_attach, adm... */
+#include "arg.h"         /* for EARGF, ARGBEGIN, ARGEND                        */
+#include "batch.h"       /* for batch_over, batch_next                         */
+#include "bin.h"         /* for store_paste, migrate_pastes, WRITE_ERROR, M... */
+#include "cache.h"       /* for cache_initialize, CACHE_MIN_SIZE, HAVE_CACHE   */
+#include "compress.h"    /* for compress_initialize, compress_loop, HAVE_ZLIB  */
+#include "dedup.h"       /* for dedup_initialize, dedup_load                   */
+#include "durability.h"  /* for durability_initialize, durability_commit      */
+#include "event.h"       /* for event_loop, HAVE_EPOLL                         */
+#include "expiry.h"      /* for expiry_load, expiry_loop                       */
+#include "http.h"        /* for http_loop                                      */
+#include "index.h"       /* for index_initialize, index_load                   */
+#include "limit.h"       /* for limit_initialize, limit_client, limit_admit... */
+#include "logger.h"      /* for logger_initialize, logger_attach, logger_loop  */
+#include "metrics.h"     /* for metrics_initialize, metrics_attach, metrics... */
+#include "pack.h"        /* for pack_initialize, pack_load, pack_export        */
+#include "paste.h"       /* for Paste, paste_open, paste_close, HAVE_SPLICE    */
+#include "server.h"      /* for send_response, accept_connection, close_con... */
+#include "tls.h"         /* for tls_initialize, tls_probe, tls_accept, HAV... */
+#include "uring.h"       /* for uring_loop, HAVE_IO_URING                      */
+#include "util.h"        /* for verbose, die, error                            */
 
 char    *argv0;
 
@@ -45,13 +62,43 @@ Settings settings = {
     .url                = "http://localhost",
     .output             = "/var/www/feuille",
     .user               = "www",
+    .certificate        = NULL,
+    .key                = NULL,
 
     .id_length          = 4,
+    .fan_out            = 0,
     .worker_count       = 4,
     .port               = 9999,
+    .http_port          = 0,
+    .stats_port         = 0,
+    .backlog            = 1024,
     .timeout            = 2,
+    .idle_timeout       = 0,
     .max_size           = 1048576, /* = 1MiB   = 1024 * 1024 */
     .buffer_size        = 131072,  /* = 128KiB = 1024 * 128  */
+    .index_size         = 1048576,
+    .retention          = 0,
+    .cache_size         = 0,
+
+    .max_uploads        = 0,
+    .memory_budget      = 0,
+    .queue_delay        = 0,
+
+    .request_rate       = 0,
+    .request_burst      = 0,
+    .byte_rate          = 0,
+    .byte_burst         = 0,
+
+    .engine             = ENGINE_BLOCKING,
+    .ingest             = INGEST_MEMORY,
+    .reuse_port         = 0,
+    .huge_pages         = 0,
+    .dedup              = DEDUP_NONE,
+    .durability         = DURABILITY_NONE,
+    .compression        = COMPRESSION_NONE,
+    .storage            = STORAGE_FILES,
+    .migrate            = 0,
+    .export             = 0,
 
     .verbose            = 0,
     .foreground         = 0
@@ -60,7 +107,12 @@ Settings settings = {
 /* functions declarations */
 static  void     usage(int exit_code);
 static  void     version(void);
+static  int      parse_rate(char *, double *, double *);
 static  void     accept_loop(int);
+static  void     run_worker(int);
+static  int      slot_server(int, int);
+static  void     close_servers(int *, int, int);
+static  void     run_slot(int *, int, int);
 
 /**
  * Display feuille's basic usage.
@@ -68,7 +120,7 @@ static  void     accept_loop(int);
  */
 void usage(int exit_code)
 {
-    die(exit_code, "usage: %s [-abfhiopstuUvVw]\n"
+    die(exit_code, "usage: %s [-abBcCdDeEfFghHikKlLmMoOpPqrRsStuUvVwxXz]\n"
                    "       see `man feuille'.\n", argv0);
 }
 
@@ -80,6 +132,30 @@ void version(void)
     die(0, "%s %s by Tom MTT. <tom@heimdall.pm>\n", argv0, VERSION);
 }
 
+/**
+ * Parse a rate limit, as `rate[/burst]'. The burst is one second worth of the rate by default.
+ *   string: the string in question.
+ *   rate: where to store the rate (per second).
+ *   burst: where to store the burst.
+ * -> 0 if done, -1 if the string is invalid.
+ */
+int parse_rate(char *string, double *rate, double *burst)
+{
+    char *end;
+
+    errno = 0;
+    *rate = strtod(string, &end);
+    *burst = *rate;
+
+    if (*end == '/')
+        *burst = strtod(end + 1, &end);
+
+    if (*end != 0 || errno == ERANGE || *rate < 0 || (*rate > 0 && *burst < 1))
+        return -1;
+
+    return 0;
+}
+
 /**
  * Feuille's accept loop.
  *   server: the server socket.
@@ -89,88 +165,208 @@ void accept_loop(int server)
     /* get current process' pid */
     int pid = getpid();
 
-    /* feed the random number god */
-    srand(time(0) + pid);
-
     /* accept loop */
+    struct sockaddr_storage address;
+
     int connection;
-    while ((connection = accept_connection(server))) {
+    while ((connection = accept_connection(server, &address))) {
         /* check if the socket is invalid */
         if (connection == -1) {
-            error("error while accepting incoming connection: %s", strerror(errno));
+            int error_code = errno;
+            error("error while accepting incoming connection: %s", strerror(error_code));
+
+            /* no file descriptor left: wait for other processes to close some */
+            if (error_code == EMFILE || error_code == ENFILE)
+                nanosleep(&(struct timespec){ ACCEPT_PAUSE / 1000, ACCEPT_PAUSE % 1000 * 1000000L }, NULL);
+
             continue;
         }
 
+        /* turn away clients over their limits, before anything is allocated for them */
+        uint64_t client = limit_client((struct sockaddr *)&address);
+
+        if (!limit_admit(client)) {
+            limit_reject(connection);
+            close_connection(connection);
+            continue;
+        }
+
+        /* shed load when feuille can't keep up */
+        if (!admission_enter()) {
+            admission_reject(connection);
+            close_connection(connection);
+            continue;
+        }
+
+#ifdef HAVE_TLS
+        /* the kernel takes the keys over, the connection is used as is afterwards */
+        if (settings.certificate != NULL && tls_accept(connection) != 0) {
+            close_connection(connection);
+            admission_leave();
+            continue;
+        }
+#endif
+
         verbose(1, "--- new incoming connection. connection ID: %d:%d ---", pid, time(0));
 
-        unsigned long paste_size = 0;
+        metrics_count(COUNTER_CONNECTIONS, 1);
+        long long accepted = metrics_now();
 
-        char *paste = NULL;
-        char *id    = NULL;
-        char *url   = NULL;
+        Paste paste;
+        char *response = NULL;
 
-        /* read paste from connection */
-        verbose(1, "reading paste from incoming connection...");
+        if (paste_open(&paste) != 0) {
+            error("error while preparing to receive a paste: %s", strerror(errno));
+            close_connection(connection);
+            admission_leave();
+            continue;
+        }
 
-        if ((paste_size = read_paste(connection, &paste)) != 0) {
-            /* generate random ID */
-            verbose(1, "done.");
-            verbose(2, "generating a random ID...");
+        /* persistent connections go on with their next pastes (see batch_next) */
+        for (;;) {
+            /* read paste from connection */
+            verbose(1, "reading paste from incoming connection...");
 
-            if ((id = generate_id(settings.id_length)) != NULL) {
-                /* write paste to disk */
-                verbose(2, "done.");
-                verbose(1, "writing paste `%s' to disk...", id);
+            unsigned long size = read_paste(connection, &paste);
 
-                if (write_paste(paste, paste_size, id) == 0) {
-                    /* create URL */
-                    verbose(1, "done.");
-                    verbose(2, "making the right URL...");
+            /* a persistent connection ending between two pastes has nothing left to answer */
+            if (size == 0 && batch_over(&paste))
+                break;
 
-                    if ((url = create_url(id)) != NULL) {
-                        /* send URL */
-                        verbose(2, "done.", url);
-                        verbose(1, "sending the link to the client...");
+            limit_charge(client, &paste);
 
-                        send_response(connection, url);
+            if (size != 0) {
+                verbose(1, "done.");
+                metrics_time(PHASE_RECEIVE, accepted);
 
-                        verbose(1, "All done.");
+                /* store paste and send its URL (or what went wrong), once it's safe on disk */
+                if ((response = store_paste(&paste)) != NULL && durability_commit() != 0) {
+                    error("error while committing paste to disk: %s", strerror(errno));
 
-                        free(url);
-                    } else {
-                        error("error while making a valid URL.");
-                        send_response(connection, "Could not create your paste URL.\nPlease try again later.\n");
-                    }
-                } else {
-                    error("error while writing paste to disk.");
-                    send_response(connection, "Could not write your paste to disk.\nPlease try again later.\n");
+                    free(response);
+                    response = strdup(WRITE_ERROR);
                 }
 
-                free(id);
+                if (response != NULL) {
+                    verbose(1, "sending the response to the client...");
+
+                    long long responding = metrics_now();
+                    send_response(connection, &paste, response);
+
+                    metrics_time(PHASE_RESPOND, responding);
+                    metrics_time(PHASE_TOTAL, accepted);
+
+                    verbose(1, "All done.");
+
+                    free(response);
+                }
             } else {
-                error("error while generating a random ID.");
-                send_response(connection, "Could not generate your paste ID.\nPlease try again later.\n");
-            }
+                metrics_error(errno);
 
-            free(paste);
-        } else {
-            if (errno == EFBIG)
-                send_response(connection, "Paste too big.\n");
+                if ((response = read_error_response(errno)) != NULL) {
+                    long long responding = metrics_now();
+                    send_response(connection, &paste, response);
 
-            if (errno == ENOENT)
-                send_response(connection, "Empty paste.\n");
+                    metrics_time(PHASE_RESPOND, responding);
+                    metrics_time(PHASE_TOTAL, accepted);
+                }
 
-            if (errno == EAGAIN)
-                send_response(connection, "Timeout'd.\n");
+                error("error %d while reading paste from incoming connection.", errno);
+            }
+
+            if (!batch_next(&paste))
+                break;
 
-            error("error %d while reading paste from incoming connection.", errno);
+            accepted = metrics_now();
         }
 
+        paste_close(&paste);
+
         /* close connection */
         close_connection(connection);
+        admission_leave();
     }
 }
 
+/**
+ * Run a worker with the engine set in the settings.
+ *   server: the server socket.
+ */
+void run_worker(int server)
+{
+    /* feed the random number god */
+    srand(time(0) + getpid());
+
+#ifdef HAVE_EPOLL
+    if (settings.engine == ENGINE_EPOLL) {
+        event_loop(server);
+        return;
+    }
+#endif
+
+#ifdef HAVE_IO_URING
+    if (settings.engine == ENGINE_URING) {
+        uring_loop(server);
+
+        /* io_uring can be missing or disabled at runtime */
+        error("io_uring is unavailable (%s), falling back to the blocking engine.", strerror(errno));
+    }
+#endif
+
+    accept_loop(server);
+}
+
+/**
+ * Get the server socket of a slot of the pool.
+ *   slot: the slot in question.
+ *   server_count: the number of server sockets of each kind.
+ * -> the index of its socket.
+ */
+int slot_server(int slot, int server_count)
+{
+    if (slot < settings.worker_count)
+        return slot % server_count;
+
+    return server_count + (slot - settings.worker_count) % server_count;
+}
+
+/**
+ * Close the server sockets a process doesn't accept connections from.
+ * With SO_REUSEPORT, the kernel would keep sending connections to a socket as long as any process has it open.
+ *   servers: the server sockets.
+ *   count: the number of server sockets.
+ *   keep: the socket to keep open, or -1.
+ */
+void close_servers(int *servers, int count, int keep)
+{
+    for (int i = 0; i < count; i++)
+        if (i != keep && servers[i] != -1)
+            close(servers[i]);
+}
+
+/**
+ * Run the worker of a slot of the pool: the first slots receive pastes, the others (if any) serve them over HTTP.
+ *   servers: the server sockets, for pastes then for HTTP.
+ *   server_count: the number of server sockets of each kind.
+ *   slot: the slot in question.
+ */
+void run_slot(int *servers, int server_count, int slot)
+{
+    int server = slot_server(slot, server_count);
+    close_servers(servers, server_count * (settings.http_port != 0 ? 2 : 1), server);
+
+    logger_attach(slot);
+    metrics_attach(slot);
+    admission_attach(slot);
+
+    if (slot < settings.worker_count) {
+        run_worker(servers[server]);
+        return;
+    }
+
+    http_loop(servers[server]);
+}
+
 /**
  * Feuille's main function.
  *   argc: the argument count.
@@ -213,16 +409,146 @@ int main(int argc, char *argv[])
         settings.buffer_size = tmp;
         break;
 
+    case 'B':
+        /* set bytes per second (and burst) of each client */
+        if (parse_rate(EARGF(usage(1)), &settings.byte_rate, &settings.byte_burst) != 0)
+            die(ERANGE, "invalid byte rate.\n"
+                        "see `man feuille'.\n");
+        break;
+
+    case 'c':
+        /* set max concurrent uploads */
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp < 0 || tmp > LONG_MAX || errno == ERANGE)
+            die(ERANGE, "invalid upload count.\n"
+                        "see `man feuille'.\n");
+
+        settings.max_uploads = tmp;
+        break;
+
+    case 'C':
+        /* set TLS certificate */
+#ifdef HAVE_TLS
+        settings.certificate = EARGF(usage(1));
+#else
+        die(1, "TLS isn't supported by this build.\n"
+               "see `man feuille'.\n");
+#endif
+        break;
+
+    case 'd':
+        /* enable deduplication */
+        tmp = -1;
+        char *dedup = EARGF(usage(1));
+
+        if (strcmp(dedup, "url") == 0)
+            tmp = DEDUP_URL;
+
+        if (strcmp(dedup, "link") == 0)
+            tmp = DEDUP_LINK;
+
+        if (tmp == -1)
+            die(1, "invalid deduplication mode `%s'.\n"
+                   "see `man feuille'.\n", dedup);
+
+        settings.dedup = tmp;
+        break;
+
+    case 'D':
+        /* set durability policy */
+        tmp = -1;
+        char *durability = EARGF(usage(1));
+
+        if (strcmp(durability, "none") == 0)
+            tmp = DURABILITY_NONE;
+
+        if (strcmp(durability, "always") == 0)
+            tmp = DURABILITY_ALWAYS;
+
+        if (strcmp(durability, "group") == 0)
+            tmp = DURABILITY_GROUP;
+
+        if (tmp == -1)
+            die(1, "invalid or unsupported durability policy `%s'.\n"
+                   "see `man feuille'.\n", durability);
+
+        settings.durability = tmp;
+        break;
+
+    case 'e':
+        /* set connection engine */
+        tmp = -1;
+        char *engine = EARGF(usage(1));
+
+        if (strcmp(engine, "blocking") == 0)
+            tmp = ENGINE_BLOCKING;
+
+#ifdef HAVE_EPOLL
+        if (strcmp(engine, "epoll") == 0)
+            tmp = ENGINE_EPOLL;
+#endif
+
+#ifdef HAVE_IO_URING
+        if (strcmp(engine, "uring") == 0)
+            tmp = ENGINE_URING;
+#endif
+
+        if (tmp == -1)
+            die(1, "invalid or unsupported engine `%s'.\n"
+                   "see `man feuille'.\n", engine);
+
+        settings.engine = tmp;
+        break;
+
+    case 'E':
+        /* set retention time */
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp < 0 || tmp > INT_MAX || errno == ERANGE)
+            die(ERANGE, "invalid retention time.\n"
+                        "see `man feuille'.\n");
+
+        settings.retention = tmp;
+        break;
+
     case 'f':
         /* enable foreground execution */
         settings.foreground = 1;
         break;
 
+    case 'F':
+        /* set fan-out levels */
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp < 0 || tmp > MAX_FAN_OUT || errno == ERANGE)
+            die(ERANGE, "invalid fan-out.\n"
+                        "see `man feuille'.\n");
+
+        settings.fan_out = tmp;
+        break;
+
+    case 'g':
+        /* set HTTP port */
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp < 0 || tmp > USHRT_MAX || errno == ERANGE)
+            die(ERANGE, "invalid HTTP port.\n"
+                        "see `man feuille'.\n");
+
+        settings.http_port = tmp;
+        break;
+
     case 'h':
         /* get help */
         usage(0);
         break;
 
+    case 'H':
+        /* back large receive buffers with huge pages */
+        settings.huge_pages = 1;
+        break;
+
     case 'i':
         /* set id length */
         tmp = strtoll(EARGF(usage(1)), NULL, 10) + 1;
@@ -234,11 +560,108 @@ int main(int argc, char *argv[])
         settings.id_length = tmp;
         break;
 
+    case 'k':
+        /* set memory budget */
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp < 0 || tmp > LONG_MAX || errno == ERANGE)
+            die(ERANGE, "invalid memory budget.\n"
+                        "see `man feuille'.\n");
+
+        settings.memory_budget = tmp;
+        break;
+
+    case 'K':
+        /* set idle timeout of persistent connections */
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp < 0 || tmp > UINT_MAX || errno == ERANGE)
+            die(ERANGE, "invalid idle timeout.\n"
+                        "see `man feuille'.\n");
+
+        settings.idle_timeout = tmp;
+        break;
+
+    case 'l':
+        /* set listen backlog */
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp <= 0 || tmp > INT_MAX || errno == ERANGE)
+            die(ERANGE, "invalid backlog.\n"
+                        "see `man feuille'.\n");
+
+        settings.backlog = tmp;
+        break;
+
+    case 'L':
+        /* set cache size */
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if ((tmp != 0 && tmp < CACHE_MIN_SIZE) || tmp > LONG_MAX || errno == ERANGE)
+            die(ERANGE, "invalid cache size.\n"
+                        "see `man feuille'.\n");
+
+#ifndef HAVE_CACHE
+        if (tmp != 0)
+            die(1, "the cache isn't supported on this system.\n"
+                   "see `man feuille'.\n");
+#endif
+
+        settings.cache_size = tmp;
+        break;
+
+    case 'm':
+        /* set ingest mode */
+        tmp = -1;
+        char *ingest = EARGF(usage(1));
+
+        if (strcmp(ingest, "memory") == 0)
+            tmp = INGEST_MEMORY;
+
+        if (strcmp(ingest, "stream") == 0)
+            tmp = INGEST_STREAM;
+
+#ifdef HAVE_SPLICE
+        if (strcmp(ingest, "splice") == 0)
+            tmp = INGEST_SPLICE;
+#endif
+
+        if (tmp == -1)
+            die(1, "invalid or unsupported ingest mode `%s'.\n"
+                   "see `man feuille'.\n", ingest);
+
+        settings.ingest = tmp;
+        break;
+
+    case 'M':
+        /* move existing pastes to the storage layout, then exit */
+        settings.migrate    = 1;
+        settings.foreground = 1;
+        break;
+
     case 'o':
         /* set output folder */
         settings.output = EARGF(usage(1));
         break;
 
+    case 'O':
+        /* set storage engine */
+        tmp = -1;
+        char *storage = EARGF(usage(1));
+
+        if (strcmp(storage, "files") == 0)
+            tmp = STORAGE_FILES;
+
+        if (strcmp(storage, "pack") == 0)
+            tmp = STORAGE_PACK;
+
+        if (tmp == -1)
+            die(1, "invalid storage engine `%s'.\n"
+                   "see `man feuille'.\n", storage);
+
+        settings.storage = tmp;
+        break;
+
     case 'p':
         /* set port */
         tmp = strtoll(EARGF(usage(1)), NULL, 10);
@@ -250,6 +673,39 @@ int main(int argc, char *argv[])
         settings.port = tmp;
         break;
 
+    case 'P':
+        /* set TLS private key */
+#ifdef HAVE_TLS
+        settings.key = EARGF(usage(1));
+#else
+        die(1, "TLS isn't supported by this build.\n"
+               "see `man feuille'.\n");
+#endif
+        break;
+
+    case 'q':
+        /* set queueing delay target */
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp < 0 || tmp > UINT_MAX || errno == ERANGE)
+            die(ERANGE, "invalid queueing delay.\n"
+                        "see `man feuille'.\n");
+
+        settings.queue_delay = tmp;
+        break;
+
+    case 'r':
+        /* enable one listening socket per worker */
+        settings.reuse_port = 1;
+        break;
+
+    case 'R':
+        /* set pastes per second (and burst) of each client */
+        if (parse_rate(EARGF(usage(1)), &settings.request_rate, &settings.request_burst) != 0)
+            die(ERANGE, "invalid paste rate.\n"
+                        "see `man feuille'.\n");
+        break;
+
     case 's':
         /* set max size */
         tmp = strtoll(EARGF(usage(1)), NULL, 10);
@@ -261,6 +717,17 @@ int main(int argc, char *argv[])
         settings.max_size = tmp;
         break;
 
+    case 'S':
+        /* set stats port */
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp < 0 || tmp > USHRT_MAX || errno == ERANGE)
+            die(ERANGE, "invalid stats port.\n"
+                        "see `man feuille'.\n");
+
+        settings.stats_port = tmp;
+        break;
+
     case 't':
         /* set timeout */
         tmp = strtoll(EARGF(usage(1)), NULL, 10);
@@ -311,6 +778,43 @@ int main(int argc, char *argv[])
         settings.worker_count = tmp;
         break;
 
+    case 'x':
+        /* set index size */
+        tmp = strtoll(EARGF(usage(1)), NULL, 10);
+
+        if (tmp < 0 || tmp > ULONG_MAX / 16 || errno == ERANGE)
+            die(ERANGE, "invalid index size.\n"
+                        "see `man feuille'.\n");
+
+        settings.index_size = tmp;
+        break;
+
+    case 'X':
+        /* copy the pastes of the packs to files, then exit */
+        settings.export     = 1;
+        settings.foreground = 1;
+        break;
+
+    case 'z':
+        /* store compressed pastes */
+        tmp = -1;
+        char *compression = EARGF(usage(1));
+
+#ifdef HAVE_ZLIB
+        if (strcmp(compression, "both") == 0)
+            tmp = COMPRESSION_BOTH;
+
+        if (strcmp(compression, "gzip") == 0)
+            tmp = COMPRESSION_GZIP;
+#endif
+
+        if (tmp == -1)
+            die(1, "invalid or unsupported compression mode `%s'.\n"
+                   "see `man feuille'.\n", compression);
+
+        settings.compression = tmp;
+        break;
+
     default:
         usage(1);
     } ARGEND;
@@ -318,6 +822,44 @@ int main(int argc, char *argv[])
     if (argc != 0)
         usage(1);
 
+    if (settings.engine == ENGINE_URING && settings.ingest == INGEST_SPLICE)
+        die(1, "the uring engine doesn't support splice ingest.\n"
+               "see `man feuille'.\n");
+
+    if (settings.compression == COMPRESSION_GZIP && settings.dedup != DEDUP_NONE)
+        die(1, "deduplication needs the uncompressed pastes, use `-z both'.\n"
+               "see `man feuille'.\n");
+
+    if (settings.storage == STORAGE_PACK && settings.compression != COMPRESSION_NONE)
+        die(1, "the pack storage doesn't support compression.\n"
+               "see `man feuille'.\n");
+
+    if (settings.storage == STORAGE_PACK && settings.dedup == DEDUP_LINK)
+        die(1, "the pack storage can't link pastes, use `-d url'.\n"
+               "see `man feuille'.\n");
+
+    if (settings.storage == STORAGE_PACK && settings.index_size == 0)
+        die(1, "the pack storage needs the index of pastes.\n"
+               "see `man feuille'.\n");
+
+    if (settings.engine == ENGINE_URING && settings.certificate != NULL)
+        die(1, "the uring engine doesn't support TLS.\n"
+               "see `man feuille'.\n");
+
+    if (settings.key != NULL && settings.certificate == NULL)
+        die(1, "a private key needs a certificate.\n"
+               "see `man feuille'.\n");
+
+#ifdef HAVE_TLS
+    /* certificates are loaded before the chroot (and before relative paths change), the workers keep them in memory */
+    if (settings.certificate != NULL && tls_initialize() != 0)
+        die(1, "could not load the certificate `%s': %s.\n", settings.certificate, tls_error());
+
+    /* otherwise, every connection would be closed after its handshake */
+    if (settings.certificate != NULL && tls_probe() != 0)
+        die(errno, "kernel TLS is unavailable: %s (is the `tls' module loaded?).\n", strerror(errno));
+#endif
+
 
     /* output folder checks */
     char path[PATH_MAX];
@@ -356,12 +898,33 @@ int main(int argc, char *argv[])
     }
 
 
-    /* server socket creation (before dropping root permissions) */
-    verbose(1, "initializing server socket...");
+    /* server socket(s) creation (before dropping root permissions) */
+    /* with SO_REUSEPORT, every worker gets its own socket and the kernel balances the connections */
+    int server_count = settings.reuse_port ? settings.worker_count : 1;
 
-    int server;
-    if ((server = initialize_server()) == -1)
-        die(errno, "failed to initialize server socket: %f.\n", strerror(errno));
+    /* serving pastes over HTTP takes as many workers and sockets again */
+    int kinds      = settings.http_port != 0 ? 2 : 1;
+    int slot_count = settings.worker_count * kinds;
+
+    int *servers;
+    if ((servers = calloc(server_count * kinds, sizeof(int))) == NULL)
+        die(errno, "could not allocate server sockets: %s.\n", strerror(errno));
+
+    for (int i = 0; i < server_count * kinds; i++) {
+        verbose(1, "initializing server socket n. %d...", i + 1);
+
+        if ((servers[i] = initialize_server(settings.address, i < server_count ? settings.port : settings.http_port)) == -1)
+            die(errno, "failed to initialize server socket: %s.\n", strerror(errno));
+    }
+
+    /* the stats socket is only reachable from the machine itself */
+    int stats = -1;
+    if (settings.stats_port != 0) {
+        verbose(1, "initializing stats socket...");
+
+        if ((stats = initialize_server("127.0.0.1", settings.stats_port)) == -1)
+            die(errno, "failed to initialize stats socket: %s.\n", strerror(errno));
+    }
 
 
     /* make feuille run in the background */
@@ -406,22 +969,179 @@ int main(int argc, char *argv[])
 #endif
 
 
+    /* move existing pastes to the storage layout (after the privileges drop, so that new folders have the right owner) */
+    if (settings.migrate) {
+        verbose(1, "moving pastes to the storage layout...");
+
+        long count;
+        if ((count = migrate_pastes()) == -1)
+            die(errno, "could not migrate the pastes: %s.\n", strerror(errno));
+
+        die(0, "%ld pastes moved.\n", count);
+    }
+
+    /* copy the pastes of the packs to files, for static web servers */
+    if (settings.export) {
+        verbose(1, "exporting the pastes of the packs...");
+
+        long count;
+        if ((count = pack_export()) == -1)
+            die(errno, "could not export the pastes: %s.\n", strerror(errno));
+
+        die(0, "%ld pastes exported.\n", count);
+    }
+
+    /* the packs have an index of their own, telling where every paste is */
+    if (settings.storage == STORAGE_PACK) {
+        verbose(1, "indexing the packs...");
+
+        long count;
+        if (pack_initialize(settings.index_size) != 0 || (count = pack_load()) == -1)
+            die(errno, "could not load the packs: %s.\n", strerror(errno));
+
+        verbose(1, "%ld pastes indexed.", count);
+
+    /* index of used IDs, shared by all workers */
+    } else if (settings.index_size > 0) {
+        verbose(1, "indexing existing pastes...");
+
+        long count;
+        if (index_initialize(settings.index_size) != 0 || (count = index_load(".")) == -1)
+            die(errno, "could not create the index of pastes: %s.\n", strerror(errno));
+
+        verbose(1, "%ld pastes indexed.", count);
+    }
+
+    /* table of known contents, shared by all workers */
+    if (settings.dedup != DEDUP_NONE) {
+        verbose(1, "loading deduplication journal...");
+
+        long count;
+        if (dedup_initialize(settings.index_size > 0 ? settings.index_size : DEDUP_DEFAULT_SIZE) != 0 || (count = dedup_load()) == -1)
+            die(errno, "could not load the deduplication journal: %s.\n", strerror(errno));
+
+        verbose(1, "%ld contents known.", count);
+    }
+
+    /* list of pastes to delete once expired, by creation time */
+    if (settings.retention > 0) {
+        verbose(1, "loading expiry list...");
+
+        long count;
+        if ((count = expiry_load()) == -1)
+            die(errno, "could not load the expiry list: %s.\n", strerror(errno));
+
+        verbose(1, "%ld existing pastes listed.", count);
+    }
+
+    /* most recent and most read pastes, shared by all workers */
+    if (settings.cache_size > 0 && settings.http_port != 0 && cache_initialize(settings.cache_size) != 0)
+        die(errno, "could not create the cache of pastes: %s.\n", strerror(errno));
+
+    /* pastes are only acknowledged once they're safe on disk */
+    if (settings.durability != DURABILITY_NONE && durability_initialize() != 0)
+        die(errno, "could not prepare the durability policy: %s.\n", strerror(errno));
+
+#ifdef HAVE_ZLIB
+    /* pastes are compressed by a process of their own */
+    if (settings.compression != COMPRESSION_NONE && compress_initialize() != 0)
+        die(errno, "could not prepare the compression: %s.\n", strerror(errno));
+#endif
+
+    /* limits of the clients, shared by all workers */
+    if ((settings.request_rate > 0 || settings.byte_rate > 0) && limit_initialize() != 0)
+        die(errno, "could not create the table of clients: %s.\n", strerror(errno));
+
+    /* pastes in flight, shared by all workers */
+    if ((settings.max_uploads > 0 || settings.memory_budget > 0 || settings.queue_delay > 0)
+        && admission_initialize(slot_count) != 0)
+        die(errno, "could not create the admission state: %s.\n", strerror(errno));
+
+    /* counters of every worker, summed up by the stats process */
+    if (settings.stats_port != 0 && metrics_initialize(slot_count) != 0)
+        die(errno, "could not allocate the metrics: %s.\n", strerror(errno));
+
+
 #ifdef DEBUG
-    /* do not create a thread pool if in DEBUG mode */
+    /* do not create a thread pool if in DEBUG mode (only a process more for the HTTP server, if any) */
     verbose(1, "running in DEBUG mode, won't create a worker pool.");
-    accept_loop(server);
+
+    pid_t http = -1;
+    if (settings.http_port != 0 && (http = fork()) < 0)
+        die(errno, "could not initialize the HTTP server: %s.\n", strerror(errno));
+
+    run_slot(servers, server_count, http == 0 ? settings.worker_count : 0);
 #else
     /* create a thread pool for incoming connections */
     verbose(1, "initializing worker pool...");
 
+    /* keep track of the workers, to give the same socket to a worker that replaces a dead one */
+    pid_t *workers;
+    if ((workers = calloc(slot_count, sizeof(pid_t))) == NULL)
+        die(errno, "could not allocate worker pool: %s.\n", strerror(errno));
+
+    /* workers don't wait for syslog: their messages are sent by a process of their own */
+    if (logger_initialize(slot_count) != 0)
+        die(errno, "could not allocate the logger: %s.\n", strerror(errno));
+
+    verbose(2, "  logger process...");
+
+    pid_t logger;
+    if ((logger = fork()) == 0) {
+        close_servers(servers, server_count * kinds, -1);
+        logger_loop();
+    }
+    else if (logger < 0)
+        die(errno, "could not initialize logger process: %s.\n", strerror(errno));
+
     int pid;
-    for (int i = 1; i <= settings.worker_count; i++) {
+    for (int i = 0; i < slot_count; i++) {
         if ((pid = fork()) == 0) {
-            verbose(2, "  worker n. %d...", i);
-            accept_loop(server);
+            verbose(2, "  worker n. %d...", i + 1);
+            run_slot(servers, server_count, i);
 
         } else if (pid < 0)
-            die(errno, "could not initialize worker n. %d: %s.\n", i, strerror(errno));
+            die(errno, "could not initialize worker n. %d: %s.\n", i + 1, strerror(errno));
+
+        workers[i] = pid;
+    }
+
+    /* a low-priority process deletes the expired pastes */
+    pid_t reaper = -1;
+    if (settings.retention > 0) {
+        verbose(2, "  expiry process...");
+
+        if ((reaper = fork()) == 0) {
+            close_servers(servers, server_count * kinds, -1);
+            expiry_loop();
+        } else if (reaper < 0)
+            die(errno, "could not initialize expiry process: %s.\n", strerror(errno));
+    }
+
+    /* another one compresses the pastes */
+    pid_t compressor = -1;
+#ifdef HAVE_ZLIB
+    if (settings.compression != COMPRESSION_NONE) {
+        verbose(2, "  compression process...");
+
+        if ((compressor = fork()) == 0) {
+            close_servers(servers, server_count * kinds, -1);
+            compress_loop();
+        } else if (compressor < 0)
+            die(errno, "could not initialize compression process: %s.\n", strerror(errno));
+    }
+#endif
+
+    /* another one serves the metrics */
+    pid_t reporter = -1;
+    if (stats != -1) {
+        verbose(2, "  stats process...");
+
+        if ((reporter = fork()) == 0) {
+            close_servers(servers, server_count * kinds, -1);
+            metrics_loop(stats);
+        } else if (reporter < 0)
+            die(errno, "could not initialize stats process: %s.\n", strerror(errno));
     }
 
     sleep(1);
@@ -436,18 +1156,91 @@ int main(int argc, char *argv[])
     while ((child_pid = wait(&status)) > 0) {
         error("child %d unexpectedly died with exit code %d.", child_pid, WEXITSTATUS(status));
 
+        /* find the slot of the dead worker, if it's one */
+        int slot = -1;
+        for (int i = 0; i < slot_count; i++)
+            if (workers[i] == child_pid)
+                slot = i;
+
+        /* the pastes it was receiving are gone with it */
+        if (slot != -1)
+            admission_clear(slot);
+
         /* do not fork if child was KILL'ed */
-        if (WTERMSIG(status) == 9)
+        if (WTERMSIG(status) == 9) {
+            /* its own socket would still get its share of the connections, with nobody to accept them */
+            if (slot != -1 && settings.reuse_port) {
+                int server = slot_server(slot, server_count);
+
+                close(servers[server]);
+                servers[server] = -1;
+            }
+
+            continue;
+        }
+
+        if (child_pid == reaper) {
+            if ((reaper = fork()) == 0) {
+                close_servers(servers, server_count * kinds, -1);
+                expiry_loop();
+            } else if (reaper < 0)
+                error("could not fork expiry process again: %s", strerror(errno));
+
+            continue;
+        }
+
+#ifdef HAVE_ZLIB
+        if (child_pid == compressor) {
+            if ((compressor = fork()) == 0) {
+                close_servers(servers, server_count * kinds, -1);
+                compress_loop();
+            } else if (compressor < 0)
+                error("could not fork compression process again: %s", strerror(errno));
+
+            continue;
+        }
+#endif
+
+        if (child_pid == logger) {
+            if ((logger = fork()) == 0) {
+                close_servers(servers, server_count * kinds, -1);
+                logger_loop();
+            } else if (logger < 0)
+                error("could not fork logger process again: %s", strerror(errno));
+
+            continue;
+        }
+
+        if (child_pid == reporter) {
+            if ((reporter = fork()) == 0) {
+                close_servers(servers, server_count * kinds, -1);
+                metrics_loop(stats);
+            } else if (reporter < 0)
+                error("could not fork stats process again: %s", strerror(errno));
+
+            continue;
+        }
+
+        if (slot == -1)
             continue;
 
         if ((pid = fork()) == 0) {
-            accept_loop(server);
+            run_slot(servers, server_count, slot);
 
         } else if (pid < 0)
-            error("could not fork killed child again: ", strerror(errno));
+            error("could not fork killed child again: %s", strerror(errno));
+
+        workers[slot] = pid;
     }
+
+    free(workers);
 #endif
 
-    close(server);
+    close_servers(servers, server_count * kinds, -1);
+
+    if (stats != -1)
+        close(stats);
+
+    free(servers);
     return 0;
 }
@@ -13,18 +13,89 @@
 
 #pragma once
 
+/* connection engines */
+enum Engine {
+    ENGINE_BLOCKING,
+    ENGINE_EPOLL,
+    ENGINE_URING
+};
+
+/* ingest modes */
+enum Ingest {
+    INGEST_MEMORY,
+    INGEST_STREAM,
+    INGEST_SPLICE
+};
+
+/* deduplication modes */
+enum Dedup {
+    DEDUP_NONE,
+    DEDUP_URL,
+    DEDUP_LINK
+};
+
+/* durability policies */
+enum Durability {
+    DURABILITY_NONE,
+    DURABILITY_ALWAYS,
+    DURABILITY_GROUP
+};
+
+/* compression modes */
+enum Compression {
+    COMPRESSION_NONE,
+    COMPRESSION_BOTH,
+    COMPRESSION_GZIP
+};
+
+/* storage engines */
+enum Storage {
+    STORAGE_FILES,
+    STORAGE_PACK
+};
+
 typedef struct Settings {
     char            *address;
     char            *url;
     char            *output;
     char            *user;
+    char            *certificate; /* NULL without TLS */
+    char            *key;
 
     unsigned char    id_length;
+    unsigned char    fan_out;     /* levels  */
     unsigned short   worker_count;
     unsigned short   port;
+    unsigned short   http_port;
+    unsigned short   stats_port;
+    unsigned int     backlog;
     unsigned int     timeout;     /* seconds */
+    unsigned int     idle_timeout; /* seconds, 0 if connections aren't kept */
     unsigned long    max_size;    /* bytes   */
     unsigned long    buffer_size; /* bytes   */
+    unsigned long    index_size;  /* IDs     */
+    unsigned long    retention;   /* seconds */
+    unsigned long    cache_size;  /* bytes, 0 if disabled */
+
+    unsigned long    max_uploads;   /* pastes, all workers, 0 if unlimited */
+    unsigned long    memory_budget; /* bytes, all workers, 0 if unlimited  */
+    unsigned long    queue_delay;   /* milliseconds, 0 if never shed       */
+
+    double           request_rate;  /* per second and client, 0 if unlimited */
+    double           request_burst;
+    double           byte_rate;
+    double           byte_burst;
+
+    char             engine;
+    char             ingest;
+    char             reuse_port;
+    char             huge_pages;
+    char             dedup;
+    char             durability;
+    char             compression;
+    char             storage;
+    char             migrate;
+    char             export;
 
     char             verbose;
     char             foreground;
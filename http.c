@@ -0,0 +1,785 @@
+/*
+ * http.c
+ *  Serving pastes over HTTP, with keep-alive.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "http.h"
+
+#ifndef COSMOPOLITAN
+#include <errno.h>         /* for errno, EAGAIN, EINTR, EMFILE, ENFILE, ...    */
+#include <fcntl.h>         /* for fcntl, open, F_GETFL, F_SETFL, O_NONBLOCK    */
+#include <netinet/in.h>    /* for IPPROTO_TCP                                  */
+#include <netinet/tcp.h>   /* for TCP_NODELAY                                  */
+#include <poll.h>          /* for poll, pollfd, POLLIN, POLLOUT                */
+#include <stdio.h>         /* for snprintf, NULL                               */
+#include <stdlib.h>        /* for calloc, free, realloc, strtod, strtoul       */
+#include <string.h>        /* for memmove, strchr, strcmp, strerror, strlen    */
+#include <strings.h>       /* for strcasecmp, strncasecmp                      */
+#include <sys/socket.h>    /* for accept, recv, send, setsockopt               */
+#include <sys/stat.h>      /* for fstat, S_ISREG                               */
+#include <unistd.h>        /* for close, pread                                 */
+#endif
+
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>  /* for sendfile                                     */
+#endif
+
+#include "bin.h"           /* for paste_path, PASTE_PATH_SIZE                  */
+#include "cache.h"         /* for cache_find                                   */
+#include "compress.h"      /* for inflate_file, COMPRESSED_SUFFIX, HAVE_ZLIB   */
+#include "feuille.h"       /* for Settings, settings                           */
+#include "metrics.h"       /* for metrics_count                                */
+#include "pack.h"          /* for pack_open                                    */
+#include "server.h"        /* for close_connection, ACCEPT_PAUSE               */
+#include "tls.h"           /* for tls_handshake, tls_free, HAVE_TLS            */
+#include "util.h"          /* for verbose, error, die, monotonic_time          */
+
+/* maximum size of a request (request line and headers) */
+#define REQUEST_SIZE  8192
+
+/* maximum size of the headers of a response (or of a whole error response) */
+#define HEADER_SIZE   512
+
+/* size of the chunks sent without sendfile */
+#define CHUNK_SIZE    65536
+
+/* MSG_MORE holds the headers back until the body follows them */
+#ifndef MSG_MORE
+#define MSG_MORE      0
+#endif
+
+/* symbols used in IDs */
+#define ID_SYMBOLS    "abcdefghijklmnopqrstuvwxyz0123456789"
+
+/* connection states */
+enum State {
+    STATE_HANDSHAKE,
+    STATE_READING,
+    STATE_SENDING
+};
+
+/* a connection handled by the loop */
+typedef struct Connection {
+    int                 socket;
+    enum State          state;
+    unsigned long       slot;        /* index in the poll set                       */
+
+    char                request[REQUEST_SIZE];
+    unsigned long       received;
+    unsigned long       length;      /* of the request being answered               */
+    int                 keep_alive;
+
+    char                header[HEADER_SIZE];
+    unsigned long       header_size;
+    unsigned long       header_sent;
+
+    /* the body of the response, either from a file or from memory */
+    int                 file;
+    char               *body;
+    long long           offset;
+    unsigned long       remaining;
+
+    long long           deadline;    /* milliseconds, monotonic clock               */
+
+#ifdef HAVE_TLS
+    Tls                *tls;         /* NULL once the kernel has the keys           */
+#endif
+
+    struct Connection  *prev;
+    struct Connection  *next;
+} Connection;
+
+/* poll set: the server socket first, then a connection per entry */
+static struct pollfd   *polled      = NULL;
+static Connection     **connections = NULL;
+static unsigned long    count       = 0;
+static unsigned long    capacity    = 0;
+
+/* connections, sorted by deadline (the timeout is the same for all of them) */
+static Connection      *timers_head = NULL;
+static Connection      *timers_tail = NULL;
+
+/* functions declarations */
+static  void            timer_remove(Connection *);
+static  void            timer_append(Connection *);
+
+static  int             has_token(char *, char *);
+static  unsigned long   request_length(Connection *);
+static  void            respond(Connection *, char *, char *, unsigned long, int);
+static  void            respond_error(Connection *, char *, char *);
+static  void            serve_paste(Connection *, char *, int, int);
+static  void            handle_request(Connection *);
+
+static  void            connection_accept(int);
+static  void            connection_close(Connection *);
+#ifdef HAVE_TLS
+static  void            connection_handshake(Connection *);
+#endif
+static  void            connection_read(Connection *);
+static  void            connection_process(Connection *);
+static  int             connection_send(Connection *);
+
+/**
+ * Remove a connection from the timer list.
+ *   connection: the connection in question.
+ */
+void timer_remove(Connection *connection)
+{
+    if (connection->prev != NULL)
+        connection->prev->next = connection->next;
+    else if (timers_head == connection)
+        timers_head = connection->next;
+
+    if (connection->next != NULL)
+        connection->next->prev = connection->prev;
+    else if (timers_tail == connection)
+        timers_tail = connection->prev;
+
+    connection->prev = NULL;
+    connection->next = NULL;
+}
+
+/**
+ * (Re)arm the timer of a connection, by putting it at the end of the timer list.
+ *   connection: the connection in question.
+ */
+void timer_append(Connection *connection)
+{
+    /* no timeout, no timer */
+    if (settings.timeout == 0)
+        return;
+
+    timer_remove(connection);
+
+    connection->deadline = monotonic_time() / 1000 + settings.timeout * 1000LL;
+    connection->prev     = timers_tail;
+
+    if (timers_tail != NULL)
+        timers_tail->next = connection;
+    else
+        timers_head = connection;
+
+    timers_tail = connection;
+}
+
+/**
+ * Check if a header value lists a token, e.g. `gzip' in `deflate, gzip;q=0.5'.
+ *   value: the header value.
+ *   token: the token in question.
+ * -> 1 if listed (and not refused with `q=0'), 0 if not.
+ */
+int has_token(char *value, char *token)
+{
+    unsigned long length = strlen(token);
+
+    for (char *item = value; item != NULL; item = strchr(item, ',')) {
+        item += strspn(item, ", \t");
+
+        if (strncasecmp(item, token, length) != 0 || strchr(";, \t", item[length]) == NULL)
+            continue;
+
+        /* a zero quality value means `not acceptable' */
+        char *end       = strchr(item, ',');
+        char *parameter = strchr(item, ';');
+
+        if (parameter != NULL && (end == NULL || parameter < end)) {
+            parameter += strspn(parameter, "; \t");
+
+            if (strncasecmp(parameter, "q=", 2) == 0 && strtod(parameter + 2, NULL) == 0)
+                return 0;
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Find the end of the request at the start of the buffer.
+ *   connection: the connection in question.
+ * -> the length of the request (including the empty line), or 0 if it's incomplete.
+ */
+unsigned long request_length(Connection *connection)
+{
+    for (unsigned long i = 3; i < connection->received; i++)
+        if (connection->request[i] == '\n' && connection->request[i - 1] == '\r'
+         && connection->request[i - 2] == '\n' && connection->request[i - 3] == '\r')
+            return i + 1;
+
+    return 0;
+}
+
+/**
+ * Prepare the headers of a response.
+ *   connection: the connection in question.
+ *   status: the status code and reason.
+ *   headers: extra headers, each ending with CRLF.
+ *   size: the size of the body.
+ *   compressed: 1 if the body is gzip-compressed, 0 if not.
+ */
+void respond(Connection *connection, char *status, char *headers, unsigned long size, int compressed)
+{
+    int length = snprintf(connection->header, sizeof(connection->header),
+                          "HTTP/1.1 %s\r\n"
+                          "Content-Type: text/plain; charset=utf-8\r\n"
+                          "Content-Length: %lu\r\n"
+                          "X-Content-Type-Options: nosniff\r\n"
+                          "%s%s%s"
+                          "Connection: %s\r\n"
+                          "\r\n",
+                          status, size, headers,
+                          settings.compression != COMPRESSION_NONE ? "Vary: Accept-Encoding\r\n" : "",
+                          compressed ? "Content-Encoding: gzip\r\n" : "",
+                          connection->keep_alive ? "keep-alive" : "close");
+
+    connection->header_size = length < (int)sizeof(connection->header) ? length : sizeof(connection->header) - 1;
+    connection->header_sent = 0;
+    connection->state       = STATE_SENDING;
+}
+
+/**
+ * Prepare an error response, sent along with its headers.
+ *   connection: the connection in question.
+ *   status: the status code and reason.
+ *   headers: extra headers, each ending with CRLF.
+ */
+void respond_error(Connection *connection, char *status, char *headers)
+{
+    /* the reason is a good enough body */
+    char *reason = strchr(status, ' ') + 1;
+    respond(connection, status, headers, strlen(reason) + 1, 0);
+
+    int length = snprintf(connection->header + connection->header_size,
+                          sizeof(connection->header) - connection->header_size, "%s\n", reason);
+
+    if (length > 0 && connection->header_size + length < sizeof(connection->header))
+        connection->header_size += length;
+}
+
+/**
+ * Open a paste, and prepare the response sending it.
+ *   connection: the connection in question.
+ *   id: the ID of the paste.
+ *   gzip: 1 if the client accepts gzip, 0 if not.
+ *   head: 1 if only the headers are wanted, 0 if not.
+ */
+void serve_paste(Connection *connection, char *id, int gzip, int head)
+{
+    char path[PASTE_PATH_SIZE];
+    char compressed[PASTE_PATH_SIZE + sizeof(COMPRESSED_SUFFIX)];
+
+    if (strlen(id) == 0 || strspn(id, ID_SYMBOLS) != strlen(id) || paste_path(id, path, sizeof(path)) != 0) {
+        respond_error(connection, "404 Not Found", "");
+        return;
+    }
+
+    /* a recent or often read paste is sent from memory, without touching the disk */
+    /* (feuille removes the pastes it deletes from the cache, but not those deleted by hand) */
+    unsigned long cached_size;
+    if ((connection->body = cache_find(id, &cached_size)) != NULL) {
+        respond(connection, "200 OK", "", cached_size, 0);
+        connection->remaining = head ? 0 : cached_size;
+        return;
+    }
+
+    /* a paste of the packs is sent straight from its segment */
+    if (settings.storage == STORAGE_PACK) {
+        long long     offset;
+        unsigned long size;
+
+        int file;
+        if ((file = pack_open(id, &offset, &size)) == -1) {
+            respond_error(connection, "404 Not Found", "");
+            return;
+        }
+
+        respond(connection, "200 OK", "", size, 0);
+
+        if (head) {
+            close(file);
+            return;
+        }
+
+        connection->file      = file;
+        connection->offset    = offset;
+        connection->remaining = size;
+        return;
+    }
+
+    snprintf(compressed, sizeof(compressed), "%s" COMPRESSED_SUFFIX, path);
+
+    /* the compressed copy is sent as is to the clients that accept it */
+    int is_compressed = 0;
+    int file          = -1;
+
+    if (gzip && settings.compression != COMPRESSION_NONE && (file = open(compressed, O_RDONLY)) != -1)
+        is_compressed = 1;
+    else
+        file = open(path, O_RDONLY);
+
+#ifdef HAVE_ZLIB
+    /* the paste could only be stored compressed */
+    if (file == -1 && (file = open(compressed, O_RDONLY)) != -1) {
+        unsigned long size;
+        connection->body = inflate_file(file, &size);
+        close(file);
+
+        if (connection->body == NULL) {
+            error("could not decompress paste `%s': %s", id, strerror(errno));
+            respond_error(connection, "500 Internal Server Error", "");
+            return;
+        }
+
+        respond(connection, "200 OK", "", size, 0);
+        connection->remaining = head ? 0 : size;
+        return;
+    }
+#endif
+
+    /* pastes are never empty: an empty file is one whose content is still being written (see reserve_paste) */
+    struct stat status;
+    if (file == -1 || fstat(file, &status) != 0 || !S_ISREG(status.st_mode) || status.st_size == 0) {
+        if (file != -1)
+            close(file);
+
+        respond_error(connection, "404 Not Found", "");
+        return;
+    }
+
+    respond(connection, "200 OK", "", status.st_size, is_compressed);
+
+    if (head) {
+        close(file);
+        return;
+    }
+
+    connection->file      = file;
+    connection->remaining = status.st_size;
+}
+
+/**
+ * Parse the request at the start of the buffer, and prepare its response.
+ *   connection: the connection in question.
+ */
+void handle_request(Connection *connection)
+{
+    char *request = connection->request;
+
+    metrics_count(COUNTER_HTTP_REQUESTS, 1);
+
+    /* cut the empty line, then the request line */
+    request[connection->length - 4] = 0;
+
+    char *headers = strchr(request, '\r');
+    if (headers != NULL) {
+        *headers = 0;
+        headers += 2;
+    }
+
+    char *method = request;
+    char *target;
+    char *version;
+
+    if ((target = strchr(method, ' ')) == NULL || (version = strchr(target + 1, ' ')) == NULL) {
+        connection->keep_alive = 0;
+        respond_error(connection, "400 Bad Request", "");
+        return;
+    }
+
+    *target++  = 0;
+    *version++ = 0;
+
+    /* HTTP/1.1 connections are kept alive by default */
+    if (strcmp(version, "HTTP/1.1") == 0) {
+        connection->keep_alive = 1;
+    } else if (strcmp(version, "HTTP/1.0") == 0) {
+        connection->keep_alive = 0;
+    } else {
+        connection->keep_alive = 0;
+        respond_error(connection, "505 HTTP Version Not Supported", "");
+        return;
+    }
+
+    int gzip = 0;
+
+    char *next;
+    for (char *header = headers; header != NULL && *header != 0; header = next) {
+        if ((next = strchr(header, '\r')) != NULL) {
+            *next = 0;
+            next += 2;
+        }
+
+        char *value;
+        if ((value = strchr(header, ':')) == NULL)
+            continue;
+
+        *value++ = 0;
+        value   += strspn(value, " \t");
+
+        if (strcasecmp(header, "Connection") == 0) {
+            if (has_token(value, "close"))
+                connection->keep_alive = 0;
+
+            if (has_token(value, "keep-alive"))
+                connection->keep_alive = 1;
+        }
+
+        if (strcasecmp(header, "Accept-Encoding") == 0)
+            gzip = has_token(value, "gzip");
+
+        /* request bodies aren't read: the connection can't be reused */
+        if ((strcasecmp(header, "Content-Length") == 0 && strtoul(value, NULL, 10) != 0)
+         || strcasecmp(header, "Transfer-Encoding") == 0)
+            connection->keep_alive = 0;
+    }
+
+    int head = strcmp(method, "HEAD") == 0;
+    if (!head && strcmp(method, "GET") != 0) {
+        respond_error(connection, "405 Method Not Allowed", "Allow: GET, HEAD\r\n");
+        return;
+    }
+
+    /* the query string isn't used */
+    target[strcspn(target, "?")] = 0;
+
+    if (*target != '/') {
+        respond_error(connection, "400 Bad Request", "");
+        return;
+    }
+
+    verbose(2, "serving `%s'...", target);
+    serve_paste(connection, target + 1, gzip, head);
+}
+
+/**
+ * Accept all pending connections.
+ *   server: the server socket.
+ */
+void connection_accept(int server)
+{
+    int socket;
+    while ((socket = accept(server, NULL, NULL)) != -1) {
+        if (count == capacity) {
+            unsigned long new_capacity = capacity * 2;
+
+            void *tmp;
+            if ((tmp = realloc(polled, new_capacity * sizeof(struct pollfd))) == NULL) {
+                close(socket);
+                return;
+            }
+
+            polled = tmp;
+
+            if ((tmp = realloc(connections, new_capacity * sizeof(Connection *))) == NULL) {
+                close(socket);
+                return;
+            }
+
+            connections = tmp;
+            capacity    = new_capacity;
+        }
+
+        Connection *connection;
+        if ((connection = calloc(1, sizeof(Connection))) == NULL) {
+            close(socket);
+            return;
+        }
+
+        fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+
+        /* the headers are held back by MSG_MORE instead, so that they leave with the body */
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &(int){ 1 }, sizeof(int));
+
+        connection->socket = socket;
+        connection->state  = settings.certificate != NULL ? STATE_HANDSHAKE : STATE_READING;
+        connection->file   = -1;
+        connection->slot   = count;
+
+        polled[count]      = (struct pollfd){ .fd = socket, .events = POLLIN };
+        connections[count] = connection;
+        count++;
+
+        timer_append(connection);
+    }
+
+    /* no file descriptor left: the connection would wake the loop up again and again, until one is closed */
+    if (errno == EMFILE || errno == ENFILE) {
+        error("no file descriptor left, accepting connections again once one is closed.");
+        polled[0].events = 0;
+        return;
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        error("error while accepting incoming connection: %s", strerror(errno));
+}
+
+/**
+ * Close a connection and free everything associated with it.
+ *   connection: the connection in question.
+ */
+void connection_close(Connection *connection)
+{
+    timer_remove(connection);
+
+    if (connection->file != -1)
+        close(connection->file);
+
+    free(connection->body);
+    close_connection(connection->socket);
+
+    /* a file descriptor is free again */
+    polled[0].events = POLLIN;
+
+#ifdef HAVE_TLS
+    tls_free(&connection->tls);
+#endif
+
+    /* the last entry of the poll set takes its place */
+    unsigned long last = --count;
+    if (connection->slot != last) {
+        polled[connection->slot]      = polled[last];
+        connections[connection->slot] = connections[last];
+
+        connections[connection->slot]->slot = connection->slot;
+    }
+
+    free(connection);
+}
+
+#ifdef HAVE_TLS
+/**
+ * Go on with the TLS handshake of a connection, then serve it as usual (sendfile included).
+ *   connection: the connection in question.
+ */
+void connection_handshake(Connection *connection)
+{
+    int status;
+    if ((status = tls_handshake(&connection->tls, connection->socket)) == -1) {
+        connection_close(connection);
+        return;
+    }
+
+    polled[connection->slot].events = status == TLS_WANT_WRITE ? POLLOUT : POLLIN;
+
+    if (status == 0)
+        connection->state = STATE_READING;
+
+    timer_append(connection);
+}
+#endif
+
+/**
+ * Receive the available part of a request.
+ *   connection: the connection in question.
+ */
+void connection_read(Connection *connection)
+{
+    long size = recv(connection->socket, connection->request + connection->received,
+                     sizeof(connection->request) - connection->received, 0);
+
+    if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+
+    /* the client is gone */
+    if (size <= 0) {
+        connection_close(connection);
+        return;
+    }
+
+    connection->received += size;
+    connection_process(connection);
+}
+
+/**
+ * Answer the complete requests received on a connection, one after the other.
+ *   connection: the connection in question.
+ */
+void connection_process(Connection *connection)
+{
+    while (connection->state == STATE_READING) {
+        if ((connection->length = request_length(connection)) == 0) {
+            if (connection->received < sizeof(connection->request))
+                return;
+
+            /* the request can't fit */
+            connection->length     = connection->received;
+            connection->keep_alive = 0;
+            respond_error(connection, "431 Request Header Fields Too Large", "");
+        } else {
+            handle_request(connection);
+        }
+
+        polled[connection->slot].events = POLLOUT;
+
+        if (!connection_send(connection))
+            return;
+    }
+}
+
+/**
+ * Send as much of the response as possible.
+ *   connection: the connection in question.
+ * -> 1 if the response has been sent and the connection waits for another request, 0 if not (or if closed).
+ */
+int connection_send(Connection *connection)
+{
+    while (connection->header_sent < connection->header_size || connection->remaining > 0) {
+        long size;
+
+        if (connection->header_sent < connection->header_size) {
+            size = send(connection->socket, connection->header + connection->header_sent,
+                        connection->header_size - connection->header_sent,
+                        connection->remaining > 0 ? MSG_MORE : 0);
+
+            if (size > 0)
+                connection->header_sent += size;
+
+        } else if (connection->body != NULL) {
+            size = send(connection->socket, connection->body + connection->offset, connection->remaining, 0);
+
+            if (size > 0) {
+                connection->offset    += size;
+                connection->remaining -= size;
+            }
+
+        } else {
+#ifdef HAVE_SENDFILE
+            off_t offset = connection->offset;
+            size = sendfile(connection->socket, connection->file, &offset, connection->remaining);
+#else
+            static char chunk[CHUNK_SIZE];
+
+            size = pread(connection->file, chunk,
+                         connection->remaining < sizeof(chunk) ? connection->remaining : sizeof(chunk),
+                         connection->offset);
+
+            if (size > 0)
+                size = send(connection->socket, chunk, size, 0);
+#endif
+
+            /* the paste has been truncated in the meantime */
+            if (size == 0) {
+                connection_close(connection);
+                return 0;
+            }
+
+            if (size > 0) {
+                connection->offset    += size;
+                connection->remaining -= size;
+            }
+        }
+
+        if (size < 0) {
+            /* socket buffer is full, wait until it's writable again */
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+
+            connection_close(connection);
+            return 0;
+        }
+
+        /* slow clients are fine, as long as they make progress */
+        timer_append(connection);
+    }
+
+    verbose(2, "response sent.");
+
+    if (!connection->keep_alive) {
+        connection_close(connection);
+        return 0;
+    }
+
+    /* get ready for the next request, which could have already been received */
+    if (connection->file != -1)
+        close(connection->file);
+
+    free(connection->body);
+
+    connection->file   = -1;
+    connection->body   = NULL;
+    connection->offset = 0;
+
+    connection->received -= connection->length;
+    memmove(connection->request, connection->request + connection->length, connection->received);
+
+    connection->state               = STATE_READING;
+    polled[connection->slot].events = POLLIN;
+
+    timer_append(connection);
+    return 1;
+}
+
+/**
+ * Feuille's HTTP loop, serving the pastes to as many keep-alive connections as the worker can handle.
+ *   server: the HTTP server socket.
+ */
+void http_loop(int server)
+{
+    /* the server socket must not block the loop */
+    fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+
+    capacity = 64;
+    if ((polled = calloc(capacity, sizeof(struct pollfd))) == NULL
+     || (connections = calloc(capacity, sizeof(Connection *))) == NULL)
+        die(errno, "could not allocate the poll set: %s.\n", strerror(errno));
+
+    polled[0] = (struct pollfd){ .fd = server, .events = POLLIN };
+    count     = 1;
+
+    for (;;) {
+        /* wait until an event occurs or the oldest connection times out */
+        int timeout = -1;
+        if (timers_head != NULL) {
+            long long remaining = timers_head->deadline - monotonic_time() / 1000;
+            timeout = remaining > 0 ? remaining : 0;
+        }
+
+        /* the file descriptors may also be used up by other processes: accepting is tried again anyway */
+        if (polled[0].events == 0 && (timeout == -1 || timeout > ACCEPT_PAUSE))
+            timeout = ACCEPT_PAUSE;
+
+        int ready;
+        if ((ready = poll(polled, count, timeout)) == -1 && errno != EINTR)
+            die(errno, "poll failed: %s.\n", strerror(errno));
+
+        if (ready == 0)
+            polled[0].events = POLLIN;
+
+        /* backwards, as a closed connection is replaced by the last one, which has already been handled */
+        for (unsigned long i = count - 1; i > 0; i--) {
+            Connection *connection = connections[i];
+            short       events     = polled[i].revents;
+
+            if (events == 0)
+                continue;
+
+            if (connection->state == STATE_READING && (events & (POLLIN | POLLHUP | POLLERR)))
+                connection_read(connection);
+#ifdef HAVE_TLS
+            else if (connection->state == STATE_HANDSHAKE)
+                connection_handshake(connection);
+#endif
+            else if (connection->state == STATE_SENDING && (events & (POLLOUT | POLLHUP | POLLERR)) && connection_send(connection))
+                connection_process(connection);
+        }
+
+        if (polled[0].revents & POLLIN)
+            connection_accept(server);
+
+        /* handle timeouts */
+        long long current = monotonic_time() / 1000;
+        while (timers_head != NULL && timers_head->deadline <= current)
+            connection_close(timers_head);
+    }
+}
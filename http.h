@@ -0,0 +1,23 @@
+/*
+ * http.h
+ *  http.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+/* sendfile(2) only has this signature on Linux */
+#if defined __linux__ && !defined COSMOPOLITAN
+#define HAVE_SENDFILE
+#endif
+
+void     http_loop(int);
@@ -0,0 +1,91 @@
+/*
+ * index.c
+ *  Index of used IDs, shared by all workers.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "index.h"
+
+#ifndef COSMOPOLITAN
+#include <limits.h>    /* for UCHAR_MAX                               */
+#include <stdio.h>     /* for snprintf, NULL                          */
+#include <string.h>    /* for strcspn                                 */
+#endif
+
+#include "bin.h"       /* for walk_pastes, MAX_FAN_OUT                */
+#include "table.h"     /* for Table, table_*                          */
+
+/* IDs of the pastes on disk: a false positive only means that another ID gets generated */
+static Table    ids = { NULL, 0 };
+
+/* functions declarations */
+static  int         claim(char *, char *);
+
+/**
+ * Create the index.
+ *   size: the number of IDs the index should hold.
+ * -> 0 if done, -1 if not.
+ */
+int index_initialize(unsigned long size)
+{
+    return table_initialize(&ids, size);
+}
+
+/**
+ * Add a paste found on disk to the index.
+ *   id: the ID of the paste.
+ *   path: the path of the paste.
+ * -> 1 if added, 0 if not.
+ */
+int claim(char *id, char *path)
+{
+    (void)path;
+
+    /* a compressed copy has the ID of its paste */
+    char paste[UCHAR_MAX + 1];
+    snprintf(paste, sizeof(paste), "%.*s", (int)strcspn(id, "."), id);
+
+    return index_claim(paste) == 1;
+}
+
+/**
+ * Fill the index with the pastes already on disk, whatever the storage layout.
+ *   path: the directory containing the pastes.
+ * -> the number of IDs added, or -1 if an error occured.
+ */
+long index_load(char *path)
+{
+    return walk_pastes(path, MAX_FAN_OUT, claim);
+}
+
+/**
+ * Atomically claim an ID, so that no other worker can use it.
+ *   id: the ID in question.
+ * -> 1 if the ID has been claimed, 0 if it's already used, -1 if the index can't tell.
+ */
+int index_claim(char *id)
+{
+    if (ids.slots == NULL)
+        return -1;
+
+    return table_claim(&ids, table_fingerprint(id), NULL);
+}
+
+/**
+ * Release an ID, e.g. when its paste couldn't be written or has been deleted.
+ *   id: the ID in question.
+ */
+void index_release(char *id)
+{
+    if (ids.slots != NULL)
+        table_release(&ids, table_fingerprint(id));
+}
@@ -0,0 +1,22 @@
+/*
+ * index.h
+ *  index.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+int      index_initialize(unsigned long);
+long     index_load(char *);
+
+int      index_claim(char *);
+void     index_release(char *);
@@ -0,0 +1,285 @@
+/*
+ * limit.c
+ *  Rate limiting of the clients, with token buckets kept in a table
+ *  shared by all workers.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "limit.h"
+
+#ifndef COSMOPOLITAN
+#include <errno.h>       /* for errno, ESRCH                                   */
+#include <netinet/in.h>  /* for sockaddr_in, sockaddr_in6, IN6_IS_ADDR_V4MA... */
+#include <sched.h>       /* for sched_yield                                    */
+#include <signal.h>      /* for kill                                           */
+#include <stdio.h>       /* for NULL                                           */
+#include <string.h>      /* for memcpy, strlen                                 */
+#include <sys/socket.h>  /* for send, MSG_DONTWAIT, MSG_NOSIGNAL, AF_INET      */
+#include <unistd.h>      /* for getpid, pid_t                                  */
+#endif
+
+#include "batch.h"       /* for Batch, batch_end                               */
+#include "feuille.h"     /* for Settings, settings                             */
+#include "metrics.h"     /* for metrics_count                                  */
+#include "util.h"        /* for hash_bytes, monotonic_time, shared_alloc, ...  */
+
+/* a client isn't looked for further than that many buckets from its place */
+#define MAX_PROBES 8
+
+/* attempts at locking a bucket before checking that the worker holding it is still alive */
+#define SPIN_CHECK 1024
+
+/* what a client is allowed to send, right now */
+typedef struct Bucket {
+    uint64_t    client;      /* 0 if the bucket is free             */
+    pid_t       owner;       /* worker holding it, 0 if none        */
+    long long   updated;     /* milliseconds, monotonic clock       */
+    double      requests;    /* tokens left                         */
+    double      bytes;       /* ... can be negative, after a paste  */
+} Bucket;
+
+static Bucket          *buckets = NULL;
+
+/* functions declarations */
+static  void        bucket_lock(Bucket *);
+static  void        bucket_unlock(Bucket *);
+static  Bucket     *bucket_find(uint64_t);
+static  void        bucket_refill(Bucket *, long long);
+
+/**
+ * Create the table of clients, before any worker is forked.
+ * -> 0 if done, -1 if not.
+ */
+int limit_initialize(void)
+{
+    if ((buckets = shared_alloc(LIMIT_TABLE_SIZE * sizeof(Bucket))) == NULL)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Get the client a connection comes from: its address, cut to the prefix its limits apply to.
+ *   address: the address of the peer, as returned by accept.
+ * -> the client, or 0 if it isn't limited (limits are disabled, or it's local, e.g. the CGI script).
+ */
+uint64_t limit_client(struct sockaddr *address)
+{
+    if (buckets == NULL)
+        return 0;
+
+    unsigned char  key[17] = { 0 };
+    unsigned char *bytes;
+    int            prefix;
+
+    if (address->sa_family == AF_INET) {
+        bytes  = (unsigned char *)&((struct sockaddr_in *)address)->sin_addr;
+        prefix = LIMIT_IPV4_PREFIX;
+        key[0] = 4;
+
+    } else if (address->sa_family == AF_INET6) {
+        struct in6_addr *ip = &((struct sockaddr_in6 *)address)->sin6_addr;
+
+        if (IN6_IS_ADDR_LOOPBACK(ip))
+            return 0;
+
+        /* IPv4 clients of a dual-stack socket */
+        if (IN6_IS_ADDR_V4MAPPED(ip)) {
+            bytes  = (unsigned char *)ip + 12;
+            prefix = LIMIT_IPV4_PREFIX;
+            key[0] = 4;
+        } else {
+            bytes  = (unsigned char *)ip;
+            prefix = LIMIT_IPV6_PREFIX;
+            key[0] = 6;
+        }
+
+    } else
+        return 0;
+
+    if (key[0] == 4 && bytes[0] == 127)
+        return 0;
+
+    /* keep the prefix only */
+    memcpy(key + 1, bytes, (prefix + 7) / 8);
+    if (prefix % 8 != 0)
+        key[(prefix + 7) / 8] &= 0xff << (8 - prefix % 8);
+
+    uint64_t client = hash_bytes(HASH_INIT, (char *)key, sizeof(key));
+    return client != 0 ? client : 1;
+}
+
+/**
+ * Lock a bucket (workers only keep it for a few instructions).
+ *   bucket: the bucket in question.
+ */
+void bucket_lock(Bucket *bucket)
+{
+    pid_t self = getpid();
+
+    for (unsigned long spins = 1;; spins++) {
+        pid_t owner = 0;
+        if (__atomic_compare_exchange_n(&bucket->owner, &owner, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+
+        if (spins % SPIN_CHECK != 0)
+            continue;
+
+        /* a worker died while holding it (its PID could be ours now): a bucket is only a few numbers, take it as it is */
+        if (owner == self || (kill(owner, 0) == -1 && errno == ESRCH))
+            __atomic_compare_exchange_n(&bucket->owner, &owner, 0, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        else
+            sched_yield();
+    }
+}
+
+/**
+ * Unlock a bucket.
+ *   bucket: the bucket in question.
+ */
+void bucket_unlock(Bucket *bucket)
+{
+    __atomic_store_n(&bucket->owner, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Find the bucket of a client, or give it one (the least recently seen client near its place is forgotten if needed).
+ *   client: the client in question.
+ * -> the bucket, locked.
+ */
+Bucket *bucket_find(uint64_t client)
+{
+    Bucket *oldest = NULL;
+
+    for (unsigned long i = 0; i < MAX_PROBES; i++) {
+        Bucket *bucket = &buckets[(client + i) % LIMIT_TABLE_SIZE];
+        bucket_lock(bucket);
+
+        if (bucket->client == client)
+            return bucket;
+
+        if (bucket->client == 0) {
+            bucket->client   = client;
+            bucket->updated  = 0;
+            return bucket;
+        }
+
+        if (oldest == NULL || bucket->updated < oldest->updated)
+            oldest = bucket;
+
+        bucket_unlock(bucket);
+    }
+
+    /* a forgotten client starts again with full buckets */
+    bucket_lock(oldest);
+
+    if (oldest->client != client) {
+        oldest->client  = client;
+        oldest->updated = 0;
+    }
+
+    return oldest;
+}
+
+/**
+ * Give a bucket the tokens earned since it was last used.
+ *   bucket: the bucket in question (locked).
+ *   time: the current time.
+ */
+void bucket_refill(Bucket *bucket, long long time)
+{
+    if (bucket->updated == 0) {
+        bucket->requests = settings.request_burst;
+        bucket->bytes    = settings.byte_burst;
+    } else {
+        double elapsed = (time - bucket->updated) / 1000.0;
+
+        bucket->requests += elapsed * settings.request_rate;
+        bucket->bytes    += elapsed * settings.byte_rate;
+
+        if (bucket->requests > settings.request_burst)
+            bucket->requests = settings.request_burst;
+
+        if (bucket->bytes > settings.byte_burst)
+            bucket->bytes = settings.byte_burst;
+    }
+
+    bucket->updated = time;
+}
+
+/**
+ * Let a client in, if it has a request left and hasn't sent too many bytes lately.
+ *   client: the client in question (see limit_client).
+ * -> 1 if it can send a paste, 0 if not.
+ */
+int limit_admit(uint64_t client)
+{
+    if (client == 0)
+        return 1;
+
+    Bucket *bucket = bucket_find(client);
+    bucket_refill(bucket, monotonic_time() / 1000);
+
+    int admitted = (settings.request_rate == 0 || bucket->requests >= 1)
+                && (settings.byte_rate == 0 || bucket->bytes > 0);
+
+    if (admitted)
+        bucket->requests--;
+
+    bucket_unlock(bucket);
+    return admitted;
+}
+
+/**
+ * Take what a client has sent out of its buckets: its bytes, and the pastes of a batch after the first one.
+ * Its next pastes wait until it's paid them back.
+ *   client: the client in question (see limit_client).
+ *   paste: the paste it has sent.
+ */
+void limit_charge(uint64_t client, Paste *paste)
+{
+    unsigned long pastes = 1;
+    unsigned long size   = paste->size;
+
+    /* a persistent connection is charged as it goes: only its very first paste has been let in by limit_admit */
+    if (paste->batch != NULL) {
+        pastes = paste->batch->count + (paste->batch->stored > 0);
+        size  -= paste->batch->charged;
+    }
+
+    if (client == 0 || (settings.byte_rate == 0 && pastes <= 1))
+        return;
+
+    Bucket *bucket = bucket_find(client);
+    bucket_refill(bucket, monotonic_time() / 1000);
+
+    bucket->bytes    -= size;
+    bucket->requests -= pastes > 1 ? pastes - 1 : 0;
+
+    /* clients over their limits have to connect again, to be let in (or not) by limit_admit */
+    if ((settings.request_rate > 0 && bucket->requests < 0) || (settings.byte_rate > 0 && bucket->bytes <= 0))
+        batch_end(paste);
+
+    bucket_unlock(bucket);
+}
+
+/**
+ * Turn a client away, without waiting for anything.
+ *   connection: the socket associated with the connection.
+ * -> the number of bytes sent, or -1 if an error occured.
+ */
+int limit_reject(int connection)
+{
+    metrics_count(COUNTER_LIMITED, 1);
+
+    return send(connection, LIMIT_ERROR, strlen(LIMIT_ERROR), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
@@ -0,0 +1,38 @@
+/*
+ * limit.h
+ *  limit.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#ifndef COSMOPOLITAN
+#include <stdint.h>      /* for uint64_t */
+#include <sys/socket.h>  /* for sockaddr */
+#endif
+
+#include "feuille.h"
+#include "paste.h"
+
+/* clients are told so right after their connection has been accepted */
+#define LIMIT_ERROR "Too many pastes from your address.\nPlease try again later.\n"
+
+/* number of clients tracked at once (the least recently seen ones are forgotten first) */
+#define LIMIT_TABLE_SIZE 65536
+
+/* clients sharing these first bits of their address share their limits */
+#define LIMIT_IPV4_PREFIX 32
+#define LIMIT_IPV6_PREFIX 64
+
+int          limit_initialize(void);
+uint64_t     limit_client(struct sockaddr *);
+int          limit_admit(uint64_t);
+void         limit_charge(uint64_t, Paste *);
+int          limit_reject(int);
@@ -0,0 +1,215 @@
+/*
+ * logger.c
+ *  Messages of the workers, written to rings in shared memory and sent
+ *  to syslog by a process of their own.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "logger.h"
+
+#ifndef COSMOPOLITAN
+#include <stdio.h>       /* for BUFSIZ, NULL                                 */
+#include <string.h>      /* for memcpy                                       */
+#include <syslog.h>      /* for syslog, LOG_DEBUG, LOG_ERR, LOG_WARNING      */
+#include <time.h>        /* for nanosleep, timespec                          */
+#include <unistd.h>      /* for getpid                                       */
+#endif
+
+#include "util.h"        /* for shared_alloc                                 */
+
+/* how long the logger waits when every ring is empty (nanoseconds) */
+#define IDLE_TIME 10000000L
+
+/* a message, followed by its text (level 0 is an error, the others are verbose levels) */
+typedef struct Record {
+    int              pid;
+    unsigned short   length;
+    unsigned char    level;
+} Record;
+
+/* the ring of a worker: written by the worker only, read by the logger only */
+typedef struct Ring {
+    unsigned long    head;        /* bytes written, ever                */
+    char             pad1[64 - sizeof(unsigned long)];
+
+    unsigned long    tail;        /* bytes read, ever                   */
+    char             pad2[64 - sizeof(unsigned long)];
+
+    unsigned long    lost;        /* messages dropped as the ring was full */
+    unsigned long    reported;    /* ... and already reported by the logger */
+
+    char             data[LOGGER_RING_SIZE];
+} Ring;
+
+/* rings of all the workers, shared with the logger */
+static Ring    *rings      = NULL;
+static int      ring_count = 0;
+
+/* ring of this worker, NULL if it logs directly */
+static Ring    *ring       = NULL;
+static int      pid        = 0;
+
+/* functions declarations */
+static  void     copy_in(Ring *, unsigned long, void *, unsigned long);
+static  void     copy_out(Ring *, unsigned long, void *, unsigned long);
+static  int      drain(Ring *);
+
+/**
+ * Allocate the rings of the workers, before any of them is forked.
+ *   count: the number of worker slots.
+ * -> 0 if done, -1 if not.
+ */
+int logger_initialize(int count)
+{
+    if ((rings = shared_alloc(count * sizeof(Ring))) == NULL)
+        return -1;
+
+    ring_count = count;
+    return 0;
+}
+
+/**
+ * Make this process log through the ring of a worker.
+ *   index: the index of the worker slot.
+ */
+void logger_attach(int index)
+{
+    if (rings == NULL || index >= ring_count)
+        return;
+
+    ring = &rings[index];
+    pid  = getpid();
+}
+
+/**
+ * Copy bytes into a ring, wrapping around its end.
+ *   ring: the ring in question.
+ *   position: where to copy them, as a number of bytes written ever.
+ *   data: the bytes in question.
+ *   size: the number of bytes.
+ */
+void copy_in(Ring *ring, unsigned long position, void *data, unsigned long size)
+{
+    unsigned long start = position % LOGGER_RING_SIZE;
+    unsigned long first = size < LOGGER_RING_SIZE - start ? size : LOGGER_RING_SIZE - start;
+
+    memcpy(ring->data + start, data, first);
+    memcpy(ring->data, (char *)data + first, size - first);
+}
+
+/**
+ * Copy bytes out of a ring, wrapping around its end.
+ *   ring: the ring in question.
+ *   position: where to copy them from, as a number of bytes written ever.
+ *   data: where to copy them.
+ *   size: the number of bytes.
+ */
+void copy_out(Ring *ring, unsigned long position, void *data, unsigned long size)
+{
+    unsigned long start = position % LOGGER_RING_SIZE;
+    unsigned long first = size < LOGGER_RING_SIZE - start ? size : LOGGER_RING_SIZE - start;
+
+    memcpy(data, ring->data + start, first);
+    memcpy((char *)data + first, ring->data, size - first);
+}
+
+/**
+ * Put a message in the ring of this worker. It never waits: verbose messages are dropped if the ring is full.
+ *   level: 0 for an error, the verbose level otherwise.
+ *   message: the formatted message.
+ *   length: its length.
+ * -> 0 if done (or dropped), -1 if it has to be sent to syslog directly.
+ */
+int logger_write(int level, char *message, unsigned long length)
+{
+    if (ring == NULL)
+        return -1;
+
+    if (length > BUFSIZ - 1)
+        length = BUFSIZ - 1;
+
+    Record record = { .pid = pid, .length = length, .level = level };
+
+    /* only this worker moves the head, only the logger moves the tail */
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (LOGGER_RING_SIZE - (head - tail) < sizeof(record) + length) {
+        /* errors are never lost */
+        if (level == 0)
+            return -1;
+
+        __atomic_store_n(&ring->lost, ring->lost + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    copy_in(ring, head, &record, sizeof(record));
+    copy_in(ring, head + sizeof(record), message, length);
+
+    __atomic_store_n(&ring->head, head + sizeof(record) + length, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Send the messages of a ring to syslog.
+ *   ring: the ring in question.
+ * -> the number of messages sent.
+ */
+int drain(Ring *ring)
+{
+    char message[BUFSIZ];
+    int  count = 0;
+
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long tail = ring->tail;
+
+    while (tail < head) {
+        Record record;
+        copy_out(ring, tail, &record, sizeof(record));
+        copy_out(ring, tail + sizeof(record), message, record.length);
+
+        message[record.length] = 0;
+        tail += sizeof(record) + record.length;
+
+        if (record.level == 0)
+            syslog(LOG_ERR, "ERROR[%d]: %s", record.pid, message);
+        else
+            syslog(LOG_DEBUG, "DEBUG%d[%d]: %s", record.level, record.pid, message);
+
+        count++;
+    }
+
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    unsigned long lost = __atomic_load_n(&ring->lost, __ATOMIC_RELAXED);
+    if (lost != ring->reported) {
+        syslog(LOG_WARNING, "%lu message(s) dropped, the logger couldn't keep up.", lost - ring->reported);
+        ring->reported = lost;
+    }
+
+    return count;
+}
+
+/**
+ * Send the messages of all the workers to syslog, as they come. Never returns.
+ */
+void logger_loop(void)
+{
+    for (;;) {
+        int count = 0;
+        for (int i = 0; i < ring_count; i++)
+            count += drain(&rings[i]);
+
+        if (count == 0)
+            nanosleep(&(struct timespec){ 0, IDLE_TIME }, NULL);
+    }
+}
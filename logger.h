@@ -0,0 +1,25 @@
+/*
+ * logger.h
+ *  logger.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+/* size of the ring of messages of each worker */
+#define LOGGER_RING_SIZE 262144
+
+int      logger_initialize(int);
+void     logger_attach(int);
+int      logger_write(int, char *, unsigned long);
+
+void     logger_loop(void);
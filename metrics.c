@@ -0,0 +1,350 @@
+/*
+ * metrics.c
+ *  Counters and latency histograms of the workers, kept in shared memory
+ *  and served on a local socket by a process of their own.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "metrics.h"
+
+#ifndef COSMOPOLITAN
+#include <errno.h>       /* for errno, EAGAIN, EFBIG, ENOBUFS, ENOENT, EP... */
+#include <stdarg.h>      /* for va_list, va_start, va_end                    */
+#include <stdio.h>       /* for NULL, snprintf, vsnprintf                    */
+#include <stdlib.h>      /* for realloc                                      */
+#include <string.h>      /* for strchr, strcmp, strerror, strncmp, strstr    */
+#include <sys/socket.h>  /* for recv, send                                   */
+#endif
+
+#include "admission.h"   /* for admission_read                               */
+#include "server.h"      /* for accept_connection, close_connection          */
+#include "util.h"        /* for error, monotonic_time, shared_alloc          */
+
+/* latencies are counted in power-of-two buckets of microseconds (the last one is for anything longer) */
+#define BUCKET_COUNT    25
+
+/* what a worker has counted (only written by that worker) */
+typedef struct Slot {
+    unsigned long        counters[COUNTER_COUNT];
+    unsigned long        buckets[PHASE_COUNT][BUCKET_COUNT];
+    unsigned long long   sums[PHASE_COUNT];   /* microseconds */
+} Slot;
+
+/* slots are apart from each other, not to share cache lines between workers */
+#define SLOT_SIZE       ((sizeof(Slot) + 63) / 64 * 64)
+
+/* how counters are exposed, in the Prometheus text format */
+static struct {
+    char *name;
+    char *help;
+    char *label;
+} counters[COUNTER_COUNT] = {
+    [COUNTER_CONNECTIONS]   = { "feuille_connections_total",    "Connections accepted.",                       NULL },
+    [COUNTER_PASTES]        = { "feuille_pastes_total",         "Pastes stored.",                              NULL },
+    [COUNTER_DEDUPLICATED]  = { "feuille_deduplicated_total",   "Pastes matching an existing one.",            NULL },
+    [COUNTER_BYTES]         = { "feuille_received_bytes_total", "Bytes of pastes received.",                   NULL },
+    [COUNTER_TOO_BIG]       = { "feuille_rejected_total",       "Pastes rejected.",                            "reason=\"too_big\"" },
+    [COUNTER_EMPTY]         = { "feuille_rejected_total",       "Pastes rejected.",                            "reason=\"empty\"" },
+    [COUNTER_TIMEOUT]       = { "feuille_rejected_total",       "Pastes rejected.",                            "reason=\"timeout\"" },
+    [COUNTER_BAD_REQUEST]   = { "feuille_rejected_total",       "Pastes rejected.",                            "reason=\"bad_request\"" },
+    [COUNTER_LIMITED]       = { "feuille_rejected_total",       "Pastes rejected.",                            "reason=\"rate_limited\"" },
+    [COUNTER_SHED]          = { "feuille_rejected_total",       "Pastes rejected.",                            "reason=\"overloaded\"" },
+    [COUNTER_COLLISIONS]    = { "feuille_id_collisions_total",  "Generated IDs that were already used.",       NULL },
+    [COUNTER_WRITE_ERRORS]  = { "feuille_write_errors_total",   "Pastes that could not be written to disk.",   NULL },
+    [COUNTER_HTTP_REQUESTS] = { "feuille_http_requests_total",  "Requests for pastes served over HTTP.",       NULL },
+    [COUNTER_CACHE_HITS]    = { "feuille_cache_lookups_total",  "Pastes looked up in the cache.",              "result=\"hit\"" },
+    [COUNTER_CACHE_MISSES]  = { "feuille_cache_lookups_total",  "Pastes looked up in the cache.",              "result=\"miss\"" },
+};
+
+static char *phases[PHASE_COUNT] = {
+    [PHASE_RECEIVE] = "receive",
+    [PHASE_STORE]   = "store",
+    [PHASE_COMMIT]  = "commit",
+    [PHASE_RESPOND] = "respond",
+    [PHASE_TOTAL]   = "total",
+};
+
+/* slots of all the workers, shared with the stats process */
+static char            *slots      = NULL;
+static int              slot_count = 0;
+
+/* slot of this worker, NULL if metrics are disabled */
+static Slot            *slot       = NULL;
+
+/* text being sent by the stats process */
+static char            *text       = NULL;
+static unsigned long    text_size  = 0;
+static unsigned long    text_cap   = 0;
+
+/* functions declarations */
+static  void     append(char *, ...);
+static  void     render(void);
+
+/**
+ * Allocate the slots of the workers, before any of them is forked.
+ *   count: the number of worker slots.
+ * -> 0 if done, -1 if not.
+ */
+int metrics_initialize(int count)
+{
+    if ((slots = shared_alloc(count * SLOT_SIZE)) == NULL)
+        return -1;
+
+    slot_count = count;
+    return 0;
+}
+
+/**
+ * Make this process count in the slot of a worker. A worker replacing a dead one keeps counting from where it was.
+ *   index: the index of the worker slot.
+ */
+void metrics_attach(int index)
+{
+    if (slots != NULL && index < slot_count)
+        slot = (Slot *)(slots + index * SLOT_SIZE);
+}
+
+/**
+ * Get the current time, if metrics are enabled (the clock isn't read otherwise).
+ * -> the time elapsed since an arbitrary point in microseconds, or 0.
+ */
+long long metrics_now(void)
+{
+    if (slot == NULL)
+        return 0;
+
+    return monotonic_time();
+}
+
+/**
+ * Add to a counter.
+ *   counter: the counter in question.
+ *   value: what to add to it.
+ */
+void metrics_count(enum Counter counter, unsigned long value)
+{
+    if (slot != NULL)
+        slot->counters[counter] += value;
+}
+
+/**
+ * Count a paste rejected because of an error while reading it.
+ *   error: the value of errno set while reading the paste.
+ */
+void metrics_error(int error)
+{
+    switch (error) {
+    case EFBIG:
+        metrics_count(COUNTER_TOO_BIG, 1);
+        break;
+
+    case ENOENT:
+        metrics_count(COUNTER_EMPTY, 1);
+        break;
+
+    case EAGAIN:
+        metrics_count(COUNTER_TIMEOUT, 1);
+        break;
+
+    case EPROTO:
+        metrics_count(COUNTER_BAD_REQUEST, 1);
+        break;
+
+    case ENOBUFS:
+        metrics_count(COUNTER_SHED, 1);
+        break;
+    }
+}
+
+/**
+ * Record the duration of a phase, ending now.
+ *   phase: the phase in question.
+ *   start: when the phase started (see metrics_now).
+ */
+void metrics_time(enum Phase phase, long long start)
+{
+    if (slot != NULL)
+        metrics_spent(phase, metrics_now() - start);
+}
+
+/**
+ * Record the duration of a phase.
+ *   phase: the phase in question.
+ *   spent: how long it lasted, in microseconds.
+ */
+void metrics_spent(enum Phase phase, long long spent)
+{
+    if (slot == NULL)
+        return;
+
+    /* the bucket of a duration is its number of bits */
+    int bucket = 0;
+    for (long long left = spent; left > 0 && bucket < BUCKET_COUNT - 1; left >>= 1)
+        bucket++;
+
+    slot->buckets[phase][bucket]++;
+    slot->sums[phase] += spent > 0 ? spent : 0;
+}
+
+/**
+ * Append formatted text to what will be sent.
+ *   format: the format string, as with printf.
+ */
+void append(char *format, ...)
+{
+    va_list args;
+
+    for (;;) {
+        va_start(args, format);
+        int length = vsnprintf(text + text_size, text_cap - text_size, format, args);
+        va_end(args);
+
+        if (length < 0)
+            return;
+
+        if (text_size + length < text_cap) {
+            text_size += length;
+            return;
+        }
+
+        void *tmp;
+        if ((tmp = realloc(text, text_cap * 2 + length + 1)) == NULL)
+            return;
+
+        text      = tmp;
+        text_cap  = text_cap * 2 + length + 1;
+    }
+}
+
+/**
+ * Sum up the slots of all the workers, in the Prometheus text format.
+ */
+void render(void)
+{
+    text_size = 0;
+
+    /* counters, for all the workers */
+    for (int counter = 0; counter < COUNTER_COUNT; counter++) {
+        unsigned long total = 0;
+        for (int i = 0; i < slot_count; i++)
+            total += ((Slot *)(slots + i * SLOT_SIZE))->counters[counter];
+
+        if (counter == 0 || strcmp(counters[counter].name, counters[counter - 1].name) != 0)
+            append("# HELP %s %s\n# TYPE %s counter\n", counters[counter].name, counters[counter].help,
+                   counters[counter].name);
+
+        if (counters[counter].label != NULL)
+            append("%s{%s} %lu\n", counters[counter].name, counters[counter].label, total);
+        else
+            append("%s %lu\n", counters[counter].name, total);
+    }
+
+    /* connections of each worker, to see how well they're balanced */
+    append("# HELP feuille_worker_connections_total Connections accepted by each worker.\n"
+           "# TYPE feuille_worker_connections_total counter\n");
+
+    for (int i = 0; i < slot_count; i++)
+        append("feuille_worker_connections_total{worker=\"%d\"} %lu\n", i,
+               ((Slot *)(slots + i * SLOT_SIZE))->counters[COUNTER_CONNECTIONS]);
+
+    /* pastes in flight, if admission control is enabled */
+    long uploads, memory;
+    int  overloaded;
+
+    if ((overloaded = admission_read(&uploads, &memory)) != -1)
+        append("# HELP feuille_uploads Pastes being received or stored.\n"
+               "# TYPE feuille_uploads gauge\n"
+               "feuille_uploads %ld\n"
+               "# HELP feuille_upload_memory_bytes Bytes of the buffers of these pastes.\n"
+               "# TYPE feuille_upload_memory_bytes gauge\n"
+               "feuille_upload_memory_bytes %ld\n"
+               "# HELP feuille_overloaded Whether new pastes are turned away as they queue up.\n"
+               "# TYPE feuille_overloaded gauge\n"
+               "feuille_overloaded %d\n", uploads, memory, overloaded);
+
+    /* latencies, as cumulative histograms */
+    append("# HELP feuille_phase_seconds Time spent in each phase of a paste.\n"
+           "# TYPE feuille_phase_seconds histogram\n");
+
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        unsigned long      count = 0;
+        unsigned long long sum   = 0;
+
+        for (int bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+            for (int i = 0; i < slot_count; i++)
+                count += ((Slot *)(slots + i * SLOT_SIZE))->buckets[phase][bucket];
+
+            if (bucket < BUCKET_COUNT - 1)
+                append("feuille_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %lu\n",
+                       phases[phase], (1LL << bucket) / 1e6, count);
+        }
+
+        for (int i = 0; i < slot_count; i++)
+            sum += ((Slot *)(slots + i * SLOT_SIZE))->sums[phase];
+
+        append("feuille_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n", phases[phase], count);
+        append("feuille_phase_seconds_sum{phase=\"%s\"} %g\n", phases[phase], sum / 1e6);
+        append("feuille_phase_seconds_count{phase=\"%s\"} %lu\n", phases[phase], count);
+    }
+}
+
+/**
+ * Serve the metrics of all the workers to whoever connects to the stats socket. Never returns.
+ *   server: the stats socket.
+ */
+void metrics_loop(int server)
+{
+    char request[1024];
+    struct sockaddr_storage address;
+
+    for (;;) {
+        int connection;
+        if ((connection = accept_connection(server, &address)) == -1) {
+            error("error while accepting stats connection: %s", strerror(errno));
+            continue;
+        }
+
+        /* HTTP clients (e.g. Prometheus) are answered once their request is over, other ones right away */
+        long size = 0, length;
+        while (size < (long)sizeof(request) - 1
+            && (length = recv(connection, request + size, sizeof(request) - 1 - size, 0)) > 0) {
+            size += length;
+            request[size] = 0;
+
+            if (strstr(request, "\r\n\r\n") != NULL || strchr(request, '\n') == request + size - 1)
+                break;
+        }
+
+        render();
+
+        char header[128];
+        int  header_size = snprintf(header, sizeof(header),
+                                    "HTTP/1.0 200 OK\r\n"
+                                    "Content-Type: text/plain; version=0.0.4\r\n"
+                                    "Content-Length: %lu\r\n"
+                                    "\r\n", text_size);
+
+        /* raw clients (netcat...) only get the metrics */
+        if (size >= 4 && strncmp(request, "GET ", 4) == 0)
+            send(connection, header, header_size, 0);
+
+        for (unsigned long sent = 0; sent < text_size;) {
+            long written;
+            if ((written = send(connection, text + sent, text_size - sent, 0)) <= 0)
+                break;
+
+            sent += written;
+        }
+
+        close_connection(connection);
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * metrics.h
+ *  metrics.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+/* what the workers count */
+enum Counter {
+    COUNTER_CONNECTIONS,
+    COUNTER_PASTES,
+    COUNTER_DEDUPLICATED,
+    COUNTER_BYTES,
+    COUNTER_TOO_BIG,
+    COUNTER_EMPTY,
+    COUNTER_TIMEOUT,
+    COUNTER_BAD_REQUEST,
+    COUNTER_LIMITED,
+    COUNTER_SHED,
+    COUNTER_COLLISIONS,
+    COUNTER_WRITE_ERRORS,
+    COUNTER_HTTP_REQUESTS,
+    COUNTER_CACHE_HITS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_COUNT
+};
+
+/* what the workers time */
+enum Phase {
+    PHASE_RECEIVE,   /* from the connection to the whole paste      */
+    PHASE_STORE,     /* store_paste                                 */
+    PHASE_COMMIT,    /* durability_commit                           */
+    PHASE_RESPOND,   /* sending the response                        */
+    PHASE_TOTAL,     /* from the connection to the end of the response */
+    PHASE_COUNT
+};
+
+int          metrics_initialize(int);
+void         metrics_attach(int);
+
+long long    metrics_now(void);
+void         metrics_count(enum Counter, unsigned long);
+void         metrics_error(int);
+void         metrics_time(enum Phase, long long);
+void         metrics_spent(enum Phase, long long);
+
+void         metrics_loop(int);
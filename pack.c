@@ -0,0 +1,893 @@
+/*
+ * pack.c
+ *  Pack storage: pastes are appended to large segment files instead of
+ *  having a file each, and found through an index shared by all workers.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "pack.h"
+
+#ifndef COSMOPOLITAN
+#include <dirent.h>      /* for opendir, readdir, closedir, DIR, dirent      */
+#include <errno.h>       /* for errno, EEXIST, ENAMETOOLONG, ENOENT          */
+#include <fcntl.h>       /* for open, O_CREAT, O_EXCL, O_RDONLY, O_RDWR, ... */
+#include <limits.h>      /* for UCHAR_MAX                                    */
+#include <stddef.h>      /* for offsetof                                     */
+#include <stdint.h>      /* for int64_t, uint8_t, uint16_t, uint32_t, ui...  */
+#include <stdio.h>       /* for snprintf, NULL                               */
+#include <stdlib.h>      /* for strtoul                                      */
+#include <string.h>      /* for memcmp, memcpy, strerror, strlen             */
+#include <sys/file.h>    /* for flock, LOCK_EX, LOCK_NB                      */
+#include <sys/mman.h>    /* for mmap, munmap, MAP_FAILED, MAP_PRIVATE, ...   */
+#include <sys/stat.h>    /* for fstat, mkdir, utimensat, stat                */
+#include <time.h>        /* for time, timespec                               */
+#include <unistd.h>      /* for close, fsync, pread, pwrite, unlink, write   */
+#endif
+
+#include "bin.h"         /* for write_paste, paste_path, PASTE_PATH_SIZE     */
+#include "durability.h"  /* for durability_file                              */
+#include "feuille.h"     /* for Settings, settings                           */
+#include "table.h"       /* for Table, table_*                               */
+#include "util.h"        /* for verbose, error, shared_alloc                 */
+
+/* a segment is closed once it's that big, and the next pastes go to a new one (bytes) */
+#define SEGMENT_SIZE        (64 * 1024 * 1024)
+
+/* a segment is compacted once at least half of it has expired */
+#define COMPACT_RATIO       2
+
+/* size of the chunks copied from the temporary file of a paste */
+#define CHUNK_SIZE          65536
+
+/* what every record starts with (`fpak') */
+#define RECORD_MAGIC        0x6b617066
+
+/* locations that don't point to a record: the paste is being written, or it has expired */
+#define LOCATION_PENDING    0
+#define LOCATION_GONE       1
+
+/* a segment is a series of records: this header, the ID, then the paste */
+typedef struct Record {
+    uint32_t         magic;
+    uint8_t          dead;        /* set once expired (or moved elsewhere)  */
+    uint8_t          length;      /* of the ID                              */
+    uint16_t         padding;
+    int64_t          created;     /* seconds, for the expiry                */
+    uint64_t         size;        /* of the paste                           */
+} Record;
+
+/* where a paste is: the number of its segment, and the offset of its record */
+typedef struct Entry {
+    uint64_t         location;    /* segment << 32 | offset                 */
+} Entry;
+
+/* shared by all workers, with an entry for every slot of the table of IDs */
+typedef struct Packs {
+    uint32_t         next;        /* number of the next segment             */
+    Entry            entries[];
+} Packs;
+
+static Packs           *packs   = NULL;
+static Table            ids     = { NULL, 0 };
+
+/* segment this process is appending to (every worker has its own) */
+static int              segment = -1;
+static uint32_t         active  = 0;
+static unsigned long    filled  = 0;
+
+/* set by the expiry process: its copies are synced before the segment they come from is removed */
+static int              syncing = 0;
+
+/* state of pack_walk and of the compaction */
+static int            (*walker)(char *, long) = NULL;
+static int              source  = -1;
+static int              failed  = 0;
+static unsigned long    live    = 0;
+static unsigned long    dead    = 0;
+
+/* functions declarations */
+static  Entry      *find(char *);
+static  int         open_segment(uint32_t, int);
+static  int         segment_number(char *, uint32_t *);
+static  int         sync_folder(void);
+static  int         write_all(int, char *, unsigned long);
+static  int         rotate(void);
+static  int         append(Record *, char *, char *, int, uint64_t *);
+static  int         bury(int, uint64_t);
+static  int         read_record(uint64_t, char *, Record *, int);
+static  long        scan(uint32_t, int (*)(uint32_t, unsigned long, Record *, char *, char *));
+static  long        scan_all(int (*)(uint32_t, unsigned long, Record *, char *, char *));
+static  int         insert(uint32_t, unsigned long, Record *, char *, char *);
+static  int         walk(uint32_t, unsigned long, Record *, char *, char *);
+static  int         measure(uint32_t, unsigned long, Record *, char *, char *);
+static  int         move(uint32_t, unsigned long, Record *, char *, char *);
+static  int         export(uint32_t, unsigned long, Record *, char *, char *);
+static  long        compact(uint32_t);
+
+/**
+ * Find the entry of an ID in the index.
+ *   id: the ID in question.
+ * -> the entry, or NULL if the ID isn't used.
+ */
+Entry *find(char *id)
+{
+    if (packs == NULL)
+        return NULL;
+
+    long slot;
+    if ((slot = table_find(&ids, table_fingerprint(id))) == -1)
+        return NULL;
+
+    return &packs->entries[slot];
+}
+
+/**
+ * Open a segment.
+ *   number: the number of the segment.
+ *   flags: the flags given to open.
+ * -> the file descriptor, or -1 if an error occured.
+ */
+int open_segment(uint32_t number, int flags)
+{
+    char path[32];
+    snprintf(path, sizeof(path), PACK_FOLDER "/%lu", (unsigned long)number);
+
+    return open(path, flags | O_CLOEXEC, 0666);
+}
+
+/**
+ * Get the number of a segment from its name.
+ *   name: the name of the file in question.
+ *   number: where to store the number.
+ * -> 1 if it's a segment, 0 if not.
+ */
+int segment_number(char *name, uint32_t *number)
+{
+    char          *rest;
+    unsigned long  value = strtoul(name, &rest, 10);
+
+    if (*name < '1' || *name > '9' || *rest != 0 || value > UINT32_MAX)
+        return 0;
+
+    *number = value;
+    return 1;
+}
+
+/**
+ * Sync the folder of the segments, so that a new (or removed) segment survives a crash.
+ * -> 0 if done, -1 if not.
+ */
+int sync_folder(void)
+{
+    int folder;
+    if ((folder = open(PACK_FOLDER, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+        return -1;
+
+    int status = fsync(folder);
+
+    close(folder);
+    return status;
+}
+
+/**
+ * Write a whole buffer to a file.
+ *   file: the file descriptor.
+ *   data: the buffer in question.
+ *   size: the size of the buffer.
+ * -> 0 if done, -1 if not.
+ */
+int write_all(int file, char *data, unsigned long size)
+{
+    for (long left = size, written; left > 0; left -= written)
+        if ((written = write(file, data + size - left, left)) <= 0)
+            return -1;
+
+    return 0;
+}
+
+/**
+ * Start appending to a new segment.
+ * -> 0 if done, -1 if not.
+ */
+int rotate(void)
+{
+    if (segment != -1) {
+        if (syncing)
+            fsync(segment);
+
+        /* its lock goes along with it: the expiry process can compact it from now on */
+        close(segment);
+    }
+
+    /* an empty segment left by a crash keeps its number */
+    do
+        active = __atomic_fetch_add(&packs->next, 1, __ATOMIC_RELAXED);
+    while ((segment = open_segment(active, O_WRONLY | O_CREAT | O_EXCL)) == -1 && errno == EEXIST);
+
+    if (segment == -1)
+        return -1;
+
+    filled = 0;
+
+    flock(segment, LOCK_EX);
+
+    /* the segment has to be found after a crash, before any of its pastes is acknowledged */
+    if ((syncing || settings.durability != DURABILITY_NONE) && sync_folder() != 0) {
+        close(segment);
+        segment = -1;
+        return -1;
+    }
+
+    verbose(2, "appending to segment %lu.", (unsigned long)active);
+    return 0;
+}
+
+/**
+ * Append a record to the segment of this process.
+ *   record: the header of the record.
+ *   id: the ID of the paste.
+ *   data: the content of the paste, if it's in memory.
+ *   file: the temporary file holding the paste, -1 if it's in memory.
+ *   location: where to store the location of the record.
+ * -> 0 if done, -1 if not.
+ */
+int append(Record *record, char *id, char *data, int file, uint64_t *location)
+{
+    if ((segment == -1 || filled >= SEGMENT_SIZE) && rotate() != 0)
+        return -1;
+
+    char header[sizeof(Record) + UCHAR_MAX];
+    memcpy(header, record, sizeof(Record));
+    memcpy(header + sizeof(Record), id, record->length);
+
+    int status = write_all(segment, header, sizeof(Record) + record->length);
+
+    if (status == 0 && file == -1)
+        status = write_all(segment, data, record->size);
+
+    for (unsigned long offset = 0; status == 0 && file != -1 && offset < record->size;) {
+        static char chunk[CHUNK_SIZE];
+
+        long size = pread(file, chunk, record->size - offset < sizeof(chunk) ? record->size - offset : sizeof(chunk), offset);
+        if (size <= 0 || write_all(segment, chunk, size) != 0)
+            status = -1;
+
+        offset += size;
+    }
+
+    /* anything after a record cut short would be lost: the next pastes go to another segment */
+    if (status != 0) {
+        close(segment);
+        segment = -1;
+        return -1;
+    }
+
+    *location = (uint64_t)active << 32 | filled;
+    filled   += sizeof(Record) + record->length + record->size;
+
+    return 0;
+}
+
+/**
+ * Mark a record as dead, so that it's neither indexed on the next start nor kept by a compaction.
+ *   file: the segment of the record, open for writing.
+ *   location: the location of the record.
+ * -> 0 if done, -1 if not.
+ */
+int bury(int file, uint64_t location)
+{
+    uint8_t flag = 1;
+
+    if (pwrite(file, &flag, 1, (location & UINT32_MAX) + offsetof(Record, dead)) != 1)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Open the segment of a paste, and read its record.
+ *   location: the location of the record.
+ *   id: the ID the record should have.
+ *   record: where to store the header of the record.
+ *   flags: the flags given to open.
+ * -> the file descriptor of the segment, or -1 if the record isn't there (anymore).
+ */
+int read_record(uint64_t location, char *id, Record *record, int flags)
+{
+    int file;
+    if ((file = open_segment(location >> 32, flags)) == -1)
+        return -1;
+
+    char           header[sizeof(Record) + UCHAR_MAX];
+    unsigned long  length = strlen(id);
+    long           size   = pread(file, header, sizeof(Record) + length, location & UINT32_MAX);
+
+    memcpy(record, header, sizeof(Record));
+
+    if (size != (long)(sizeof(Record) + length) || record->magic != RECORD_MAGIC || record->dead
+     || record->length != length || memcmp(header + sizeof(Record), id, length) != 0) {
+        close(file);
+        errno = ENOENT;
+        return -1;
+    }
+
+    return file;
+}
+
+/**
+ * Call a function for every record of a segment.
+ *   number: the number of the segment.
+ *   callback: the function in question, called with the number of the segment,
+ *             the offset, header, ID and content of every record.
+ * -> the sum of what the function returned, or -1 if an error occured.
+ */
+long scan(uint32_t number, int (*callback)(uint32_t, unsigned long, Record *, char *, char *))
+{
+    int file;
+    if ((file = open_segment(number, O_RDONLY)) == -1)
+        return errno == ENOENT ? 0 : -1;
+
+    struct stat status;
+    if (fstat(file, &status) != 0) {
+        close(file);
+        return -1;
+    }
+
+    unsigned long size = status.st_size;
+    if (size == 0) {
+        close(file);
+        return 0;
+    }
+
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+
+    if (data == MAP_FAILED)
+        return -1;
+
+    long count = 0;
+    for (unsigned long offset = 0; size - offset >= sizeof(Record);) {
+        Record record;
+        memcpy(&record, data + offset, sizeof(record));
+
+        /* a segment can end with a record cut short by a crash */
+        unsigned long left = size - offset - sizeof(record);
+
+        if (record.magic != RECORD_MAGIC || record.length == 0 || record.length > left
+         || record.size > left - record.length)
+            break;
+
+        char id[UCHAR_MAX + 1];
+        memcpy(id, data + offset + sizeof(record), record.length);
+        id[record.length] = 0;
+
+        count  += callback(number, offset, &record, id, data + offset + sizeof(record) + record.length);
+        offset += sizeof(record) + record.length + record.size;
+    }
+
+    munmap(data, size);
+    return count;
+}
+
+/**
+ * Call a function for every record of every segment, see scan.
+ *   callback: the function in question.
+ * -> the sum of what the function returned, or -1 if an error occured.
+ */
+long scan_all(int (*callback)(uint32_t, unsigned long, Record *, char *, char *))
+{
+    DIR *folder;
+    if ((folder = opendir(PACK_FOLDER)) == NULL)
+        return -1;
+
+    long count = 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(folder)) != NULL) {
+        uint32_t number;
+        if (!segment_number(entry->d_name, &number))
+            continue;
+
+        long found;
+        if ((found = scan(number, callback)) == -1) {
+            closedir(folder);
+            return -1;
+        }
+
+        count += found;
+    }
+
+    closedir(folder);
+    return count;
+}
+
+/**
+ * Create the index of the packs, before any worker is forked.
+ *   size: the number of pastes the index should hold.
+ * -> 0 if done, -1 if not.
+ */
+int pack_initialize(unsigned long size)
+{
+    if (table_initialize(&ids, size) != 0)
+        return -1;
+
+    if ((packs = shared_alloc(sizeof(Packs) + (ids.mask + 1) * sizeof(Entry))) == NULL)
+        return -1;
+
+    packs->next = 1;
+
+    return 0;
+}
+
+/**
+ * Add a record found in a segment to the index (before the workers are started).
+ * -> 1 if added, 0 if not.
+ */
+int insert(uint32_t number, unsigned long offset, Record *record, char *id, char *data)
+{
+    (void)data;
+
+    if (number >= packs->next)
+        packs->next = number + 1;
+
+    if (record->dead)
+        return 0;
+
+    uint64_t location = (uint64_t)number << 32 | offset;
+
+    unsigned long slot;
+    int           claimed;
+    if ((claimed = table_claim(&ids, table_fingerprint(id), &slot)) == -1) {
+        error("the index is full, paste `%s' can't be found (see -x).", id);
+        return 0;
+    }
+
+    Entry *entry = &packs->entries[slot];
+
+    if (claimed) {
+        entry->location = location;
+        return 1;
+    }
+
+    /* a compaction was interrupted: its copy, in a newer segment, is kept */
+    uint64_t older = location < entry->location ? location : entry->location;
+
+    if (location > entry->location)
+        entry->location = location;
+
+    int file;
+    if ((file = open_segment(older >> 32, O_WRONLY)) != -1) {
+        bury(file, older);
+        close(file);
+    }
+
+    return 0;
+}
+
+/**
+ * Fill the index with the pastes of the segments.
+ * -> the number of pastes indexed, or -1 if an error occured.
+ */
+long pack_load(void)
+{
+    if (mkdir(PACK_FOLDER, 0755) != 0 && errno != EEXIST)
+        return -1;
+
+    return scan_all(insert);
+}
+
+/**
+ * Atomically claim an ID, so that no other worker can use it.
+ *   id: the ID in question.
+ * -> 1 if the ID has been claimed, 0 if it's already used, -1 if the index is full.
+ */
+int pack_claim(char *id)
+{
+    unsigned long slot;
+    int           claimed;
+    if ((claimed = table_claim(&ids, table_fingerprint(id), &slot)) != 1)
+        return claimed;
+
+    /* the slot can be the one of an expired paste */
+    __atomic_store_n(&packs->entries[slot].location, LOCATION_PENDING, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Release an ID whose paste couldn't be written, or has expired.
+ *   id: the ID in question.
+ */
+void pack_release(char *id)
+{
+    table_release(&ids, table_fingerprint(id));
+}
+
+/**
+ * Check whether a paste is in the packs.
+ *   id: the ID of the paste.
+ * -> 1 if it is, 0 if not.
+ */
+int pack_exists(char *id)
+{
+    Entry *entry;
+    if ((entry = find(id)) == NULL)
+        return 0;
+
+    return __atomic_load_n(&entry->location, __ATOMIC_ACQUIRE) > LOCATION_GONE;
+}
+
+/**
+ * Append a paste to the segment of this worker, and make it available to the others.
+ *   id: the ID of the paste, already claimed.
+ *   buffer: the content of the paste, if it's in memory.
+ *   size: the size of the paste.
+ *   file: the temporary file holding the paste, -1 if it's in memory.
+ * -> 0 if done, -1 if not.
+ */
+int pack_write(char *id, char *buffer, unsigned long size, int file)
+{
+    Entry *entry;
+    if ((entry = find(id)) == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (strlen(id) > UCHAR_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    Record record = { .magic = RECORD_MAGIC, .length = strlen(id), .created = time(NULL), .size = size };
+
+    uint64_t location;
+    if (append(&record, id, buffer, file, &location) != 0)
+        return -1;
+
+    /* make it durable, if every paste is synced on its own */
+    if (durability_file(segment) != 0) {
+        bury(segment, location);
+        return -1;
+    }
+
+    __atomic_store_n(&entry->location, location, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Open the segment of a paste, to read it with pread or sendfile.
+ *   id: the ID of the paste.
+ *   offset: where to store the offset of the paste in the segment.
+ *   size: where to store the size of the paste.
+ * -> the file descriptor of the segment, or -1 if the paste doesn't exist.
+ */
+int pack_open(char *id, long long *offset, unsigned long *size)
+{
+    Entry *entry;
+    if ((entry = find(id)) == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* a compaction can move the paste (and remove its segment) in the meantime: look again */
+    for (int attempt = 0; attempt < 2; attempt++) {
+        uint64_t location = __atomic_load_n(&entry->location, __ATOMIC_ACQUIRE);
+
+        if (location <= LOCATION_GONE)
+            break;
+
+        Record record;
+        int    file;
+        if ((file = read_record(location, id, &record, O_RDONLY)) == -1)
+            continue;
+
+        *offset = (location & UINT32_MAX) + sizeof(Record) + record.length;
+        *size   = record.size;
+
+        return file;
+    }
+
+    errno = ENOENT;
+    return -1;
+}
+
+/**
+ * Give a paste a fresh lifetime (see expiry_renew).
+ *   id: the ID of the paste.
+ * -> 0 if done, -1 if not (e.g. the paste has already expired).
+ */
+int pack_renew(char *id)
+{
+    Entry *entry;
+    if ((entry = find(id)) == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    int64_t now = time(NULL);
+
+    /* done again if a compaction has moved the paste in the meantime */
+    for (;;) {
+        uint64_t location = __atomic_load_n(&entry->location, __ATOMIC_ACQUIRE);
+
+        Record record;
+        int    file = -1;
+        if (location <= LOCATION_GONE || (file = read_record(location, id, &record, O_RDWR)) == -1) {
+            if (location > LOCATION_GONE && __atomic_load_n(&entry->location, __ATOMIC_ACQUIRE) != location)
+                continue;
+
+            errno = ENOENT;
+            return -1;
+        }
+
+        int status = pwrite(file, &now, sizeof(now), (location & UINT32_MAX) + offsetof(Record, created)) == sizeof(now) ? 0 : -1;
+        close(file);
+
+        if (__atomic_load_n(&entry->location, __ATOMIC_ACQUIRE) == location)
+            return status;
+    }
+}
+
+/**
+ * Get the creation time of a paste, e.g. to know whether it has expired before reading it.
+ *   id: the ID of the paste.
+ * -> the creation time of the paste, or -1 if there's none.
+ */
+long pack_created(char *id)
+{
+    Entry *entry;
+    if ((entry = find(id)) == NULL)
+        return -1;
+
+    uint64_t location = __atomic_load_n(&entry->location, __ATOMIC_ACQUIRE);
+
+    Record record;
+    int    file;
+    if (location <= LOCATION_GONE || (file = read_record(location, id, &record, O_RDONLY)) == -1)
+        return -1;
+
+    close(file);
+    return record.created;
+}
+
+/**
+ * Mark a paste as expired, if it still is. Its space is reclaimed by the next compaction.
+ *   id: the ID of the paste.
+ * -> 1 if expired, 0 if not.
+ */
+int pack_expire(char *id)
+{
+    Entry *entry;
+    if ((entry = find(id)) == NULL)
+        return 0;
+
+    uint64_t location = __atomic_load_n(&entry->location, __ATOMIC_ACQUIRE);
+
+    Record record;
+    int    file;
+    if (location <= LOCATION_GONE || (file = read_record(location, id, &record, O_RDWR)) == -1)
+        return 0;
+
+    /* the paste could have been renewed */
+    if (record.created + (long)settings.retention > time(NULL)) {
+        close(file);
+        return 0;
+    }
+
+    int expired = __atomic_compare_exchange_n(&entry->location, &location, LOCATION_GONE, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+                  && bury(file, location) == 0;
+
+    close(file);
+
+    /* its ID can be used again, as it would be after a restart */
+    if (expired)
+        pack_release(id);
+
+    return expired;
+}
+
+/**
+ * Call pack_walk's function for a record, if it's still in use.
+ * -> what the function returned, or 0.
+ */
+int walk(uint32_t number, unsigned long offset, Record *record, char *id, char *data)
+{
+    (void)number;
+    (void)offset;
+    (void)data;
+
+    return record->dead ? 0 : walker(id, record->created);
+}
+
+/**
+ * Call a function for every paste of the segments.
+ *   callback: the function in question, called with the ID and the creation time of every paste.
+ * -> the number of pastes for which the function returned 1, or -1 if an error occured.
+ */
+long pack_walk(int (*callback)(char *, long))
+{
+    walker = callback;
+
+    return scan_all(walk);
+}
+
+/**
+ * Count the bytes of a record as still in use, or as reclaimable.
+ * -> 0.
+ */
+int measure(uint32_t number, unsigned long offset, Record *record, char *id, char *data)
+{
+    (void)data;
+
+    Entry        *entry = find(id);
+    unsigned long size  = sizeof(Record) + record->length + record->size;
+
+    if (entry != NULL && __atomic_load_n(&entry->location, __ATOMIC_ACQUIRE) == ((uint64_t)number << 32 | offset))
+        live += size;
+    else
+        dead += size;
+
+    return 0;
+}
+
+/**
+ * Copy a record still in use to the segment of the expiry process, and point the index to the copy.
+ * -> 1 if moved, 0 if not.
+ */
+int move(uint32_t number, unsigned long offset, Record *record, char *id, char *data)
+{
+    uint64_t location = (uint64_t)number << 32 | offset;
+
+    Entry *entry;
+    if (failed || (entry = find(id)) == NULL || __atomic_load_n(&entry->location, __ATOMIC_ACQUIRE) != location)
+        return 0;
+
+    uint64_t copy;
+    if (append(record, id, data, -1, &copy) != 0) {
+        failed = 1;
+        return 0;
+    }
+
+    /* it has just expired */
+    if (!__atomic_compare_exchange_n(&entry->location, &location, copy, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        bury(segment, copy);
+        return 0;
+    }
+
+    /* it could have been renewed while it was copied (see pack_renew) */
+    int64_t created;
+    if (pread(source, &created, sizeof(created), offset + offsetof(Record, created)) == sizeof(created)
+     && created > record->created)
+        pwrite(segment, &created, sizeof(created), (copy & UINT32_MAX) + offsetof(Record, created));
+
+    return 1;
+}
+
+/**
+ * Compact a segment if enough of it has expired: the pastes still in use are copied, then it's removed.
+ *   number: the number of the segment.
+ * -> 1 if compacted, 0 if not, -1 if an error occured.
+ */
+long compact(uint32_t number)
+{
+    int file;
+    if ((file = open_segment(number, O_RDONLY)) == -1)
+        return errno == ENOENT ? 0 : -1;
+
+    /* the segments being appended to are locked by their worker */
+    if (flock(file, LOCK_EX | LOCK_NB) != 0) {
+        close(file);
+        return 0;
+    }
+
+    live = 0;
+    dead = 0;
+
+    if (scan(number, measure) == -1 || dead == 0 || dead * COMPACT_RATIO < live + dead) {
+        close(file);
+        return 0;
+    }
+
+    source = file;
+    failed = 0;
+
+    long moved = scan(number, move);
+
+    /* the pastes have to be safe in their copy before it's the only one */
+    if (moved == -1 || failed || (segment != -1 && fsync(segment) != 0)) {
+        close(file);
+        return -1;
+    }
+
+    char path[32];
+    snprintf(path, sizeof(path), PACK_FOLDER "/%lu", (unsigned long)number);
+
+    int status = unlink(path) == 0 ? sync_folder() : -1;
+    close(file);
+
+    if (status != 0)
+        return -1;
+
+    verbose(1, "segment %lu compacted, %ld paste(s) moved, %lu bytes reclaimed.", (unsigned long)number, moved, dead);
+    return 1;
+}
+
+/**
+ * Compact the segments whose pastes have mostly expired.
+ * -> the number of segments compacted, or -1 if an error occured.
+ */
+long pack_compact(void)
+{
+    DIR *folder;
+    if ((folder = opendir(PACK_FOLDER)) == NULL)
+        return -1;
+
+    syncing = 1;
+
+    long count = 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(folder)) != NULL) {
+        uint32_t number;
+        if (!segment_number(entry->d_name, &number))
+            continue;
+
+        long status;
+        if ((status = compact(number)) == -1) {
+            closedir(folder);
+            return -1;
+        }
+
+        count += status;
+    }
+
+    closedir(folder);
+    return count;
+}
+
+/**
+ * Write a paste of a segment to a file of its own, with the same creation time.
+ * -> 1 if written, 0 if not.
+ */
+int export(uint32_t number, unsigned long offset, Record *record, char *id, char *data)
+{
+    (void)number;
+    (void)offset;
+
+    if (record->dead)
+        return 0;
+
+    if (write_paste(data, record->size, id) != 0) {
+        if (errno != EEXIST)
+            error("could not export paste `%s': %s", id, strerror(errno));
+
+        return 0;
+    }
+
+    /* it expires as if it had always been a file */
+    char path[PASTE_PATH_SIZE];
+    struct timespec times[2] = { { .tv_sec = record->created }, { .tv_sec = record->created } };
+
+    if (paste_path(id, path, sizeof(path)) == 0)
+        utimensat(AT_FDCWD, path, times, 0);
+
+    return 1;
+}
+
+/**
+ * Write every paste of the segments to a file of its own, in the storage layout set in the settings.
+ * The segments are left as is.
+ * -> the number of pastes written, or -1 if an error occured.
+ */
+long pack_export(void)
+{
+    return scan_all(export);
+}
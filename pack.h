@@ -0,0 +1,36 @@
+/*
+ * pack.h
+ *  pack.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+/* folder holding the segments, each one named after its number */
+#define PACK_FOLDER ".pack"
+
+int      pack_initialize(unsigned long);
+long     pack_load(void);
+
+int      pack_claim(char *);
+void     pack_release(char *);
+int      pack_exists(char *);
+
+int      pack_write(char *, char *, unsigned long, int);
+int      pack_open(char *, long long *, unsigned long *);
+
+int      pack_renew(char *);
+long     pack_created(char *);
+int      pack_expire(char *);
+long     pack_walk(int (*)(char *, long));
+long     pack_compact(void);
+long     pack_export(void);
@@ -0,0 +1,636 @@
+/*
+ * paste.c
+ *  Incoming pastes handling.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _GNU_SOURCE
+
+#include "paste.h"
+
+#ifndef COSMOPOLITAN
+#include <errno.h>       /* for errno, EFBIG, EIO, EINVAL, ENOBUFS...  */
+#include <fcntl.h>       /* for splice, O_CLOEXEC, SPLICE_F_MOVE       */
+#include <stdio.h>       /* for BUFSIZ                                 */
+#include <stdlib.h>      /* for free, mkstemp                          */
+#include <string.h>      /* for memcmp, memmove, strcpy, strlen        */
+#include <sys/socket.h>  /* for recv                                   */
+#include <sys/stat.h>    /* for fchmod                                 */
+#include <unistd.h>      /* for close, pipe2, pread, pwrite, unlink... */
+#endif
+
+#include "admission.h"   /* for admission_reserve, admission_release... */
+#include "batch.h"       /* for batch_match, batch_open, batch_filter... */
+#include "feuille.h"     /* for Settings, settings                     */
+#include "pool.h"        /* for pool_get, pool_grow, pool_put          */
+#include "post.h"        /* for post_match, post_open, post_filter...  */
+#include "tls.h"         /* for tls_closing, HAVE_TLS                  */
+#include "util.h"        /* for hash_bytes, HASH_INIT                  */
+
+/* functions declarations */
+static  int      get_buffer(Paste *, unsigned long);
+static  int      grow_buffer(Paste *);
+static  int      open_batch(Paste *, int);
+static  int      undecided(char *, unsigned long);
+static  int      identify(Paste *, char *, unsigned long);
+static  int      release(Paste *);
+static  long     receive_memory(Paste *, int);
+static  long     receive_stream(Paste *, int);
+static  long     receive_splice(Paste *, int);
+static  int      append_file(Paste *, char *, unsigned long);
+static  int      hash_file(Paste *);
+
+/**
+ * Prepare a paste to be received, depending on the ingest mode.
+ *   paste: the paste in question.
+ * -> 0 if done, -1 if not.
+ */
+int paste_open(Paste *paste)
+{
+    paste->buffer      = NULL;
+    paste->buffer_size = 0;
+    paste->file        = -1;
+    paste->pipe[0]     = -1;
+    paste->pipe[1]     = -1;
+    paste->size        = 0;
+    paste->hash        = HASH_INIT;
+    paste->held        = 0;
+    paste->reserved    = 0;
+    paste->received    = 0;
+    paste->deferred    = 0;
+    paste->output      = -1;
+    paste->id          = NULL;
+    paste->post        = NULL;
+    paste->batch       = NULL;
+
+    paste->temporary[0] = 0;
+
+    /* memory ingest: get a buffer to store the data */
+    if (settings.ingest == INGEST_MEMORY)
+        return get_buffer(paste, pool_initial_size());
+
+    /* stream ingest: data goes through a fixed-size buffer, whatever the paste size */
+    if (settings.ingest == INGEST_STREAM && get_buffer(paste, settings.buffer_size) != 0)
+        return -1;
+
+    /* splice ingest: data goes from the socket to a pipe, then from the pipe to the file */
+    if (settings.ingest == INGEST_SPLICE) {
+#ifdef HAVE_SPLICE
+        if (pipe2(paste->pipe, O_CLOEXEC) == -1) {
+            paste_close(paste);
+            return -1;
+        }
+#else
+        errno = ENOTSUP;
+        paste_close(paste);
+        return -1;
+#endif
+    }
+
+    /* the temporary file is linked to the paste ID once everything is received */
+    /* it's hidden so that web servers don't serve it */
+    strcpy(paste->temporary, ".tmp.XXXXXX");
+
+    if ((paste->file = mkstemp(paste->temporary)) == -1) {
+        paste->temporary[0] = 0;
+        paste_close(paste);
+        return -1;
+    }
+
+    /* mkstemp creates files only readable by their owner */
+    fchmod(paste->file, 0644);
+
+    return 0;
+}
+
+/**
+ * Get a buffer for a paste from the pool.
+ *   paste: the paste in question.
+ *   size: the minimum capacity of the buffer.
+ * -> 0 if done, -1 if not.
+ */
+int get_buffer(Paste *paste, unsigned long size)
+{
+    if ((paste->buffer = pool_get(size, &paste->buffer_size)) == NULL)
+        return -1;
+
+    /* the paste has already been let in, its first buffer is counted whatever the budget */
+    admission_reserve(paste->buffer_size, 1);
+    paste->reserved = paste->buffer_size;
+
+    return 0;
+}
+
+/**
+ * Grow the buffer of a paste geometrically, if the memory budget allows it.
+ *   paste: the paste in question.
+ * -> 0 if done, -1 if not (errno is ENOBUFS if it's over the budget).
+ */
+int grow_buffer(Paste *paste)
+{
+    /* a buffer grows twice as large at most */
+    unsigned long capacity = paste->buffer_size;
+
+    if (admission_reserve(capacity, 0) != 0) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    char *tmp;
+    if ((tmp = pool_grow(paste->buffer, &paste->buffer_size, settings.max_size + 1)) == NULL) {
+        admission_release(capacity);
+        return -1;
+    }
+
+    /* give back what it didn't take */
+    admission_release(2 * capacity - paste->buffer_size);
+    paste->reserved += paste->buffer_size - capacity;
+
+    paste->buffer = tmp;
+    return 0;
+}
+
+/**
+ * Start handling a paste as a batch upload. Batches are received in memory whatever the ingest mode, to be split once received.
+ *   paste: the paste in question (nothing has been added to it yet).
+ *   mode: the kind of batch upload (see batch_match).
+ * -> 0 if done, -1 if not.
+ */
+int open_batch(Paste *paste, int mode)
+{
+    if (paste->pipe[0] != -1) {
+        close(paste->pipe[0]);
+        close(paste->pipe[1]);
+
+        paste->pipe[0] = -1;
+        paste->pipe[1] = -1;
+    }
+
+    if (paste->file != -1) {
+        close(paste->file);
+        unlink(paste->temporary);
+
+        paste->file         = -1;
+        paste->temporary[0] = 0;
+    }
+
+    if (paste->buffer == NULL && get_buffer(paste, pool_initial_size()) != 0)
+        return -1;
+
+    return batch_open(paste, mode);
+}
+
+/**
+ * Check whether the first bytes received on a connection could still be those of an HTTP or a batch upload.
+ *   data: the bytes in question.
+ *   size: the number of bytes.
+ * -> 1 if more bytes are needed to tell, 0 if not.
+ */
+int undecided(char *data, unsigned long size)
+{
+    static char *preambles[] = { POST_METHOD, BATCH_MAGIC, BATCH_KEEPALIVE };
+
+    /* a newline (or any other byte) that doesn't match settles it */
+    for (unsigned long i = 0; i < sizeof(preambles) / sizeof(*preambles); i++)
+        if (size < strlen(preambles[i]) && memcmp(data, preambles[i], size) == 0)
+            return 1;
+
+    return 0;
+}
+
+/**
+ * Tell HTTP and batch uploads apart from raw pastes by their first bytes, held until there are enough of them.
+ *   paste: the paste in question (nothing has been added to it yet).
+ *   data: the bytes received after those held.
+ *   size: the number of bytes.
+ * -> 1 if the bytes have been used (held, or added to an HTTP or a batch upload),
+ *    0 if it's a raw paste (the bytes held have been added to it, not the others), -1 if an error occured.
+ */
+int identify(Paste *paste, char *data, unsigned long size)
+{
+    unsigned long held = paste->held;
+    unsigned long more = size < PREAMBLE_SIZE - held ? size : PREAMBLE_SIZE - held;
+
+    /* (the data can already be there, see receive_splice) */
+    memmove(paste->preamble + held, data, more);
+
+    if (post_match(paste->preamble, held + more)) {
+        paste->held = 0;
+
+        /* HTTP uploads have to be parsed: they're received like with stream ingest */
+        if (paste->pipe[0] != -1) {
+            close(paste->pipe[0]);
+            close(paste->pipe[1]);
+
+            paste->pipe[0] = -1;
+            paste->pipe[1] = -1;
+        }
+
+        if (post_open(paste) != 0 || post_filter(paste, paste->preamble, held) != 0 || post_filter(paste, data, size) != 0)
+            return -1;
+
+        return 1;
+    }
+
+    int mode;
+    if ((mode = batch_match(paste->preamble, held + more)) != BATCH_NONE) {
+        paste->held = 0;
+
+        if (open_batch(paste, mode) != 0 || batch_filter(paste, paste->preamble, held) != 0 || batch_filter(paste, data, size) != 0)
+            return -1;
+
+        return 1;
+    }
+
+    if (undecided(paste->preamble, held + more)) {
+        paste->held = held + more;
+        return 1;
+    }
+
+    return release(paste) == 0 ? 0 : -1;
+}
+
+/**
+ * Add the bytes held by identify to a paste, once it's known to be a raw paste.
+ *   paste: the paste in question.
+ * -> 0 if done, -1 if not.
+ */
+int release(Paste *paste)
+{
+    unsigned long held = paste->held;
+    paste->held = 0;
+
+    if (held == 0)
+        return 0;
+
+    /* with splice ingest, they're written before the spliced data (see hash_file) */
+    if (paste->file != -1)
+        return append_file(paste, paste->preamble, held);
+
+    return paste_write(paste, paste->preamble, held);
+}
+
+/**
+ * Receive data from a connection into a memory buffer.
+ *   paste: the paste in question.
+ *   connection: the socket associated with the connection.
+ * -> the number of bytes received, 0 on EOF or -1 if an error occured.
+ */
+long receive_memory(Paste *paste, int connection)
+{
+    /* the last byte of the buffer is kept for the trailing newline */
+    /* (and the first ones for the bytes held, if any, see identify) */
+    long          size;
+    unsigned long start = paste->size + paste->held;
+    if ((size = recv(connection, paste->buffer + start, paste->buffer_size - 1 - start, 0)) <= 0)
+        return size;
+
+    /* HTTP and batch uploads are told apart by their first bytes */
+    /* (the body is moved to the start of the buffer, never past the data still to be parsed) */
+    int identified;
+    if (paste->size == 0 && (identified = identify(paste, paste->buffer + start, size)) != 0)
+        return identified == 1 ? size : -1;
+
+    if (settings.dedup)
+        paste->hash = hash_bytes(paste->hash, paste->buffer + paste->size, size);
+
+    paste->size += size;
+
+    /* have we reached the end of the buffer? */
+    /* yup, grow it (geometrically, to avoid copying large pastes over and over) */
+    if (paste->size == paste->buffer_size - 1 && paste->size < settings.max_size && grow_buffer(paste) != 0)
+        return -1;
+
+    return size;
+}
+
+/**
+ * Receive data from a connection and append it to the temporary file right away.
+ *   paste: the paste in question.
+ *   connection: the socket associated with the connection.
+ * -> the number of bytes received, 0 on EOF or -1 if an error occured.
+ */
+long receive_stream(Paste *paste, int connection)
+{
+    long size;
+    if ((size = recv(connection, paste->buffer, paste->buffer_size, 0)) <= 0)
+        return size;
+
+    /* HTTP and batch uploads are told apart by their first bytes */
+    /* (a batch is received in the buffer the data already is in) */
+    int identified;
+    if (paste->size == 0 && (identified = identify(paste, paste->buffer, size)) != 0)
+        return identified == 1 ? size : -1;
+
+    if (append_file(paste, paste->buffer, size) != 0)
+        return -1;
+
+    return size;
+}
+
+/**
+ * Append data to the temporary file of a paste.
+ *   paste: the paste in question.
+ *   data: the data to append.
+ *   size: the size of the data.
+ * -> 0 if done, -1 if not.
+ */
+int append_file(Paste *paste, char *data, unsigned long size)
+{
+    for (long left = size, written; left > 0; left -= written)
+        if ((written = write(paste->file, data + size - left, left)) <= 0)
+            return -1;
+
+    if (settings.dedup)
+        paste->hash = hash_bytes(paste->hash, data, size);
+
+    paste->size += size;
+    return 0;
+}
+
+/**
+ * Move data from a connection to the temporary file, without copying it to userspace.
+ *   paste: the paste in question.
+ *   connection: the socket associated with the connection.
+ * -> the number of bytes received, 0 on EOF or -1 if an error occured.
+ */
+long receive_splice(Paste *paste, int connection)
+{
+#ifdef HAVE_SPLICE
+    long size;
+
+    /* HTTP and batch uploads are told apart by their first bytes, received (not spliced) until it's settled */
+    if (paste->size == 0) {
+        char *data = paste->preamble + paste->held;
+        if ((size = recv(connection, data, PREAMBLE_SIZE - paste->held, 0)) <= 0)
+            return size;
+
+        int identified;
+        if ((identified = identify(paste, data, size)) != 0)
+            return identified == 1 ? size : -1;
+
+        return append_file(paste, data, size) == 0 ? size : -1;
+    }
+
+    if ((size = splice(connection, NULL, paste->pipe[1], NULL, settings.buffer_size, SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0)
+        return size;
+
+    /* empty the pipe into the file */
+    for (long left = size, written; left > 0; left -= written)
+        if ((written = splice(paste->pipe[0], NULL, paste->file, NULL, left, SPLICE_F_MOVE)) <= 0)
+            return -1;
+
+    paste->size += size;
+    return size;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/**
+ * Receive the data available on a connection.
+ * Blocks unless the socket is non-blocking.
+ *   paste: the paste in question.
+ *   connection: the socket associated with the connection.
+ * -> the number of bytes received, 0 on EOF or -1 if an error occured (errno is EFBIG if the paste is too big).
+ */
+long paste_receive(Paste *paste, int connection)
+{
+    long size;
+    if (paste->post != NULL)
+        size = post_receive(paste, connection);
+    else if (paste->batch != NULL)
+        size = batch_receive(paste, connection);
+    else if (paste->file == -1)
+        size = receive_memory(paste, connection);
+    else if (paste->pipe[0] == -1)
+        size = receive_stream(paste, connection);
+    else
+        size = receive_splice(paste, connection);
+
+#ifdef HAVE_TLS
+    /* the alert sent by a TLS client before closing can't be received as data (nor spliced): it ends the paste */
+    if (size < 0 && (errno == EIO || errno == EINVAL) && settings.certificate != NULL && tls_closing(connection))
+        size = 0;
+#endif
+
+    if (size > 0 && post_continue(paste, connection) != 0)
+        return -1;
+
+    /* have we reached max file size? */
+    if (size > 0 && paste->size >= settings.max_size) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    return size;
+}
+
+/**
+ * Append data that has already been received to a paste, for engines that don't read from the socket themselves.
+ *   paste: the paste in question.
+ *   data: the data in question.
+ *   size: the size of the data.
+ * -> 0 if done, -1 if not (errno is EFBIG if the paste is too big, EPROTO if an HTTP upload is rejected).
+ */
+int paste_append(Paste *paste, char *data, unsigned long size)
+{
+    if (paste->post != NULL)
+        return post_filter(paste, data, size);
+
+    if (paste->batch != NULL)
+        return batch_filter(paste, data, size);
+
+    /* HTTP and batch uploads are told apart by their first bytes */
+    int identified;
+    if (paste->size == 0 && (identified = identify(paste, data, size)) != 0)
+        return identified == 1 ? 0 : -1;
+
+    return paste_write(paste, data, size);
+}
+
+/**
+ * Add data to a paste as is.
+ *   paste: the paste in question.
+ *   data: the data in question.
+ *   size: the size of the data.
+ * -> 0 if done, -1 if not (errno is EFBIG if the paste is too big, ENOTSUP with splice ingest).
+ */
+int paste_write(Paste *paste, char *data, unsigned long size)
+{
+    if (paste->size + size >= settings.max_size) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    if (paste->pipe[0] != -1) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (paste->file != -1)
+        return append_file(paste, data, size);
+
+    /* the body of an HTTP upload can be moved within the buffer, which moves as it grows */
+    int           inside = data >= paste->buffer && data < paste->buffer + paste->buffer_size;
+    unsigned long offset = inside ? (unsigned long)(data - paste->buffer) : 0;
+
+    /* the last byte of the buffer is kept for the trailing newline */
+    while (paste->size + size > paste->buffer_size - 1)
+        if (grow_buffer(paste) != 0)
+            return -1;
+
+    if (inside)
+        data = paste->buffer + offset;
+
+    memmove(paste->buffer + paste->size, data, size);
+
+    /* the data could have been overwritten by the move: hash where it's been moved to */
+    if (settings.dedup)
+        paste->hash = hash_bytes(paste->hash, paste->buffer + paste->size, size);
+
+    paste->size += size;
+    return 0;
+}
+
+/**
+ * Hash the content of the temporary file of a paste.
+ *   paste: the paste in question.
+ * -> 0 if done, -1 if not.
+ */
+int hash_file(Paste *paste)
+{
+    char chunk[BUFSIZ];
+
+    /* the bytes written before splicing have been hashed already: start over with the whole file */
+    paste->hash = HASH_INIT;
+
+    long size;
+    for (unsigned long offset = 0; offset < paste->size; offset += size) {
+        if ((size = pread(paste->file, chunk, sizeof(chunk), offset)) <= 0)
+            return -1;
+
+        paste->hash = hash_bytes(paste->hash, chunk, size);
+    }
+
+    return 0;
+}
+
+/**
+ * Finish receiving a paste, by ending it with a newline if there's none.
+ *   paste: the paste in question.
+ * -> 0 if done, -1 if not (errno is ENOENT if the paste is empty, EPROTO if an HTTP upload is incomplete).
+ */
+int paste_finish(Paste *paste)
+{
+    /* HTTP uploads end with their body, not with the connection */
+    if (paste->post != NULL && post_finish(paste) != 0)
+        return -1;
+
+    /* so do batch uploads, each of their pastes already ends with a newline */
+    if (paste->batch != NULL) {
+        if (batch_finish(paste) != 0)
+            return -1;
+
+        paste->received = admission_now();
+        return 0;
+    }
+
+    /* the connection could have ended before telling what kind of upload it is: it's a raw paste */
+    if (release(paste) != 0)
+        return -1;
+
+    /* is the paste empty? */
+    if (paste->size == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (paste->file == -1) {
+        if (paste->buffer[paste->size - 1] != '\n') {
+            paste->buffer[paste->size++] = '\n';
+
+            if (settings.dedup)
+                paste->hash = hash_bytes(paste->hash, "\n", 1);
+        }
+
+        paste->received = admission_now();
+        return 0;
+    }
+
+    /* spliced data has never been seen: hash it now (costs a read, but only with deduplication) */
+    if (settings.dedup && paste->pipe[0] != -1 && hash_file(paste) != 0)
+        return -1;
+
+    /* the last byte isn't in memory anymore, read it back from the file */
+    char last;
+    if (pread(paste->file, &last, 1, paste->size - 1) != 1)
+        return -1;
+
+    if (last != '\n') {
+        if (pwrite(paste->file, "\n", 1, paste->size) != 1)
+            return -1;
+
+        paste->size++;
+
+        if (settings.dedup)
+            paste->hash = hash_bytes(paste->hash, "\n", 1);
+    }
+
+    paste->received = admission_now();
+    return 0;
+}
+
+/**
+ * Free everything associated with a paste, and remove its temporary file if any.
+ *   paste: the paste in question.
+ */
+void paste_close(Paste *paste)
+{
+    /* give the buffer back to the worker's pool, for the next connection */
+    pool_put(paste->buffer, paste->buffer_size, paste->file == -1 ? paste->size : 0);
+    paste->buffer = NULL;
+
+    /* ... and its memory back to the budget */
+    admission_release(paste->reserved);
+    admission_delay(paste->received);
+
+    paste->reserved = 0;
+    paste->received = 0;
+
+    if (paste->file != -1)
+        close(paste->file);
+
+    if (paste->pipe[0] != -1)
+        close(paste->pipe[0]);
+
+    if (paste->pipe[1] != -1)
+        close(paste->pipe[1]);
+
+    if (paste->output != -1)
+        close(paste->output);
+
+    if (paste->temporary[0] != 0)
+        unlink(paste->temporary);
+
+    free(paste->id);
+    free(paste->post);
+    free(paste->batch);
+
+    paste->file         = -1;
+    paste->pipe[0]      = -1;
+    paste->pipe[1]      = -1;
+    paste->output       = -1;
+    paste->id           = NULL;
+    paste->post         = NULL;
+    paste->batch        = NULL;
+    paste->temporary[0] = 0;
+}
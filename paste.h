@@ -0,0 +1,65 @@
+/*
+ * paste.h
+ *  paste.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+/* splice is only available on Linux */
+#if defined __linux__ && !defined COSMOPOLITAN
+#define HAVE_SPLICE
+#endif
+
+/* first bytes needed to tell a raw paste from an HTTP or a batch upload (the longest preamble, FEUILLE-KEEPALIVE/1) */
+#define PREAMBLE_SIZE 20
+
+/* an incoming paste */
+typedef struct Paste {
+    /* memory ingest (or chunk buffer for stream ingest) */
+    char                *buffer;
+    unsigned long        buffer_size; /* capacity of the buffer */
+
+    /* file ingest (the paste is written to a temporary file) */
+    int                  file;
+    int                  pipe[2];
+    char                 temporary[16];
+
+    unsigned long        size;
+    unsigned long long   hash;        /* only computed with deduplication */
+
+    /* first bytes, held until there are enough of them to tell what kind of upload it is */
+    char                 preamble[PREAMBLE_SIZE];
+    unsigned char        held;
+
+    /* admission control */
+    unsigned long        reserved;    /* bytes counted against the memory budget */
+    long long            received;    /* see admission_now, 0 until it's received */
+
+    /* deferred write (the buffer is written to the paste file by the engine) */
+    char                 deferred;
+    int                  output;
+    char                *id;
+
+    /* HTTP upload (NULL for raw pastes) */
+    struct Post         *post;
+
+    /* batch upload (NULL for single pastes) */
+    struct Batch        *batch;
+} Paste;
+
+int      paste_open(Paste *);
+long     paste_receive(Paste *, int);
+int      paste_append(Paste *, char *, unsigned long);
+int      paste_write(Paste *, char *, unsigned long);
+int      paste_finish(Paste *);
+void     paste_close(Paste *);
@@ -0,0 +1,242 @@
+/*
+ * pool.c
+ *  Per-worker pool of receive buffers.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "pool.h"
+
+#ifndef COSMOPOLITAN
+#include <stdlib.h>    /* for free, malloc, realloc                       */
+#include <string.h>    /* for memcpy                                      */
+#include <sys/mman.h>  /* for madvise, mmap, munmap, MADV_HUGEPAGE        */
+#endif
+
+#include "feuille.h"   /* for Settings, settings                          */
+
+/* maximum number of idle buffers kept by a worker */
+#define POOL_SIZE        16
+
+/* smallest buffer ever handed out */
+#define POOL_MIN_SIZE    4096
+
+/* number of pastes to observe before adapting the initial buffer size */
+#define POOL_SAMPLES     64
+
+/* percentage of pastes that should fit in the initial buffer */
+#define POOL_PERCENTILE  90
+
+/* buffers this large are backed by huge pages, if enabled */
+#define HUGE_PAGE_SIZE   (2UL * 1024 * 1024)
+
+/* an idle buffer */
+typedef struct Buffer {
+    char            *data;
+    unsigned long    capacity;
+} Buffer;
+
+static Buffer           pool[POOL_SIZE];
+static int              pool_count = 0;
+
+/* number of pastes per power of two of their size */
+static unsigned long    histogram[sizeof(unsigned long) * 8];
+static unsigned long    samples = 0;
+
+/* functions declarations */
+static  int      is_huge(unsigned long);
+static  char    *allocate(unsigned long);
+static  void     release(char *, unsigned long);
+
+/**
+ * Check if a buffer is (or should be) backed by huge pages.
+ *   capacity: the capacity of the buffer.
+ * -> 1 if it is, 0 if not.
+ */
+int is_huge(unsigned long capacity)
+{
+#ifdef MADV_HUGEPAGE
+    return settings.huge_pages && capacity >= HUGE_PAGE_SIZE;
+#else
+    (void)capacity;
+    return 0;
+#endif
+}
+
+/**
+ * Allocate a new buffer.
+ *   capacity: the capacity of the buffer.
+ * -> a pointer to the buffer, or NULL if an error occured.
+ */
+char *allocate(unsigned long capacity)
+{
+#ifdef MADV_HUGEPAGE
+    if (is_huge(capacity)) {
+        char *buffer;
+        if ((buffer = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+            return NULL;
+
+        /* only a hint, the kernel may or may not use huge pages */
+        madvise(buffer, capacity, MADV_HUGEPAGE);
+        return buffer;
+    }
+#endif
+
+    return malloc(capacity * sizeof(char));
+}
+
+/**
+ * Free a buffer.
+ *   buffer: the buffer in question.
+ *   capacity: the capacity of the buffer.
+ */
+void release(char *buffer, unsigned long capacity)
+{
+    if (is_huge(capacity))
+        munmap(buffer, capacity);
+    else
+        free(buffer);
+}
+
+/**
+ * Get the size a receive buffer should start with, depending on the size of the previous pastes.
+ * -> the size in question.
+ */
+unsigned long pool_initial_size(void)
+{
+    /* not enough pastes observed yet */
+    if (samples < POOL_SAMPLES)
+        return settings.buffer_size + 1;
+
+    /* find the smallest power of two that fits most of the pastes */
+    unsigned long total = 0;
+    unsigned int  bucket;
+    for (bucket = 0; bucket < sizeof(histogram) / sizeof(*histogram) - 1; bucket++) {
+        total += histogram[bucket];
+
+        if (total * 100 >= samples * POOL_PERCENTILE)
+            break;
+    }
+
+    unsigned long size = 1UL << bucket;
+
+    if (size < POOL_MIN_SIZE)
+        size = POOL_MIN_SIZE;
+
+    if (size > settings.max_size + 1)
+        size = settings.max_size + 1;
+
+    return size;
+}
+
+/**
+ * Get a buffer from the pool, or allocate a new one if none is large enough.
+ *   size: the minimum capacity of the buffer.
+ *   capacity: set to the actual capacity of the buffer.
+ * -> a pointer to the buffer, or NULL if an error occured.
+ */
+char *pool_get(unsigned long size, unsigned long *capacity)
+{
+    /* find the smallest idle buffer that's large enough */
+    int best = -1;
+    for (int i = 0; i < pool_count; i++)
+        if (pool[i].capacity >= size && (best == -1 || pool[i].capacity < pool[best].capacity))
+            best = i;
+
+    if (best != -1) {
+        char *buffer = pool[best].data;
+        *capacity    = pool[best].capacity;
+
+        pool[best] = pool[--pool_count];
+        return buffer;
+    }
+
+    char *buffer;
+    if ((buffer = allocate(size)) == NULL)
+        return NULL;
+
+    *capacity = size;
+    return buffer;
+}
+
+/**
+ * Grow a buffer geometrically.
+ *   buffer: the buffer in question.
+ *   capacity: the capacity of the buffer. Updated on success.
+ *   limit: the maximum capacity of the buffer.
+ * -> a pointer to the new buffer, or NULL if an error occured (the old one is still valid).
+ */
+char *pool_grow(char *buffer, unsigned long *capacity, unsigned long limit)
+{
+    unsigned long new_capacity = *capacity * 2;
+
+    if (new_capacity > limit)
+        new_capacity = limit;
+
+    char *tmp;
+    if (!is_huge(*capacity) && !is_huge(new_capacity)) {
+        if ((tmp = realloc(buffer, new_capacity * sizeof(char))) == NULL)
+            return NULL;
+    } else {
+        if ((tmp = allocate(new_capacity)) == NULL)
+            return NULL;
+
+        memcpy(tmp, buffer, *capacity);
+        release(buffer, *capacity);
+    }
+
+    *capacity = new_capacity;
+    return tmp;
+}
+
+/**
+ * Give a buffer back to the pool.
+ *   buffer: the buffer in question.
+ *   capacity: the capacity of the buffer.
+ *   used: the size of the paste it contained, or 0 if it shouldn't be taken into account.
+ */
+void pool_put(char *buffer, unsigned long capacity, unsigned long used)
+{
+    if (buffer == NULL)
+        return;
+
+    /* remember the size of the paste */
+    if (used > 0) {
+        unsigned int bucket = 0;
+        while ((1UL << bucket) < used + 1)
+            bucket++;
+
+        histogram[bucket]++;
+        samples++;
+
+        /* let old pastes fade out, to follow changes in the distribution */
+        if (samples >= POOL_SAMPLES * 16) {
+            samples = 0;
+
+            for (unsigned int i = 0; i < sizeof(histogram) / sizeof(*histogram); i++) {
+                histogram[i] /= 2;
+                samples     += histogram[i];
+            }
+        }
+    }
+
+    /* don't keep outliers around, nor more buffers than needed */
+    unsigned long usual = pool_initial_size() > settings.buffer_size ? pool_initial_size() : settings.buffer_size;
+
+    if (pool_count == POOL_SIZE || capacity > 4 * usual) {
+        release(buffer, capacity);
+        return;
+    }
+
+    pool[pool_count].data     = buffer;
+    pool[pool_count].capacity = capacity;
+    pool_count++;
+}
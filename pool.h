@@ -0,0 +1,22 @@
+/*
+ * pool.h
+ *  pool.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+unsigned long    pool_initial_size(void);
+
+char    *pool_get(unsigned long, unsigned long *);
+char    *pool_grow(char *, unsigned long *, unsigned long);
+void     pool_put(char *, unsigned long, unsigned long);
@@ -0,0 +1,442 @@
+/*
+ * post.c
+ *  HTTP uploads, received on the paste socket (from HTML forms or HTTP clients).
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "post.h"
+
+#ifndef COSMOPOLITAN
+#include <errno.h>       /* for errno, EAGAIN, EFBIG, ENOENT, EPROTO       */
+#include <stdio.h>       /* for snprintf, BUFSIZ, NULL                     */
+#include <stdlib.h>      /* for calloc, malloc, strtoul                    */
+#include <string.h>      /* for memcmp, strchr, strcmp, strdup, strlen...  */
+#include <strings.h>     /* for strcasecmp, strncasecmp                    */
+#include <sys/socket.h>  /* for recv, send, MSG_NOSIGNAL                   */
+#endif
+
+#include "admission.h"   /* for ADMISSION_ERROR, ADMISSION_RETRY           */
+#include "feuille.h"     /* for Settings, settings                         */
+#include "paste.h"       /* for Paste, paste_write                         */
+#include "server.h"      /* for read_error_response                        */
+
+/* what the body of a form starts with (see cgi/form.html) */
+#define FORM_PREFIX         "paste="
+#define FORM_PREFIX_LENGTH  (sizeof(FORM_PREFIX) - 1)
+
+/* functions declarations */
+static  int      post_error(Post *, char *);
+static  int      parse_headers(Post *);
+static  int      hex_digit(char);
+static  int      decode_form(Paste *, char *, unsigned long);
+
+/**
+ * Check whether the first bytes received on a connection are those of an HTTP upload.
+ *   data: the bytes in question.
+ *   size: the number of bytes.
+ * -> 1 if they are, 0 if not.
+ */
+int post_match(char *data, unsigned long size)
+{
+    return size >= sizeof(POST_METHOD) - 1 && memcmp(data, POST_METHOD, sizeof(POST_METHOD) - 1) == 0;
+}
+
+/**
+ * Start handling a paste as an HTTP upload.
+ *   paste: the paste in question.
+ * -> 0 if done, -1 if not.
+ */
+int post_open(Paste *paste)
+{
+    if ((paste->post = calloc(1, sizeof(Post))) == NULL)
+        return -1;
+
+    paste->post->state = POST_HEADERS;
+    return 0;
+}
+
+/**
+ * Reject an HTTP upload.
+ *   post: the upload in question.
+ *   status: the status code and reason sent to the client.
+ * -> -1, with errno set to EPROTO.
+ */
+int post_error(Post *post, char *status)
+{
+    post->status = status;
+
+    errno = EPROTO;
+    return -1;
+}
+
+/**
+ * Parse the request line and headers of an HTTP upload, once they have been received.
+ *   post: the upload in question.
+ * -> 0 if the body can be received, -1 if not (errno is EPROTO, or EFBIG if the paste is too big).
+ */
+int parse_headers(Post *post)
+{
+    char *request = post->header;
+
+    /* cut the empty line, then the request line */
+    request[post->header_size - 4] = 0;
+
+    char *headers = strchr(request, '\r');
+    if (headers != NULL) {
+        *headers = 0;
+        headers += 2;
+    }
+
+    /* the target doesn't matter: every upload is a new paste */
+    char *version;
+    if ((version = strrchr(request, ' ')) == NULL || version < request + sizeof(POST_METHOD) - 1)
+        return post_error(post, "400 Bad Request");
+
+    if (strcmp(version + 1, "HTTP/1.1") != 0 && strcmp(version + 1, "HTTP/1.0") != 0)
+        return post_error(post, "505 HTTP Version Not Supported");
+
+    int           has_length = 0;
+    unsigned long length     = 0;
+
+    char *next;
+    for (char *header = headers; header != NULL && *header != 0; header = next) {
+        if ((next = strchr(header, '\r')) != NULL) {
+            *next = 0;
+            next += 2;
+        }
+
+        char *value;
+        if ((value = strchr(header, ':')) == NULL)
+            return post_error(post, "400 Bad Request");
+
+        *value++ = 0;
+        value   += strspn(value, " \t");
+
+        if (strcasecmp(header, "Content-Length") == 0) {
+            char *end;
+            length     = strtoul(value, &end, 10);
+            has_length = 1;
+
+            if (end == value || *end != 0)
+                return post_error(post, "400 Bad Request");
+        }
+
+        /* the body has to be cut in chunks: not worth it for pastes */
+        if (strcasecmp(header, "Transfer-Encoding") == 0)
+            return post_error(post, "411 Length Required");
+
+        if (strcasecmp(header, "Content-Type") == 0) {
+            if (strncasecmp(value, "multipart/", 10) == 0)
+                return post_error(post, "415 Unsupported Media Type");
+
+            post->urlencoded = strncasecmp(value, "application/x-www-form-urlencoded", 33) == 0;
+        }
+
+        if (strcasecmp(header, "Expect") == 0 && strcasecmp(value, "100-continue") == 0)
+            post->expect = 1;
+    }
+
+    if (!has_length)
+        return post_error(post, "411 Length Required");
+
+    /* no need to receive what won't be stored */
+    if (length >= settings.max_size) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    post->remaining = length;
+    post->state     = length == 0 ? POST_DONE : POST_PREFIX;
+
+    return 0;
+}
+
+/**
+ * Get the value of a hexadecimal digit.
+ *   c: the digit in question.
+ * -> its value, or -1 if it isn't one.
+ */
+int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+
+    return -1;
+}
+
+/**
+ * Decode a part of the body of a form, and add its field to the paste.
+ *   paste: the paste in question.
+ *   data: the part of the body.
+ *   size: the size of the part.
+ * -> 0 if done, -1 if not.
+ */
+int decode_form(Paste *paste, char *data, unsigned long size)
+{
+    Post *post = paste->post;
+
+    char          decoded[BUFSIZ];
+    unsigned long length = 0;
+
+    for (unsigned long i = 0; i < size; i++) {
+        char c = data[i];
+
+        if (post->urlencoded) {
+            /* the field ends with the next one */
+            if (post->skipping || c == '&') {
+                post->skipping = 1;
+                continue;
+            }
+
+            if (post->escape != 0) {
+                int digit;
+                if ((digit = hex_digit(c)) == -1)
+                    return post_error(post, "400 Bad Request");
+
+                post->escaped = post->escaped << 4 | digit;
+                if (--post->escape > 1)
+                    continue;
+
+                post->escape = 0;
+                c            = post->escaped;
+            } else if (c == '%') {
+                post->escape  = 3;
+                post->escaped = 0;
+                continue;
+            } else if (c == '+') {
+                c = ' ';
+            }
+        }
+
+        /* browsers send textareas with CRLF line endings */
+        if (c == '\r')
+            continue;
+
+        decoded[length++] = c;
+
+        if (length == sizeof(decoded)) {
+            if (paste_write(paste, decoded, length) != 0)
+                return -1;
+
+            length = 0;
+        }
+    }
+
+    return length == 0 ? 0 : paste_write(paste, decoded, length);
+}
+
+/**
+ * Add data received from an HTTP client to its paste: headers are parsed, and only the paste itself is kept.
+ *   paste: the paste in question.
+ *   data: the data in question.
+ *   size: the size of the data.
+ * -> 0 if done, -1 if not (errno is EPROTO if the request is rejected, EFBIG if the paste is too big).
+ */
+int post_filter(Paste *paste, char *data, unsigned long size)
+{
+    Post          *post = paste->post;
+    unsigned long  i    = 0;
+
+    /* the headers are gathered until the empty line, whatever the chunks */
+    while (post->state == POST_HEADERS && i < size) {
+        if (post->header_size == sizeof(post->header) - 1)
+            return post_error(post, "431 Request Header Fields Too Large");
+
+        post->header[post->header_size++] = data[i++];
+
+        if (post->header_size >= 4 && memcmp(post->header + post->header_size - 4, "\r\n\r\n", 4) == 0
+         && parse_headers(post) != 0)
+            return -1;
+    }
+
+    /* anything after the body is ignored */
+    if (post->state == POST_HEADERS || post->state == POST_DONE)
+        return 0;
+
+    unsigned long end = size - i < post->remaining ? size : i + post->remaining;
+    post->remaining  -= end - i;
+
+    /* forms are told apart by their field name, held back until it's known */
+    for (; i < end && post->state == POST_PREFIX; i++) {
+        if (data[i] == FORM_PREFIX[post->matched]) {
+            if (++post->matched == FORM_PREFIX_LENGTH) {
+                post->state = POST_FORM;
+                post->form  = 1;
+            }
+
+            continue;
+        }
+
+        post->state = POST_RAW;
+
+        if (paste_write(paste, FORM_PREFIX, post->matched) != 0)
+            return -1;
+
+        break;
+    }
+
+    if (i < end && post->state == POST_RAW && paste_write(paste, data + i, end - i) != 0)
+        return -1;
+
+    if (i < end && post->state == POST_FORM && decode_form(paste, data + i, end - i) != 0)
+        return -1;
+
+    if (post->remaining == 0) {
+        /* a body shorter than the field name */
+        if (post->state == POST_PREFIX && paste_write(paste, FORM_PREFIX, post->matched) != 0)
+            return -1;
+
+        post->state = POST_DONE;
+    }
+
+    return 0;
+}
+
+/**
+ * Receive the data available for an HTTP upload.
+ *   paste: the paste in question.
+ *   connection: the socket associated with the connection.
+ * -> the number of bytes received, 0 once the whole body has been received, or -1 if an error occured.
+ */
+long post_receive(Paste *paste, int connection)
+{
+    /* the request is over, there's no EOF to wait for */
+    if (paste->post->state == POST_DONE)
+        return 0;
+
+    long size;
+    if ((size = recv(connection, paste->post->chunk, sizeof(paste->post->chunk), 0)) <= 0)
+        return size;
+
+    if (post_filter(paste, paste->post->chunk, size) != 0)
+        return -1;
+
+    return size;
+}
+
+/**
+ * Tell the client to send the body of its upload, if it waits for it.
+ *   paste: the paste in question.
+ *   connection: the socket associated with the connection.
+ * -> 0 if done, -1 if not.
+ */
+int post_continue(Paste *paste, int connection)
+{
+    static char response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+    Post *post = paste->post;
+    if (post == NULL || !post->expect || post->state == POST_HEADERS)
+        return 0;
+
+    post->expect = 0;
+
+    /* the body has already been sent anyway */
+    if (post->state == POST_DONE)
+        return 0;
+
+    return send(connection, response, sizeof(response) - 1, MSG_NOSIGNAL) == sizeof(response) - 1 ? 0 : -1;
+}
+
+/**
+ * Check whether a paste is an HTTP upload whose body has been received.
+ *   paste: the paste in question.
+ * -> 1 if it is, 0 if not.
+ */
+int post_done(Paste *paste)
+{
+    return paste->post != NULL && paste->post->state == POST_DONE;
+}
+
+/**
+ * Check that an HTTP upload is complete, once the connection is over.
+ *   paste: the paste in question.
+ * -> 0 if it is, -1 if not (errno is EPROTO).
+ */
+int post_finish(Paste *paste)
+{
+    if (paste->post->state == POST_DONE)
+        return 0;
+
+    return post_error(paste->post, "400 Bad Request");
+}
+
+/**
+ * Prepare the response to a paste: as is, or as an HTTP response for HTTP uploads.
+ *   paste: the paste in question.
+ *   response: the response of feuille (URL or error).
+ * -> the response to be sent, or NULL if an error occured. Needs to be freed.
+ */
+char *post_response(Paste *paste, char *response)
+{
+    if (response == NULL)
+        return NULL;
+
+    if (paste->post == NULL)
+        return strdup(response);
+
+    char *status   = paste->post->status;
+    char *body     = response;
+    int   location = 0;
+    char *retry    = "";
+
+    char reason[64];
+
+    if (status != NULL) {
+        /* the reason is a good enough body */
+        snprintf(reason, sizeof(reason), "%s\n", strchr(status, ' ') + 1);
+        body = reason;
+    } else if (strncmp(response, settings.url, strlen(settings.url)) == 0) {
+        /* forms come from browsers: send them to their paste */
+        status   = paste->post->form ? "303 See Other" : "200 OK";
+        location = paste->post->form ? strcspn(response, "\n") : 0;
+    } else if (strcmp(response, read_error_response(EFBIG)) == 0) {
+        status = "413 Content Too Large";
+    } else if (strcmp(response, read_error_response(ENOENT)) == 0) {
+        status = "400 Bad Request";
+    } else if (strcmp(response, read_error_response(EAGAIN)) == 0) {
+        status = "408 Request Timeout";
+    } else if (strcmp(response, ADMISSION_ERROR) == 0) {
+        /* load shedding, not a failure: clients and proxies may come back */
+        status = "503 Service Unavailable";
+        retry  = "Retry-After: " ADMISSION_RETRY "\r\n";
+    } else {
+        status = "500 Internal Server Error";
+    }
+
+    char *format = "HTTP/1.1 %s\r\n"
+                   "Content-Type: text/plain; charset=utf-8\r\n"
+                   "Content-Length: %lu\r\n"
+                   "X-Content-Type-Options: nosniff\r\n"
+                   "%s%.*s%s"
+                   "%s"
+                   "Connection: close\r\n"
+                   "\r\n"
+                   "%s";
+
+    char *prefix = location != 0 ? "Location: " : "";
+    char *suffix = location != 0 ? "\r\n" : "";
+
+    int length = snprintf(NULL, 0, format, status, strlen(body), prefix, location, body, suffix, retry, body);
+
+    char *http;
+    if (length < 0 || (http = malloc(length + 1)) == NULL)
+        return NULL;
+
+    snprintf(http, length + 1, format, status, strlen(body), prefix, location, body, suffix, retry, body);
+    return http;
+}
@@ -0,0 +1,67 @@
+/*
+ * post.h
+ *  post.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+#include "paste.h"
+
+/* what an HTTP upload starts with */
+#define POST_METHOD         "POST /"
+
+/* size of the request line and headers of an HTTP upload */
+#define POST_HEADER_SIZE    8192
+
+/* size of the chunks received once an HTTP upload has been recognized */
+#define POST_CHUNK_SIZE     16384
+
+/* where an HTTP upload is at */
+enum PostState {
+    POST_HEADERS,   /* reading the request line and headers      */
+    POST_PREFIX,    /* reading the start of the body: form or not */
+    POST_RAW,       /* reading a raw body, stored as is           */
+    POST_FORM,      /* reading a form, only its field is stored   */
+    POST_DONE       /* the whole body has been received           */
+};
+
+/* an HTTP upload, received on the paste socket */
+typedef struct Post {
+    char             state;
+    char             form;        /* the body is the `paste' field of a form        */
+    char             urlencoded;  /* ... and that form is URL-encoded               */
+    char             skipping;    /* ... and its field is over (other fields follow) */
+    char             expect;      /* the client waits for a `100 Continue'          */
+
+    /* URL-encoded escape sequence being decoded (%XX) */
+    char             escape;      /* hex digits left + 1, 0 outside of a sequence    */
+    unsigned char    escaped;
+
+    unsigned long    matched;     /* bytes of the form prefix seen so far           */
+    unsigned long    remaining;   /* bytes of the body left to receive              */
+
+    char            *status;      /* protocol error, NULL if there's none           */
+
+    char             header[POST_HEADER_SIZE];
+    unsigned long    header_size;
+
+    char             chunk[POST_CHUNK_SIZE];
+} Post;
+
+int      post_match(char *, unsigned long);
+int      post_open(Paste *);
+int      post_filter(Paste *, char *, unsigned long);
+long     post_receive(Paste *, int);
+int      post_continue(Paste *, int);
+int      post_done(Paste *);
+int      post_finish(Paste *);
+char    *post_response(Paste *, char *);
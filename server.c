@@ -11,14 +11,16 @@
  * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
  */
 
+#define _DEFAULT_SOURCE
+
 #include "server.h"
 
 #ifndef COSMOPOLITAN
 #include <arpa/inet.h>   /* for inet_pton                                      */
-#include <errno.h>       /* for errno, EAGAIN, EFBIG, ENOENT                   */
+#include <errno.h>       /* for errno, EAGAIN, EFBIG, ENOBUFS, ENOENT, EPROTO  */
 #include <netinet/in.h>  /* for htons, sockaddr_in, sockaddr_in6, IPPROTO_IPV6 */
 #include <stdio.h>       /* for NULL                                           */
-#include <stdlib.h>      /* for free, malloc, realloc                          */
+#include <stdlib.h>      /* for free                                           */
 #include <string.h>      /* for strcmp, strlen                                 */
 #include <strings.h>     /* for bzero                                          */
 #include <syslog.h>      /* for syslog, LOG_WARNING                            */
@@ -27,13 +29,38 @@
 #include <unistd.h>      /* for close                                          */
 #endif
 
+#include "admission.h"   /* for ADMISSION_ERROR                                */
+#include "batch.h"       /* for batch_idle                                     */
 #include "feuille.h"     /* for Settings, settings                             */
+#include "paste.h"       /* for Paste, paste_receive, paste_finish             */
+#include "post.h"        /* for post_response                                  */
+#include "tls.h"         /* for tls_notify, HAVE_TLS                           */
 #include "util.h"        /* for verbose                                        */
+/**
+ * Allow multiple sockets to be bound to the same address and port.
+ * Incoming connections are then balanced between them by the kernel.
+ *   server: the server socket.
+ * -> 0 if done, -1 if not.
+ */
+int set_reuse_port(int server)
+{
+    verbose(3, "  SO_REUSEPORT...");
+
+#ifdef SO_REUSEPORT
+    return setsockopt(server, SOL_SOCKET, SO_REUSEPORT, &(int){ 1 }, sizeof(int));
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
 /**
  * Initialize the server socket.
+ *   address: the address to listen on (`*' for every IPv4 and IPv6 address).
+ *   port: the port to listen on.
  * -> the actual socket.
  */
-int initialize_server()
+int initialize_server(char *address, unsigned short port)
 {
     int server;
 
@@ -47,20 +74,20 @@ int initialize_server()
     struct sockaddr_in6 server_address_v6;
     bzero(&server_address_v6, sizeof(server_address_v6));
 
-    if (strcmp(settings.address, "*") == 0) {
-        settings.address = "::";
+    if (strcmp(address, "*") == 0) {
+        address          = "::";
         ipv6_only        = 0;
     }
 
     /* dirty hack to detect and convert IPv4 / IPv6 addresses */
     verbose(3, "detecting address family...");
 
-    if (inet_pton(AF_INET, settings.address, &server_address_v4.sin_addr) == 1) {
+    if (inet_pton(AF_INET, address, &server_address_v4.sin_addr) == 1) {
         verbose(3, "IPv4 address detected.");
 
         /* set socket family and port */
         server_address_v4.sin_family = AF_INET;
-        server_address_v4.sin_port   = htons(settings.port);
+        server_address_v4.sin_port   = htons(port);
 
         /* create socket */
         verbose(3, "creating server socket...");
@@ -77,18 +104,22 @@ int initialize_server()
         if (setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int)) < 0)
             return -1;
 
+        /* let the workers share the port */
+        if (settings.reuse_port && set_reuse_port(server) < 0)
+            return -1;
+
         /* bind address and port */
         verbose(3, "binding address on the socket...");
 
         if (bind(server, (struct sockaddr *)&server_address_v4, sizeof(server_address_v4)) < 0)
             return -1;
 
-    } else if (inet_pton(AF_INET6, settings.address, &server_address_v6.sin6_addr) == 1) {
+    } else if (inet_pton(AF_INET6, address, &server_address_v6.sin6_addr) == 1) {
         verbose(3, "IPv6 address detected.");
 
         /* set socket family and port */
         server_address_v6.sin6_family = AF_INET6;
-        server_address_v6.sin6_port   = htons(settings.port);
+        server_address_v6.sin6_port   = htons(port);
 
         /* create socket */
         verbose(3, "creating server socket...");
@@ -105,6 +136,10 @@ int initialize_server()
         if (setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int)) < 0)
             return -1;
 
+        /* let the workers share the port */
+        if (settings.reuse_port && set_reuse_port(server) < 0)
+            return -1;
+
         /* Enable dual-stack mode on supported platforms */
         verbose(3, "  IPV6_V6ONLY...");
 
@@ -125,7 +160,7 @@ int initialize_server()
 
     /* start listening to incoming connections */
     verbose(3, "starting to listen on the socket...");
-    if (listen(server, 1) < 0)
+    if (listen(server, settings.backlog) < 0)
         return -1;
 
     return server;
@@ -134,18 +169,18 @@ int initialize_server()
 /**
  * Accept incoming connections.
  *   socket: the server socket.
+ *   address: where to store the address of the client (big enough for IPv6 ones).
  * -> the socket associated with the connection.
  */
-int accept_connection(int socket)
+int accept_connection(int socket, struct sockaddr_storage *address)
 {
-    /* only needed for cosmopolitan libc */
-    /* we don't do anything with this struct yet */
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
+    socklen_t addrlen = sizeof(*address);
 
     /* accept the connection */
-    /* TODO: maybe retrieve IP address for logging? *maybe* */
-    int connection = accept(socket, (struct sockaddr*)&address, (socklen_t*)&addrlen);
+    int connection = accept(socket, (struct sockaddr *)address, &addrlen);
+
+    if (connection == -1)
+        return -1;
 
     /* set the timeout for the connection */
     struct timeval timeout = { settings.timeout, 0 };
@@ -165,6 +200,12 @@ int accept_connection(int socket)
  */
 void close_connection(int connection)
 {
+#ifdef HAVE_TLS
+    /* TLS clients are told that it's on purpose */
+    if (settings.certificate != NULL)
+        tls_notify(connection);
+#endif
+
     /* prevent reading from / writing to the socket */
     shutdown(connection, SHUT_RDWR);
 
@@ -175,76 +216,80 @@ void close_connection(int connection)
 /**
  * Read the incoming data from a connection.
  *   connection: the socket associated with the connection.
- * -> the string containing all data sent, or NULL if an error occured. Needs to be freed.
+ *   paste: the paste to store the data in. Needs to be opened with paste_open.
+ * -> the size of the paste, or 0 if an error occured.
  */
-unsigned long read_paste(int connection, char **output)
+unsigned long read_paste(int connection, Paste *paste)
 {
-
-    unsigned long buffer_size = settings.buffer_size;
-    unsigned long total_size  = 0;
-
-    /* allocate buffer to store the data */
-    char *buffer;
-    if ((buffer = malloc((buffer_size + 1) * sizeof(char))) == NULL)
-        return 0;
-
     /* read all data until EOF is received, or max file size is reached, or the socket timeouts... */
-    /* each time, the data is appended to the buffer, once it's been reallocated a larger size */
     errno = 0;
     long size;
-    while ((size = recv(connection, buffer + total_size, buffer_size - total_size, 0)) > 0) {
-        total_size += size;
-
-        /* have we reached max file size? */
-        if (total_size >= settings.max_size) {
-            /* yup, free the buffer and return an error */
-            free(buffer);
-            errno = EFBIG;
-            return 0;
-        }
 
-        /* have we reached the end of the buffer? */
-        if (total_size == buffer_size) {
-            /* yup, increase the buffer size */
-            buffer_size += settings.buffer_size;
+    /* persistent connections wait longer between two pastes (the timeout of the socket is checked against the idle timeout) */
+    do
+        while ((size = paste_receive(paste, connection)) > 0);
+    while (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && batch_idle(paste));
 
-            /* reallocate the buffer with a larger size */
-            void *tmp;
-            if ((tmp = realloc(buffer, (buffer_size + 1) * sizeof(char))) == NULL) {
-                free(buffer);
-                return 0;
-            }
+    /* have we reached max file size? has the HTTP upload been rejected? or the memory budget? */
+    /* only a timeout ends a paste like EOF does: any other error (e.g. out of memory, reset) leaves it truncated */
+    if (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return 0;
 
-            buffer = tmp;
-        }
-    }
+    /* is the paste empty? */
+    int timed_out = size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
 
-    /* is the buffer empty? */
-    if (total_size == 0) {
-        /* yup, free the buffer and return an error */
-        if (errno != EAGAIN)
-            errno  = ENOENT;
+    if (paste_finish(paste) != 0) {
+        if (errno == ENOENT && timed_out)
+            errno = EAGAIN;
 
-        free(buffer);
         return 0;
     }
 
-    /* end the buffer with a newline if there's none */
-    if (buffer[total_size - 1] != '\n') {
-        buffer[total_size]      = '\n';
-        total_size++; /* add newline to total size */
-    }
-
-    *output = buffer;
-    return total_size;
+    return paste->size;
 }
 
 /**
- * Send a response to the client.
+ * Send a response to the client (as an HTTP response for HTTP uploads).
  *   connection: the socket associated with the connection.
+ *   paste: the paste the response is about.
  *   data: the string to be sent.
  * -> -1 on error, number of bytes sent on success.
  */
-int send_response(int connection, char *data) {
-    return send(connection, data, strlen(data), 0);
+int send_response(int connection, Paste *paste, char *data) {
+    char *response;
+    if ((response = post_response(paste, data)) == NULL)
+        return -1;
+
+    int size = send(connection, response, strlen(response), 0);
+
+    free(response);
+    return size;
+}
+
+/**
+ * Get the response matching an error that occured while reading a paste.
+ *   error: the value of errno set by read_paste.
+ * -> the string to be sent to the client, or NULL if there's none.
+ */
+char *read_error_response(int error)
+{
+    switch (error) {
+    case EFBIG:
+        return "Paste too big.\n";
+
+    case ENOENT:
+        return "Empty paste.\n";
+
+    case EAGAIN:
+        return "Timeout'd.\n";
+
+    case EPROTO:
+        return "Bad request.\n";
+
+    case ENOBUFS:
+        return ADMISSION_ERROR;
+
+    default:
+        return NULL;
+    }
 }
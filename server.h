@@ -13,12 +13,22 @@
 
 #pragma once
 
+#ifndef COSMOPOLITAN
+#include <sys/socket.h>  /* for sockaddr_storage */
+#endif
+
 #include "feuille.h"
+#include "paste.h"
+
+/* how long accepting stops when no file descriptor is left, unless a connection is closed first (milliseconds) */
+#define ACCEPT_PAUSE 1000
 
-int      initialize_server();
+int      set_reuse_port(int);
+int      initialize_server(char *, unsigned short);
 
-int      accept_connection(int);
+int      accept_connection(int, struct sockaddr_storage *);
 void     close_connection(int);
 
-unsigned long   read_paste(int, char **);
-int             send_response(int, char *);
+unsigned long   read_paste(int, Paste *);
+int             send_response(int, Paste *, char *);
+char           *read_error_response(int);
@@ -0,0 +1,165 @@
+/*
+ * table.c
+ *  Table of IDs shared by all workers, used by the index of used IDs
+ *  and by the index of the packs.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "table.h"
+
+#ifndef COSMOPOLITAN
+#include <stdio.h>     /* for NULL                                    */
+#include <string.h>    /* for strlen                                  */
+#endif
+
+#include "util.h"      /* for hash_bytes, shared_alloc, HASH_INIT     */
+
+/* a false positive only means that another ID gets generated */
+#define SLOT_EMPTY    0
+#define SLOT_DELETED  1
+
+/* give up after that many slots, and let the caller check the disk instead */
+#define MAX_PROBES    64
+
+/**
+ * Compute the fingerprint of an ID (FNV-1a).
+ *   id: the ID in question.
+ * -> the fingerprint, never SLOT_EMPTY nor SLOT_DELETED.
+ */
+uint64_t table_fingerprint(char *id)
+{
+    uint64_t hash = hash_bytes(HASH_INIT, id, strlen(id));
+
+    return hash > SLOT_DELETED ? hash : hash + 2;
+}
+
+/**
+ * Create a table, before any worker is forked.
+ *   table: the table in question.
+ *   size: the number of IDs the table should hold.
+ * -> 0 if done, -1 if not.
+ */
+int table_initialize(Table *table, unsigned long size)
+{
+    /* round up to a power of two, twice as large to keep probe sequences short */
+    unsigned long capacity = 1;
+    while (capacity < size * 2)
+        capacity <<= 1;
+
+    if ((table->slots = shared_alloc(capacity * sizeof(uint64_t))) == NULL)
+        return -1;
+
+    table->mask = capacity - 1;
+
+    return 0;
+}
+
+/**
+ * Find the slot of an ID.
+ *   table: the table in question.
+ *   hash: the fingerprint of the ID.
+ * -> the index of the slot, or -1 if the ID isn't in the table.
+ */
+long table_find(Table *table, uint64_t hash)
+{
+    for (unsigned long i = 0; i < MAX_PROBES; i++) {
+        unsigned long slot    = (hash + i) & table->mask;
+        uint64_t      current = __atomic_load_n(&table->slots[slot], __ATOMIC_ACQUIRE);
+
+        if (current == hash)
+            return slot;
+
+        if (current == SLOT_EMPTY)
+            return -1;
+    }
+
+    return -1;
+}
+
+/**
+ * Atomically claim an ID, so that no other worker can use it.
+ *   table: the table in question.
+ *   hash: the fingerprint of the ID.
+ *   found: where to store the index of its slot, whether it's claimed or already used (can be NULL).
+ * -> 1 if the ID has been claimed, 0 if it's already used, -1 if the table can't tell.
+ */
+int table_claim(Table *table, uint64_t hash, unsigned long *found)
+{
+    for (;;) {
+        /* the ID is only absent once its whole probe sequence has been seen */
+        long      target   = -1;
+        uint64_t  expected = SLOT_EMPTY;
+
+        for (unsigned long i = 0; i < MAX_PROBES; i++) {
+            unsigned long slot    = (hash + i) & table->mask;
+            uint64_t      current = __atomic_load_n(&table->slots[slot], __ATOMIC_SEQ_CST);
+
+            if (current == hash) {
+                if (found != NULL)
+                    *found = slot;
+
+                return 0;
+            }
+
+            /* the first deleted slot is reused, the rest of the sequence is still checked */
+            if (current <= SLOT_DELETED && target == -1) {
+                target   = slot;
+                expected = current;
+            }
+
+            if (current == SLOT_EMPTY)
+                break;
+        }
+
+        if (target == -1)
+            return -1;
+
+        /* another worker has taken the slot in the meantime: look again */
+        if (!__atomic_compare_exchange_n(&table->slots[target], &expected, hash, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            continue;
+
+        /* two workers can claim the same ID in two different slots: at least one of them sees the other, and gives up */
+        for (unsigned long i = 0; i < MAX_PROBES; i++) {
+            unsigned long slot    = (hash + i) & table->mask;
+            uint64_t      current = __atomic_load_n(&table->slots[slot], __ATOMIC_SEQ_CST);
+
+            if (current == SLOT_EMPTY)
+                break;
+
+            if (slot != (unsigned long)target && current == hash) {
+                __atomic_store_n(&table->slots[target], SLOT_DELETED, __ATOMIC_SEQ_CST);
+
+                if (found != NULL)
+                    *found = slot;
+
+                return 0;
+            }
+        }
+
+        if (found != NULL)
+            *found = target;
+
+        return 1;
+    }
+}
+
+/**
+ * Release an ID, so that its slot can be claimed again.
+ *   table: the table in question.
+ *   hash: the fingerprint of the ID.
+ */
+void table_release(Table *table, uint64_t hash)
+{
+    long slot;
+    if ((slot = table_find(table, hash)) != -1)
+        __atomic_store_n(&table->slots[slot], SLOT_DELETED, __ATOMIC_RELEASE);
+}
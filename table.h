@@ -0,0 +1,33 @@
+/*
+ * table.h
+ *  table.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#ifndef COSMOPOLITAN
+#include <stdint.h>    /* for uint64_t */
+#endif
+
+#include "feuille.h"
+
+/* an open-addressing hash table of IDs, stored as 64-bit fingerprints */
+typedef struct Table {
+    uint64_t        *slots;
+    unsigned long    mask;
+} Table;
+
+uint64_t     table_fingerprint(char *);
+
+int          table_initialize(Table *, unsigned long);
+long         table_find(Table *, uint64_t);
+int          table_claim(Table *, uint64_t, unsigned long *);
+void         table_release(Table *, uint64_t);
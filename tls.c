@@ -0,0 +1,255 @@
+/*
+ * tls.c
+ *  TLS on the listening sockets: the handshake is done with OpenSSL,
+ *  then the keys are handed to the kernel (kTLS), so that connections
+ *  are used as is afterwards (sendfile and splice included).
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "tls.h"
+
+#ifdef HAVE_TLS
+
+#include <errno.h>         /* for errno, EAGAIN, ENOMEM, ENOTCONN, ENOTSUP...  */
+#include <linux/tls.h>     /* for TLS_GET_RECORD_TYPE, TLS_SET_RECORD_TYPE     */
+#include <netinet/in.h>    /* for IPPROTO_TCP, AF_INET                         */
+#include <netinet/tcp.h>   /* for TCP_ULP                                      */
+#include <openssl/err.h>   /* for ERR_get_error, ERR_clear_error, ERR_reas...  */
+#include <openssl/ssl.h>   /* for SSL_*, SSL_CTX_*, BIO_get_ktls_*             */
+#include <stdio.h>         /* for NULL                                         */
+#include <string.h>        /* for strcmp                                       */
+#include <sys/socket.h>    /* for socket, setsockopt, recvmsg, sendmsg, msg... */
+#include <sys/uio.h>       /* for iovec                                        */
+#include <unistd.h>        /* for close                                        */
+
+#include "feuille.h"       /* for Settings, settings                           */
+#include "util.h"          /* for verbose, error                               */
+
+/* content type of the records of alerts (RFC 8446) */
+#define RECORD_ALERT    21
+
+/* ciphers of TLS 1.2 the kernel can take over (those of TLS 1.3 all can) */
+#define CIPHERS         "ECDHE+AESGCM:ECDHE+CHACHA20"
+
+static SSL_CTX *context = NULL;
+
+/**
+ * Load the certificate and its key, before the chroot. The workers keep them in memory.
+ * -> 0 if done, -1 if not (see tls_error).
+ */
+int tls_initialize(void)
+{
+    if ((context = SSL_CTX_new(TLS_server_method())) == NULL)
+        return -1;
+
+    /* the symmetric crypto is done by the kernel, once the handshake is over */
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+    /* the receiving keys of TLS 1.3 are only handed to the kernel since OpenSSL 3.2 */
+    SSL_CTX_set_max_proto_version(context, TLS1_2_VERSION);
+#endif
+
+    /* every worker is on its own: no session to resume, and no ticket to send after the handshake */
+    SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_num_tickets(context, 0);
+
+    if (SSL_CTX_set_cipher_list(context, CIPHERS) != 1)
+        return -1;
+
+    char *key = settings.key != NULL ? settings.key : settings.certificate;
+
+    if (SSL_CTX_use_certificate_chain_file(context, settings.certificate) != 1
+     || SSL_CTX_use_PrivateKey_file(context, key, SSL_FILETYPE_PEM) != 1
+     || SSL_CTX_check_private_key(context) != 1)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Check that the kernel can take over connections, before any is accepted.
+ * -> 0 if it can, -1 if not.
+ */
+int tls_probe(void)
+{
+#ifdef OPENSSL_NO_KTLS
+    errno = ENOTSUP;
+    return -1;
+#else
+    int probe;
+    if ((probe = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+
+    /* the module is loaded on demand, then an unconnected socket is turned away (ENOTCONN) */
+    int status = setsockopt(probe, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+    int saved  = errno;
+
+    close(probe);
+
+    if (status == 0 || saved == ENOTCONN)
+        return 0;
+
+    errno = saved;
+    return -1;
+#endif
+}
+
+/**
+ * Get what went wrong in OpenSSL.
+ * -> a description of the last error. Not to be freed.
+ */
+char *tls_error(void)
+{
+    unsigned long code = ERR_get_error();
+    const char   *reason;
+
+    if (code == 0 || (reason = ERR_reason_error_string(code)) == NULL)
+        return "unknown error";
+
+    return (char *)reason;
+}
+
+/**
+ * Go on with the handshake of a connection, as far as its socket allows.
+ *   tls: the handshake in question (NULL for a new connection, NULL again once it's over).
+ *   socket: the socket associated with the connection.
+ * -> 0 if done (the kernel has the keys), TLS_WANT_READ or TLS_WANT_WRITE if it's waiting for the socket, -1 if it failed.
+ */
+int tls_handshake(Tls **tls, int socket)
+{
+    if (*tls == NULL && ((*tls = SSL_new(context)) == NULL || SSL_set_fd(*tls, socket) != 1)) {
+        tls_free(tls);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ERR_clear_error();
+
+    int status;
+    if ((status = SSL_accept(*tls)) != 1) {
+        switch (SSL_get_error(*tls, status)) {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+        }
+
+        verbose(2, "TLS handshake failed: %s", tls_error());
+
+        tls_free(tls);
+        errno = EPROTO;
+        return -1;
+    }
+
+    /* OpenSSL falls back to doing the crypto itself when the kernel can't */
+#ifdef OPENSSL_NO_KTLS
+    int offloaded = 0;
+#else
+    int offloaded = BIO_get_ktls_send(SSL_get_wbio(*tls)) && BIO_get_ktls_recv(SSL_get_rbio(*tls));
+#endif
+
+    /* the socket stays open, and nothing is sent */
+    tls_free(tls);
+
+    if (!offloaded) {
+        error("kernel TLS is unavailable for this connection (is the `tls' module loaded?).");
+
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Do the handshake of a connection whose socket is blocking (the timeout of the socket bounds it).
+ *   socket: the socket associated with the connection.
+ * -> 0 if done, -1 if not.
+ */
+int tls_accept(int socket)
+{
+    Tls *tls = NULL;
+
+    int status;
+    if ((status = tls_handshake(&tls, socket)) <= 0)
+        return status;
+
+    /* a blocking socket only stops waiting on its timeout */
+    tls_free(&tls);
+    errno = EAGAIN;
+    return -1;
+}
+
+/**
+ * Free a handshake.
+ *   tls: the handshake in question (can be NULL).
+ */
+void tls_free(Tls **tls)
+{
+    SSL_free(*tls);
+    *tls = NULL;
+}
+
+/**
+ * Check whether the next record of a connection is an alert, like the one clients send before closing.
+ * It can't be received as data: receiving fails instead.
+ *   socket: the socket associated with the connection.
+ * -> 1 if it is, 0 if not.
+ */
+int tls_closing(int socket)
+{
+    char            data[2];
+    char            control[CMSG_SPACE(sizeof(unsigned char))];
+    struct iovec    iov = { .iov_base = data, .iov_len = sizeof(data) };
+    struct msghdr   msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+
+    if (recvmsg(socket, &msg, MSG_PEEK | MSG_DONTWAIT) < 0)
+        return 0;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    return cmsg != NULL && cmsg->cmsg_level == SOL_TLS && cmsg->cmsg_type == TLS_GET_RECORD_TYPE
+        && *CMSG_DATA(cmsg) == RECORD_ALERT;
+}
+
+/**
+ * Tell the client that the connection is closed on purpose (with a close_notify alert), if it's been handed to the kernel.
+ *   socket: the socket associated with the connection.
+ */
+void tls_notify(int socket)
+{
+    char      ulp[16] = { 0 };
+    socklen_t size    = sizeof(ulp) - 1;
+
+    if (getsockopt(socket, IPPROTO_TCP, TCP_ULP, ulp, &size) != 0 || strcmp(ulp, "tls") != 0)
+        return;
+
+    /* level warning, description close_notify */
+    char            alert[2] = { 1, 0 };
+    char            control[CMSG_SPACE(sizeof(unsigned char))] = { 0 };
+    struct iovec    iov = { .iov_base = alert, .iov_len = sizeof(alert) };
+    struct msghdr   msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level   = SOL_TLS;
+    cmsg->cmsg_type    = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len     = CMSG_LEN(sizeof(unsigned char));
+    *CMSG_DATA(cmsg)   = RECORD_ALERT;
+
+    sendmsg(socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+#endif
@@ -0,0 +1,39 @@
+/*
+ * tls.h
+ *  tls.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+/* TLS is enabled in config.mk */
+#ifdef HAVE_TLS
+
+/* what a handshake is waiting for */
+#define TLS_WANT_READ   1
+#define TLS_WANT_WRITE  2
+
+/* a handshake in progress */
+typedef struct ssl_st Tls;
+
+int      tls_initialize(void);
+int      tls_probe(void);
+char    *tls_error(void);
+
+int      tls_handshake(Tls **, int);
+int      tls_accept(int);
+void     tls_free(Tls **);
+
+int      tls_closing(int);
+void     tls_notify(int);
+
+#endif
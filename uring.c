@@ -0,0 +1,989 @@
+/*
+ * uring.c
+ *  io_uring connection engine.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>         /* for errno, ECANCELED, EFBIG, EIO, ENOBUFS, ET... */
+#include <stdlib.h>        /* for calloc, free, malloc                         */
+#include <poll.h>          /* for POLLIN                                       */
+#include <string.h>        /* for memset, strdup, strerror, strlen             */
+#include <sys/mman.h>      /* for mmap, MAP_SHARED, MAP_POPULATE               */
+#include <sys/resource.h>  /* for getrlimit, setrlimit, RLIMIT_NOFILE          */
+#include <sys/socket.h>    /* for MSG_NOSIGNAL, SHUT_RDWR, SOCK_CLOEXEC        */
+#include <sys/syscall.h>   /* for SYS_io_uring_setup, SYS_io_uring_enter...    */
+#include <unistd.h>        /* for close, getpid, syscall                       */
+
+#include "admission.h"     /* for admission_enter, admission_leave, admiss... */
+#include "batch.h"         /* for batch_done, batch_idle, batch_over, batc... */
+#include "bin.h"           /* for remove_paste, store_paste, WRITE_ERROR       */
+#include "durability.h"    /* for durability_start, durability_end             */
+#include "feuille.h"       /* for Settings, settings                           */
+#include "limit.h"         /* for limit_client, limit_admit, limit_charge, ... */
+#include "metrics.h"       /* for metrics_count, metrics_error, metrics_now... */
+#include "index.h"         /* for index_release                                */
+#include "paste.h"         /* for Paste, paste_open, paste_append, paste_cl... */
+#include "post.h"          /* for post_response, post_continue, post_done      */
+#include "server.h"        /* for close_connection, read_error_response, ...   */
+#include "util.h"          /* for verbose, error, die, monotonic_time          */
+
+/* number of entries of the submission queue (the completion queue is 4 times larger) */
+#define RING_ENTRIES  1024
+
+/* buffers provided to the kernel for receiving, shared by all the connections of a worker */
+#define BUFFER_COUNT  256
+#define BUFFER_SIZE   16384
+#define BUFFER_GROUP  0
+
+/* a single write can't be larger than that */
+#define MAX_WRITE     (1UL << 30)
+
+/* what a completion is about, stored in the low bits of its user data */
+enum Operation {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_WRITE,
+    OP_SEND,
+    OP_SHUTDOWN,
+    OP_CLOSE,
+    OP_COMMIT,
+    OP_IGNORE
+};
+
+#define OP_MASK 7UL
+
+/* connection states */
+enum State {
+    STATE_READING,
+    STATE_COMMITTING,
+    STATE_WRITING,
+    STATE_CLOSING
+};
+
+/* a connection handled by the ring */
+typedef struct Connection {
+    int                 socket;
+    enum State          state;
+    int                 inflight;    /* operations that haven't completed yet       */
+
+    char                timed_out;
+    char                writing;     /* the paste is being written to disk          */
+    char                cancelled;   /* the response was cancelled by a failed write */
+
+    Paste               paste;
+
+    char               *response;
+    unsigned long       size;        /* bytes to send */
+    unsigned long       sent;
+
+    long long           deadline;    /* milliseconds, monotonic clock               */
+
+    long long           accepted;    /* microseconds, see metrics_now               */
+    long long           responding;
+
+    uint64_t            client;      /* see limit_client                            */
+
+    struct Connection  *prev;
+    struct Connection  *next;
+} Connection;
+
+/* the ring of a worker, shared with the kernel */
+typedef struct Ring {
+    int                    fd;
+    unsigned int           entries;
+
+    unsigned int          *sq_head;
+    unsigned int          *sq_tail;
+    unsigned int          *sq_mask;
+    unsigned int          *sq_array;
+    struct io_uring_sqe   *sqes;
+
+    unsigned int          *cq_head;
+    unsigned int          *cq_tail;
+    unsigned int          *cq_mask;
+    struct io_uring_cqe   *cqes;
+
+    unsigned int           tail;     /* entries prepared          */
+    unsigned int           queued;   /* entries not submitted yet */
+} Ring;
+
+static Ring        ring;
+static char       *buffers   = NULL;
+static int         multishot = 1;
+
+/* connections, sorted by deadline (the timeout is the same for all of them) */
+static Connection *timers_head = NULL;
+static Connection *timers_tail = NULL;
+
+/* connections waiting for their paste to be committed (linked with next, out of the timer list) */
+static Connection *commits     = NULL;
+
+/* ... and those whose commit is in progress, in the background */
+static Connection *syncing     = NULL;
+
+/* when accepting stopped for lack of file descriptors (in milliseconds, 0 while it goes on) */
+static long long   paused      = 0;
+
+/* functions declarations */
+static  void        timer_remove(Connection *);
+static  void        timer_append(Connection *);
+
+static  int         ring_is_supported(int);
+static  int         ring_setup(void);
+static  struct io_uring_sqe *ring_sqe(void);
+static  int         ring_enter(int);
+
+static  void        submit_accept(int);
+static  void        submit_provide(unsigned int, unsigned int);
+static  void        submit_recv(Connection *);
+static  void        submit_write(Connection *);
+static  void        submit_send(Connection *);
+static  void        submit_cancel(Connection *, enum Operation);
+static  void        submit_poll(int);
+
+static  void        connection_accepted(int, int, unsigned int);
+static  void        connection_close(Connection *);
+static  void        connection_received(Connection *, int, unsigned int);
+static  void        connection_finish(Connection *, int);
+static  void        connection_commit(void);
+static  void        connection_committed(void);
+static  void        connection_respond(Connection *, char *);
+static  void        connection_written(Connection *, int);
+static  void        connection_sent(Connection *, int);
+
+/**
+ * Remove a connection from the timer list.
+ *   connection: the connection in question.
+ */
+void timer_remove(Connection *connection)
+{
+    if (connection->prev != NULL)
+        connection->prev->next = connection->next;
+    else if (timers_head == connection)
+        timers_head = connection->next;
+
+    if (connection->next != NULL)
+        connection->next->prev = connection->prev;
+    else if (timers_tail == connection)
+        timers_tail = connection->prev;
+
+    connection->prev = NULL;
+    connection->next = NULL;
+}
+
+/**
+ * (Re)arm the timer of a connection, by putting it at the end of the timer list.
+ *   connection: the connection in question.
+ */
+void timer_append(Connection *connection)
+{
+    /* no timeout, no timer */
+    if (settings.timeout == 0)
+        return;
+
+    timer_remove(connection);
+
+    connection->deadline = monotonic_time() / 1000 + settings.timeout * 1000LL;
+    connection->prev     = timers_tail;
+
+    if (timers_tail != NULL)
+        timers_tail->next = connection;
+    else
+        timers_head = connection;
+
+    timers_tail = connection;
+}
+
+/**
+ * Check that the kernel supports every operation used by the engine.
+ *   fd: the file descriptor of the ring.
+ * -> 1 if it does, 0 if not.
+ */
+int ring_is_supported(int fd)
+{
+    static const unsigned char operations[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_WRITE, IORING_OP_PROVIDE_BUFFERS,
+        IORING_OP_ASYNC_CANCEL, IORING_OP_SHUTDOWN, IORING_OP_CLOSE, IORING_OP_POLL_ADD
+    };
+
+    struct io_uring_probe *probe;
+    if ((probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op))) == NULL)
+        return 0;
+
+    int supported = syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for (unsigned long i = 0; supported && i < sizeof(operations); i++)
+        if (operations[i] > probe->last_op || !(probe->ops[operations[i]].flags & IO_URING_OP_SUPPORTED))
+            supported = 0;
+
+    free(probe);
+    return supported;
+}
+
+/**
+ * Create the ring of the worker, and map its queues.
+ * -> 0 if done, -1 if not.
+ */
+int ring_setup(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    params.flags      = IORING_SETUP_CQSIZE;
+    params.cq_entries = RING_ENTRIES * 4;
+
+    int fd;
+    if ((fd = syscall(SYS_io_uring_setup, RING_ENTRIES, &params)) == -1)
+        return -1;
+
+    /* timeouts are given to io_uring_enter directly (Linux 5.11+) */
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !ring_is_supported(fd)) {
+        close(fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    unsigned long sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    unsigned long cq_size = params.cq_off.cqes  + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    /* both queues can share the same mapping */
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+    char *sq, *cq;
+    void *sqes;
+    if ((sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+     && (cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    if ((sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    ring.fd       = fd;
+    ring.entries  = params.sq_entries;
+
+    ring.sq_head  = (unsigned int *)(sq + params.sq_off.head);
+    ring.sq_tail  = (unsigned int *)(sq + params.sq_off.tail);
+    ring.sq_mask  = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring.sqes     = sqes;
+
+    ring.cq_head  = (unsigned int *)(cq + params.cq_off.head);
+    ring.cq_tail  = (unsigned int *)(cq + params.cq_off.tail);
+    ring.cq_mask  = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring.cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    ring.tail     = *ring.sq_tail;
+    ring.queued   = 0;
+
+    return 0;
+}
+
+/**
+ * Get a free submission queue entry, submitting the queued ones if there's none.
+ * -> a pointer to the entry, zeroed.
+ */
+struct io_uring_sqe *ring_sqe(void)
+{
+    while (ring.tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.entries)
+        if (ring_enter(0) == -1 && errno != EINTR && errno != EBUSY)
+            die(errno, "could not submit to io_uring: %s.\n", strerror(errno));
+
+    unsigned int index = ring.tail & *ring.sq_mask;
+
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    ring.sq_array[index] = index;
+    ring.tail++;
+    ring.queued++;
+
+    return sqe;
+}
+
+/**
+ * Submit the queued entries, and wait for a completion if asked to.
+ *   timeout: -1 to wait without timeout, the maximum time to wait in milliseconds, or 0 to only submit.
+ * -> 0 if done, -1 if not (errno is ETIME if the timeout expired).
+ */
+int ring_enter(int timeout)
+{
+    __atomic_store_n(ring.sq_tail, ring.tail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000LL };
+    struct io_uring_getevents_arg arg = { .ts = (unsigned long)&ts };
+
+    unsigned int flags = timeout != 0 ? IORING_ENTER_GETEVENTS : 0;
+    if (timeout > 0)
+        flags |= IORING_ENTER_EXT_ARG;
+
+    long submitted;
+    if ((submitted = syscall(SYS_io_uring_enter, ring.fd, ring.queued, timeout != 0, flags,
+                             timeout > 0 ? &arg : NULL, timeout > 0 ? sizeof(arg) : 0)) == -1)
+        return -1;
+
+    ring.queued -= submitted;
+    return 0;
+}
+
+/**
+ * Accept incoming connections (all of them with a single request, if the kernel supports it).
+ *   server: the server socket.
+ */
+void submit_accept(int server)
+{
+    struct io_uring_sqe *sqe = ring_sqe();
+
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = server;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio       = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data    = OP_ACCEPT;
+}
+
+/**
+ * Give receive buffers (back) to the kernel.
+ *   id: the ID of the first buffer.
+ *   count: the number of buffers.
+ */
+void submit_provide(unsigned int id, unsigned int count)
+{
+    struct io_uring_sqe *sqe = ring_sqe();
+
+    sqe->opcode    = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd        = count;
+    sqe->addr      = (unsigned long)(buffers + id * BUFFER_SIZE);
+    sqe->len       = BUFFER_SIZE;
+    sqe->off       = id;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = OP_IGNORE;
+}
+
+/**
+ * Receive data on a connection, in one of the provided buffers.
+ *   connection: the connection in question.
+ */
+void submit_recv(Connection *connection)
+{
+    struct io_uring_sqe *sqe = ring_sqe();
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = connection->socket;
+    sqe->len       = BUFFER_SIZE;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = (unsigned long)connection | OP_RECV;
+
+    connection->inflight++;
+}
+
+/**
+ * Write the paste of a connection to its file. The response is only sent if it succeeds.
+ *   connection: the connection in question.
+ */
+void submit_write(Connection *connection)
+{
+    struct io_uring_sqe *sqe = ring_sqe();
+
+    sqe->opcode    = IORING_OP_WRITE;
+    sqe->fd        = connection->paste.output;
+    sqe->addr      = (unsigned long)connection->paste.buffer;
+    sqe->len       = connection->paste.size;
+    sqe->off       = 0;
+    sqe->flags     = IOSQE_IO_LINK;
+    sqe->user_data = (unsigned long)connection | OP_WRITE;
+
+    connection->inflight++;
+    connection->writing = 1;
+}
+
+/**
+ * Send the rest of the response of a connection.
+ *   connection: the connection in question.
+ */
+void submit_send(Connection *connection)
+{
+    struct io_uring_sqe *sqe = ring_sqe();
+
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = connection->socket;
+    sqe->addr      = (unsigned long)(connection->response + connection->sent);
+    sqe->len       = connection->size - connection->sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long)connection | OP_SEND;
+
+    connection->inflight++;
+}
+
+/**
+ * Cancel an operation of a connection.
+ *   connection: the connection in question.
+ *   operation: the operation in question.
+ */
+void submit_cancel(Connection *connection, enum Operation operation)
+{
+    struct io_uring_sqe *sqe = ring_sqe();
+
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->fd        = -1;
+    sqe->addr      = (unsigned long)connection | operation;
+    sqe->user_data = OP_IGNORE;
+}
+
+/**
+ * Wait for the background commit to be done.
+ *   file: the file descriptor given by durability_start.
+ */
+void submit_poll(int file)
+{
+    struct io_uring_sqe *sqe = ring_sqe();
+
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = file;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data     = OP_COMMIT;
+}
+
+/**
+ * Start handling a new connection.
+ *   server: the server socket.
+ *   result: the result of the accept request (the socket, or a negative error number).
+ *   flags: the flags of the completion.
+ */
+void connection_accepted(int server, int result, unsigned int flags)
+{
+    /* the accept request has ended: make a new one */
+    if (!(flags & IORING_CQE_F_MORE)) {
+        /* multishot accept appeared in Linux 5.19 */
+        if (result == -EINVAL && multishot) {
+            verbose(1, "multishot accept isn't supported, accepting connections one by one.");
+            multishot = 0;
+        }
+
+        /* no file descriptor left: a new request would fail again and again, until a connection is closed */
+        if (result == -EMFILE || result == -ENFILE) {
+            error("no file descriptor left, accepting connections again once one is closed.");
+            paused = monotonic_time() / 1000;
+            return;
+        }
+
+        submit_accept(server);
+    }
+
+    if (result < 0) {
+        if (result != -EINVAL)
+            error("error while accepting incoming connection: %s", strerror(-result));
+
+        return;
+    }
+
+    /* turn away clients over their limits, before anything is allocated for them */
+    /* (multishot accepts can't return the address of the client) */
+    uint64_t client = 0;
+
+    struct sockaddr_storage address;
+    socklen_t               address_size = sizeof(address);
+
+    if (settings.request_rate > 0 || settings.byte_rate > 0) {
+        if (getpeername(result, (struct sockaddr *)&address, &address_size) == 0)
+            client = limit_client((struct sockaddr *)&address);
+
+        if (!limit_admit(client)) {
+            limit_reject(result);
+            close_connection(result);
+            return;
+        }
+    }
+
+    /* shed load when feuille can't keep up */
+    if (!admission_enter()) {
+        admission_reject(result);
+        close_connection(result);
+        return;
+    }
+
+    verbose(1, "--- new incoming connection. connection ID: %d:%d ---", getpid(), result);
+
+    Connection *connection;
+    if ((connection = calloc(1, sizeof(Connection))) == NULL) {
+        error("could not allocate a new connection.");
+        close_connection(result);
+        admission_leave();
+        return;
+    }
+
+    connection->socket   = result;
+    connection->state    = STATE_READING;
+    connection->accepted = metrics_now();
+    connection->client   = client;
+
+    metrics_count(COUNTER_CONNECTIONS, 1);
+
+    if (paste_open(&connection->paste) != 0) {
+        error("error while preparing to receive a paste: %s", strerror(errno));
+        close_connection(result);
+        free(connection);
+        admission_leave();
+        return;
+    }
+
+    /* pastes that don't need to be synced (nor compressed, nor packed) are written to disk along with the response */
+    connection->paste.deferred = settings.durability == DURABILITY_NONE && settings.compression == COMPRESSION_NONE
+                              && settings.storage == STORAGE_FILES && settings.max_size < MAX_WRITE;
+
+    submit_recv(connection);
+    timer_append(connection);
+}
+
+/**
+ * Close a connection. Everything associated with it is freed once its operations have completed.
+ *   connection: the connection in question.
+ */
+void connection_close(Connection *connection)
+{
+    connection->state = STATE_CLOSING;
+    timer_remove(connection);
+
+    /* the socket is closed even if shutting it down fails */
+    struct io_uring_sqe *sqe = ring_sqe();
+
+    sqe->opcode    = IORING_OP_SHUTDOWN;
+    sqe->fd        = connection->socket;
+    sqe->len       = SHUT_RDWR;
+    sqe->flags     = IOSQE_IO_HARDLINK;
+    sqe->user_data = (unsigned long)connection | OP_SHUTDOWN;
+
+    sqe = ring_sqe();
+
+    sqe->opcode    = IORING_OP_CLOSE;
+    sqe->fd        = connection->socket;
+    sqe->user_data = (unsigned long)connection | OP_CLOSE;
+
+    connection->inflight += 2;
+}
+
+/**
+ * Handle data received on a connection.
+ *   connection: the connection in question.
+ *   result: the result of the receive request (the number of bytes received, or a negative error number).
+ *   flags: the flags of the completion.
+ */
+void connection_received(Connection *connection, int result, unsigned int flags)
+{
+    int status = 0;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned int id = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (result > 0)
+            status = paste_append(&connection->paste, buffers + id * BUFFER_SIZE, result);
+
+        /* the data has been copied, the buffer can be used again */
+        submit_provide(id, 1);
+    }
+
+    if (status != 0) {
+        /* too big, rejected HTTP upload, or over the memory budget: the client is told so */
+        if (errno == EFBIG || errno == EPROTO || errno == ENOBUFS) {
+            int error_code = errno;
+            limit_charge(connection->client, &connection->paste);
+
+            error("error %d while reading paste from incoming connection.", error_code);
+            metrics_error(error_code);
+
+            connection_respond(connection, read_error_response(error_code));
+            return;
+        }
+
+        error("error while reading paste from connection %d: %s", connection->socket, strerror(errno));
+        connection_close(connection);
+        return;
+    }
+
+    /* every buffer is in use: try again */
+    if (result == -ENOBUFS && !connection->timed_out) {
+        submit_recv(connection);
+        return;
+    }
+
+    if (result > 0 && post_continue(&connection->paste, connection->socket) != 0) {
+        error("error while reading paste from connection %d: %s", connection->socket, strerror(errno));
+        connection_close(connection);
+        return;
+    }
+
+    /* a timeout ends the paste, like in the other engines (the receive request is cancelled) */
+    /* so does the end of the body of an HTTP upload, or of a batch */
+    if (result == 0 || connection->timed_out || post_done(&connection->paste) || batch_done(&connection->paste)) {
+        verbose(1, "done reading paste from connection %d.", connection->socket);
+        connection_finish(connection, connection->timed_out);
+        return;
+    }
+
+    if (result < 0) {
+        error("error while reading paste from connection %d: %s", connection->socket, strerror(-result));
+        connection_close(connection);
+        return;
+    }
+
+    submit_recv(connection);
+    timer_append(connection);
+}
+
+/**
+ * Store the paste received on a connection and respond to the client.
+ *   connection: the connection in question.
+ *   timed_out: whether the connection timed out.
+ */
+void connection_finish(Connection *connection, int timed_out)
+{
+    /* a persistent connection ending between two pastes has nothing left to answer */
+    if (batch_over(&connection->paste)) {
+        connection_close(connection);
+        return;
+    }
+
+    limit_charge(connection->client, &connection->paste);
+
+    if (paste_finish(&connection->paste) != 0) {
+        int error_code = errno == ENOENT && timed_out ? EAGAIN : errno;
+
+        error("error %d while reading paste from incoming connection.", error_code);
+        metrics_error(error_code);
+
+        connection_respond(connection, read_error_response(error_code));
+        return;
+    }
+
+    metrics_time(PHASE_RECEIVE, connection->accepted);
+
+    /* store paste (or only create its file, if it's deferred) and send its URL */
+    char *response;
+    if ((response = store_paste(&connection->paste)) == NULL) {
+        connection_close(connection);
+        return;
+    }
+
+    /* the URL is only sent once the paste is safe on disk, along with the other pastes of this round */
+    if (settings.durability != DURABILITY_NONE) {
+        timer_remove(connection);
+
+        connection->state    = STATE_COMMITTING;
+        connection->response = response;
+        connection->next     = commits;
+        commits              = connection;
+        return;
+    }
+
+    connection_respond(connection, response);
+    free(response);
+}
+
+/**
+ * Start committing the pastes stored during this round at once, without blocking the loop.
+ */
+void connection_commit(void)
+{
+    syncing = commits;
+    commits = NULL;
+
+    int done;
+    if ((done = durability_start()) == -1) {
+        connection_committed();
+        return;
+    }
+
+    submit_poll(done);
+}
+
+/**
+ * Respond to the clients whose pastes have been committed.
+ */
+void connection_committed(void)
+{
+    int status;
+    if ((status = durability_end()) != 0)
+        error("error while committing pastes to disk: %s", strerror(errno));
+
+    while (syncing != NULL) {
+        Connection *connection = syncing;
+        char       *response   = connection->response;
+
+        syncing                = connection->next;
+        connection->next       = NULL;
+        connection->response   = NULL;
+
+        connection_respond(connection, status == 0 ? response : WRITE_ERROR);
+        free(response);
+    }
+}
+
+/**
+ * Start sending a response to the client, right after writing the paste to disk if it's deferred.
+ *   connection: the connection in question.
+ *   response: the string to be sent. Copied.
+ */
+void connection_respond(Connection *connection, char *response)
+{
+    if ((connection->response = post_response(&connection->paste, response)) == NULL) {
+        connection_close(connection);
+        return;
+    }
+
+    connection->state      = STATE_WRITING;
+    connection->size       = strlen(connection->response);
+    connection->sent       = 0;
+    connection->responding = metrics_now();
+
+    verbose(1, "sending the response to the client...");
+
+    /* the paste is written and its URL sent without getting back to userspace in between */
+    /* (or kept, if the connection is persistent) */
+    if (connection->paste.output != -1)
+        submit_write(connection);
+    else if (!batch_next(&connection->paste))
+        paste_close(&connection->paste);
+
+    submit_send(connection);
+    timer_append(connection);
+}
+
+/**
+ * Handle the end of the write of a paste.
+ *   connection: the connection in question.
+ *   result: the result of the write request (the number of bytes written, or a negative error number).
+ */
+void connection_written(Connection *connection, int result)
+{
+    connection->writing = 0;
+
+    /* a short write cancels the response too */
+    if (result != (long)connection->paste.size) {
+        error("error while writing paste `%s' to disk: %s", connection->paste.id,
+              strerror(result < 0 ? -result : EIO));
+
+        remove_paste(connection->paste.id);
+        index_release(connection->paste.id);
+
+        metrics_count(COUNTER_WRITE_ERRORS, 1);
+
+        free(connection->response);
+        connection->response = post_response(&connection->paste, WRITE_ERROR);
+        connection->size     = connection->response != NULL ? strlen(connection->response) : 0;
+        connection->sent     = 0;
+
+        /* send the error instead, if the response has already been cancelled */
+        if (connection->cancelled && connection->state == STATE_WRITING) {
+            connection->cancelled = 0;
+
+            if (connection->response != NULL)
+                submit_send(connection);
+            else
+                connection_close(connection);
+        }
+    }
+
+    /* the paste isn't needed anymore */
+    paste_close(&connection->paste);
+}
+
+/**
+ * Handle the end of a send request.
+ *   connection: the connection in question.
+ *   result: the result of the send request (the number of bytes sent, or a negative error number).
+ */
+void connection_sent(Connection *connection, int result)
+{
+    /* cancelled along with a failed write: the error is sent instead */
+    if (result == -ECANCELED && !connection->timed_out) {
+        if (connection->writing)
+            connection->cancelled = 1;
+        else if (connection->response != NULL)
+            submit_send(connection);
+        else
+            connection_close(connection);
+
+        return;
+    }
+
+    if (result < 0) {
+        connection_close(connection);
+        return;
+    }
+
+    connection->sent += result;
+
+    if (connection->sent < connection->size) {
+        submit_send(connection);
+        timer_append(connection);
+        return;
+    }
+
+    verbose(1, "All done.");
+
+    metrics_time(PHASE_RESPOND, connection->responding);
+    metrics_time(PHASE_TOTAL, connection->accepted);
+
+    /* the paste has been kept by connection_respond: the connection is persistent */
+    if (connection->paste.batch != NULL && !connection->timed_out) {
+        free(connection->response);
+
+        connection->state    = STATE_READING;
+        connection->response = NULL;
+        connection->accepted = metrics_now();
+
+        submit_recv(connection);
+        timer_append(connection);
+        return;
+    }
+
+    connection_close(connection);
+}
+
+/**
+ * Feuille's io_uring loop.
+ * Like the epoll engine, every connection is a state machine, but every
+ * step (accept, receive, write, send, close) is a request to the kernel,
+ * and the requests of a whole round are submitted with a single syscall.
+ *   server: the server socket.
+ * -> -1 if io_uring isn't available (errno is set). Doesn't return otherwise.
+ */
+int uring_loop(int server)
+{
+    if (ring_setup() != 0)
+        return -1;
+
+    /* connections are only limited by the number of file descriptors */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if ((buffers = malloc(BUFFER_COUNT * BUFFER_SIZE)) == NULL)
+        die(errno, "could not allocate receive buffers: %s.\n", strerror(errno));
+
+    submit_provide(0, BUFFER_COUNT);
+    submit_accept(server);
+
+    for (;;) {
+        /* wait until a request completes or the oldest connection times out */
+        int timeout = -1;
+        if (timers_head != NULL) {
+            long long remaining = timers_head->deadline - monotonic_time() / 1000;
+            timeout = remaining > 0 ? remaining : 1;
+        }
+
+        /* the file descriptors may also be used up by other processes: accepting is tried again anyway */
+        if (paused != 0 && (timeout == -1 || timeout > ACCEPT_PAUSE))
+            timeout = ACCEPT_PAUSE;
+
+        if (ring_enter(timeout) == -1 && errno != ETIME && errno != EINTR && errno != EBUSY)
+            die(errno, "io_uring_enter failed: %s.\n", strerror(errno));
+
+        if (paused != 0 && monotonic_time() / 1000 - paused >= ACCEPT_PAUSE) {
+            submit_accept(server);
+            paused = 0;
+        }
+
+        /* handle completions */
+        unsigned int head;
+        while ((head = *ring.cq_head) != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+            __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+
+            Connection *connection = (Connection *)(unsigned long)(cqe.user_data & ~OP_MASK);
+
+            switch (cqe.user_data & OP_MASK) {
+            case OP_ACCEPT:
+                connection_accepted(server, cqe.res, cqe.flags);
+                continue;
+
+            case OP_COMMIT:
+                connection_committed();
+                continue;
+
+            case OP_IGNORE:
+                continue;
+            }
+
+            connection->inflight--;
+
+            switch (cqe.user_data & OP_MASK) {
+            case OP_RECV:
+                connection_received(connection, cqe.res, cqe.flags);
+                break;
+
+            case OP_WRITE:
+                connection_written(connection, cqe.res);
+                break;
+
+            case OP_SEND:
+                connection_sent(connection, cqe.res);
+                break;
+            }
+
+            /* every request of a closed connection has completed */
+            if (connection->state == STATE_CLOSING && connection->inflight == 0) {
+                paste_close(&connection->paste);
+                free(connection->response);
+                free(connection);
+
+                admission_leave();
+
+                /* a file descriptor is free again */
+                if (paused != 0) {
+                    submit_accept(server);
+                    paused = 0;
+                }
+            }
+        }
+
+        /* handle timeouts, by cancelling the pending request of the connections */
+        long long current = monotonic_time() / 1000;
+        while (timers_head != NULL && timers_head->deadline <= current) {
+            Connection *connection = timers_head;
+
+            /* persistent connections wait longer between two pastes */
+            if (connection->state == STATE_READING && batch_idle(&connection->paste)) {
+                timer_append(connection);
+                continue;
+            }
+
+            timer_remove(connection);
+            connection->timed_out = 1;
+
+            submit_cancel(connection, connection->state == STATE_READING ? OP_RECV : OP_SEND);
+        }
+
+        /* a single commit for every paste stored in this round (or since the previous commit began) */
+        if (commits != NULL && syncing == NULL)
+            connection_commit();
+    }
+}
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * uring.h
+ *  uring.c header declarations.
+ *
+ * Copyright (c) 2022
+ *     Tom MTT. <tom@heimdall.pm>
+ *
+ * This file is licensed under the 3-Clause BSD License.
+ * You should have received a copy of the 3-Clause BSD License
+ * along with this program. If not, see
+ * <https://basedwa.re/tmtt/feuille/src/branch/main/LICENSE>.
+ */
+
+#pragma once
+
+#include "feuille.h"
+
+/* io_uring is only available on Linux, with recent enough kernel headers */
+#if defined __linux__ && !defined COSMOPOLITAN && defined __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+
+#ifdef IORING_ACCEPT_MULTISHOT
+#define HAVE_IO_URING
+#endif
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+int      uring_loop(int);
+#endif
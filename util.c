@@ -17,13 +17,16 @@
 
 #ifndef COSMOPOLITAN
 #include <stdarg.h>   /* for va_end, va_list, va_start                     */
-#include <stdio.h>    /* for snprintf, vsnprintf, vfprintf, BUFSIZ, stderr */
+#include <stdio.h>    /* for vsnprintf, vfprintf, BUFSIZ, stderr           */
 #include <stdlib.h>   /* for exit                                          */
+#include <sys/mman.h> /* for mmap, MAP_SHARED, MAP_ANONYMOUS               */
 #include <syslog.h>   /* for syslog, LOG_DEBUG, LOG_ERR                    */
+#include <time.h>     /* for clock_gettime, timespec, CLOCK_MONOTONIC      */
 #include <unistd.h>   /* for getpid                                        */
 #endif
 
 #include "feuille.h"  /* for Settings, settings                            */
+#include "logger.h"   /* for logger_write                                  */
 
 /* reuse that buffer for syslogs */
 char syslog_buffer[BUFSIZ];
@@ -45,7 +48,7 @@ void die(int exit_code, char *string, ...)
 }
 
 /**
- * Send an error message to syslog.
+ * Send an error message to syslog (through the logger, for workers).
  *   string: the string to be displayed. Printf format is supported.
  */
 void error(char *string, ...)
@@ -53,34 +56,77 @@ void error(char *string, ...)
     va_list ap;
     va_start(ap, string);
 
-    /* prepend the PID of the current thread */
-    int length = snprintf(syslog_buffer, sizeof(syslog_buffer), "ERROR[%d]: ", getpid());
-
-    /* send the string to syslog */
-    vsnprintf(syslog_buffer + length, sizeof(syslog_buffer) - length, string, ap);
-    syslog(LOG_ERR, "%s", syslog_buffer);
+    int length = vsnprintf(syslog_buffer, sizeof(syslog_buffer), string, ap);
 
     va_end(ap);
+
+    if (length < 0 || logger_write(0, syslog_buffer, length) == 0)
+        return;
+
+    /* prepend the PID of the current process */
+    syslog(LOG_ERR, "ERROR[%d]: %s", getpid(), syslog_buffer);
 }
 
 /**
- * Send a message to syslog if in verbose mode.
+ * Send a message to syslog (through the logger, for workers). Called by verbose, if in verbose mode.
+ *   level: the verbose level of the message.
  *   string: the string to be displayed. Printf format is supported.
  */
-void verbose(int level, char *string, ...)
+void verbose_log(int level, char *string, ...)
 {
-    if (settings.verbose < level)
-        return;
-
     va_list ap;
     va_start(ap, string);
 
-    /* prepend the PID of the current thread */
-    int length = snprintf(syslog_buffer, sizeof(syslog_buffer), "DEBUG%d[%d]: ", level, getpid());
-
-    /* send the string to syslog */
-    vsnprintf(syslog_buffer + length, sizeof(syslog_buffer) - length, string, ap);
-    syslog(LOG_DEBUG, "%s", syslog_buffer);
+    int length = vsnprintf(syslog_buffer, sizeof(syslog_buffer), string, ap);
 
     va_end(ap);
+
+    if (length < 0 || logger_write(level, syslog_buffer, length) == 0)
+        return;
+
+    /* prepend the PID of the current process */
+    syslog(LOG_DEBUG, "DEBUG%d[%d]: %s", level, getpid(), syslog_buffer);
+}
+
+/**
+ * Hash some bytes (FNV-1a, 64-bit). Can be called repeatedly to hash data as it arrives.
+ *   hash: the current hash, or HASH_INIT.
+ *   data: the bytes to be hashed.
+ *   size: the number of bytes.
+ * -> the new hash.
+ */
+unsigned long long hash_bytes(unsigned long long hash, const char *data, unsigned long size)
+{
+    for (unsigned long i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * Get the current time, for durations and deadlines.
+ * -> the time elapsed since an arbitrary point, in microseconds.
+ */
+long long monotonic_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Allocate zeroed memory shared with every process forked afterwards.
+ *   size: the size of the memory, in bytes.
+ * -> a pointer to the memory, or NULL if an error occured.
+ */
+void *shared_alloc(unsigned long size)
+{
+    void *memory;
+    if ((memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+        return NULL;
+
+    return memory;
 }
@@ -13,6 +13,28 @@
 
 #pragma once
 
+#include "feuille.h"
+
+/* initial value for hash_bytes (FNV-1a 64-bit offset basis) */
+#define HASH_INIT 14695981039346656037ULL
+
+/* most verbose level compiled in (see config.mk), the calls above it cost nothing */
+#ifndef VERBOSE_MAX
+#define VERBOSE_MAX 3
+#endif
+
+/* the arguments aren't even evaluated if the level is disabled */
+#define verbose(level, ...)                                             \
+    do {                                                                \
+        if ((level) <= VERBOSE_MAX && settings.verbose >= (level))      \
+            verbose_log((level), __VA_ARGS__);                          \
+    } while (0)
+
 void     die(int, char *, ...);
 void     error(char *, ...);
-void     verbose(int, char *, ...);
+void     verbose_log(int, char *, ...);
+
+unsigned long long   hash_bytes(unsigned long long, const char *, unsigned long);
+
+long long            monotonic_time(void);
+void                *shared_alloc(unsigned long);